@@ -11,6 +11,10 @@ function dumpe(s)
 end
 
 function worker(conn)
+  if path == "/stats" then
+    return http.stats(conn)
+  end
+
   if string.sub(path, 1, 7) == "/upload" then
     pit.debug(1, "method = " .. method)
     pit.debug(1, "path = " .. path)
@@ -5,6 +5,7 @@
 #include "thread.h"
 #include "media.h"
 #include "pumpkin.h"
+#include "AppRegistry.h"
 #include "secure.h"
 #include "debug.h"
 
@@ -12,7 +13,7 @@
 
 typedef struct {
   int width, height, depth, mono, xfactor, yfactor, rotate;
-  int software, fullscreen, fullrefresh, dia, single;
+  int software, fullscreen, fullrefresh, container, compress, images, journal, watch, recordcache, dia, single;
   char launcher[MAX_STR];
   char driver[MAX_STR];
   window_provider_t *wp;
@@ -98,6 +99,12 @@ static int libos_action(void *arg) {
   }
 
   debug(DEBUG_INFO, PUMPKINOS, "deploying applications");
+  pumpkin_set_container(data->container);
+  pumpkin_set_compress(data->compress);
+  pumpkin_set_images(data->images);
+  if (data->journal >= 0) pumpkin_set_journal(data->journal);
+  if (data->watch >= 0) pumpkin_set_watch(data->watch);
+  if (data->recordcache >= 0) pumpkin_set_record_cache(data->recordcache * 1024);
   pumpkin_deploy_files("/app_install");
   pumpkin_load_plugins();
 
@@ -134,8 +141,8 @@ static int libos_action(void *arg) {
 
 typedef enum {
   PARAM_WIDTH = 1, PARAM_HEIGHT, PARAM_DEPTH, PARAM_XFACTOR, PARAM_YFACTOR, PARAM_ROTATE,
-  PARAM_FULLSCREEN, PARAM_DIA, PARAM_SINGLE, PARAM_SOFTWARE, PARAM_FULLREFRESH,
-  PARAM_DRIVER, PARAM_LAUNCHER
+  PARAM_FULLSCREEN, PARAM_DIA, PARAM_SINGLE, PARAM_SOFTWARE, PARAM_FULLREFRESH, PARAM_CONTAINER,
+  PARAM_COMPRESS, PARAM_IMAGES, PARAM_JOURNAL, PARAM_WATCH, PARAM_RECORDCACHE, PARAM_DRIVER, PARAM_LAUNCHER
 } param_id_t;
 
 typedef struct {
@@ -156,6 +163,12 @@ static param_t params[] = {
   { PARAM_SINGLE,      SCRIPT_ARG_BOOLEAN, "single"      },
   { PARAM_SOFTWARE,    SCRIPT_ARG_BOOLEAN, "software"    },
   { PARAM_FULLREFRESH, SCRIPT_ARG_BOOLEAN, "fullrefresh" },
+  { PARAM_CONTAINER,   SCRIPT_ARG_BOOLEAN, "container"   },
+  { PARAM_COMPRESS,    SCRIPT_ARG_BOOLEAN, "compress"    },
+  { PARAM_IMAGES,      SCRIPT_ARG_BOOLEAN, "images"      },
+  { PARAM_JOURNAL,     SCRIPT_ARG_BOOLEAN, "journal"     },
+  { PARAM_WATCH,       SCRIPT_ARG_BOOLEAN, "watch"       },
+  { PARAM_RECORDCACHE, SCRIPT_ARG_INTEGER, "recordcache" },
   { PARAM_DRIVER,      SCRIPT_ARG_LSTRING, "driver"      },
   { PARAM_LAUNCHER,    SCRIPT_ARG_LSTRING, "launcher"    },
   { 0, 0, NULL }
@@ -171,6 +184,9 @@ static int libos_start(int pe) {
   int i, r = -1;
 
   if ((data = sys_calloc(1, sizeof(libos_t))) != NULL) {
+    data->recordcache = -1;
+    data->journal = -1;
+    data->watch = -1;
     data->wp = script_get_pointer(pe, WINDOW_PROVIDER);
     data->secure = script_get_pointer(pe, SECURE_PROVIDER);
 
@@ -203,6 +219,12 @@ static int libos_start(int pe) {
               case PARAM_SINGLE:      data->single      = v.value.i; break;
               case PARAM_SOFTWARE:    data->software    = v.value.i; break;
               case PARAM_FULLREFRESH: data->fullrefresh = v.value.i; break;
+              case PARAM_CONTAINER:   data->container   = v.value.i; break;
+              case PARAM_COMPRESS:    data->compress    = v.value.i; break;
+              case PARAM_IMAGES:      data->images      = v.value.i; break;
+              case PARAM_JOURNAL:     data->journal     = v.value.i; break;
+              case PARAM_WATCH:       data->watch       = v.value.i; break;
+              case PARAM_RECORDCACHE: data->recordcache = v.value.i; break;
               case PARAM_DRIVER:
                 sys_strncpy(data->driver, v.value.l.s, v.value.l.n < MAX_STR ? v.value.l.n : MAX_STR);
                 break;
@@ -311,12 +333,45 @@ static int libos_serial(int pe) {
   return r;
 }
 
+// engine(creator, name) selects how the 68K code of an app runs, see appEngine* in AppRegistry.h
+static int libos_engine(int pe) {
+  static char *engines[] = { "default", "interpreter", "blocks", "check", NULL };
+  char *screator = NULL;
+  char *name = NULL;
+  UInt32 creator;
+  int len, i, r = -1;
+
+  if (script_get_lstring(pe, 0, &screator, &len) == 0 &&
+      script_get_string(pe,  1, &name) == 0) {
+
+    for (i = 0; engines[i]; i++) {
+      if (!sys_strcmp(name, engines[i])) break;
+    }
+
+    if (len != 4) {
+      debug(DEBUG_ERROR, PUMPKINOS, "invalid creator for engine");
+    } else if (engines[i] == NULL) {
+      debug(DEBUG_ERROR, PUMPKINOS, "invalid engine \"%s\"", name);
+    } else {
+      pumpkin_s2id(&creator, screator);
+      pumpkin_set_engine(creator, appEngineDefault + i);
+      r = script_push_boolean(pe, 1);
+    }
+  }
+
+  if (name) sys_free(name);
+  if (screator) sys_free(screator);
+
+  return r;
+}
+
 int libos_init(int pe, script_ref_t obj) {
   debug(DEBUG_INFO, PUMPKINOS, "libos_init");
 
   script_add_function(pe, obj, "init",   libos_app_init);
   script_add_function(pe, obj, "finish", libos_app_finish);
   script_add_function(pe, obj, "serial", libos_serial);
+  script_add_function(pe, obj, "engine", libos_engine);
   script_add_function(pe, obj, "start",  libos_start);
 
   return 0;
@@ -46,6 +46,9 @@
 #include <sys/syscall.h>
 #include <sys/vfs.h>
 #endif
+#ifdef LINUX
+#include <sys/inotify.h>
+#endif
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -72,6 +75,14 @@ struct sys_dir_t {
 #endif
 };
 
+#define WATCH_BUF 4096
+
+struct sys_watch_t {
+  int fd;
+  int pos, len;
+  uint8_t buf[WATCH_BUF] __attribute__ ((aligned(8)));
+};
+
 #ifndef WINDOWS
 #define closesocket(s) close(s)
 #endif
@@ -545,6 +556,110 @@ int sys_closedir(sys_dir_t *dir) {
   return r;
 }
 
+// Directory change notification. Only inotify is supported, on other systems
+// sys_watch_open fails and callers are expected to fall back to scanning.
+
+sys_watch_t *sys_watch_open(void) {
+#ifdef LINUX
+  sys_watch_t *w;
+
+  if ((w = sys_calloc(1, sizeof(sys_watch_t))) == NULL) {
+    return NULL;
+  }
+
+  if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+    debug_errno("SYS", "inotify_init1");
+    sys_free(w);
+    w = NULL;
+  }
+
+  return w;
+#else
+  return NULL;
+#endif
+}
+
+int sys_watch_add(sys_watch_t *w, const char *pathname, int events) {
+  int r = -1;
+
+#ifdef LINUX
+  uint32_t mask = 0;
+
+  if (w) {
+    if (events & SYS_WATCH_CREATE) mask |= IN_CREATE | IN_MOVED_TO;
+    if (events & SYS_WATCH_DELETE) mask |= IN_DELETE | IN_MOVED_FROM;
+    if (events & SYS_WATCH_WRITE)  mask |= IN_CLOSE_WRITE;
+    if (events & SYS_WATCH_DIR)    mask |= IN_ONLYDIR;
+
+    if ((r = inotify_add_watch(w->fd, pathname, mask)) == -1) {
+      debug_errno("SYS", "inotify_add_watch(\"%s\")", pathname);
+    }
+  }
+#endif
+
+  return r;
+}
+
+// returns the events of the next pending change, 0 if there is none
+int sys_watch_next(sys_watch_t *w, int *wd, char *name, int len) {
+  int r = -1;
+
+#ifdef LINUX
+  struct inotify_event *ev;
+  int n;
+
+  if (w) {
+    for (r = 0; r == 0;) {
+      if (w->pos >= w->len) {
+        w->pos = w->len = 0;
+        if ((n = read(w->fd, w->buf, WATCH_BUF)) == -1) {
+          if (errno == EAGAIN || errno == EINTR) return 0;
+          debug_errno("SYS", "read inotify");
+          return -1;
+        }
+        w->len = n;
+      }
+
+      if (w->pos + (int)sizeof(struct inotify_event) > w->len) {
+        w->pos = w->len;
+        return 0;
+      }
+
+      ev = (struct inotify_event *)&w->buf[w->pos];
+      w->pos += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO))   r |= SYS_WATCH_CREATE;
+      if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) r |= SYS_WATCH_DELETE;
+      if (ev->mask & IN_CLOSE_WRITE)              r |= SYS_WATCH_WRITE;
+      if (ev->mask & IN_IGNORED)                  r |= SYS_WATCH_IGNORED;
+      if (ev->mask & IN_Q_OVERFLOW)               r |= SYS_WATCH_OVERFLOW;
+    }
+    if (ev->mask & IN_ISDIR) r |= SYS_WATCH_DIR;
+
+    if (wd) *wd = ev->wd;
+    if (name && len > 0) {
+      sys_strncpy(name, ev->len ? ev->name : "", len - 1);
+      name[len - 1] = 0;
+    }
+  }
+#endif
+
+  return r;
+}
+
+int sys_watch_close(sys_watch_t *w) {
+  int r = -1;
+
+  if (w) {
+#ifdef LINUX
+    r = close(w->fd);
+#endif
+    sys_free(w);
+  }
+
+  return r;
+}
+
 int sys_chdir(char *path) {
   char buf[FILE_PATH];
   int r = -1;
@@ -1055,6 +1170,29 @@ int sys_truncate(int fd, int64_t offset) {
   return r;
 }
 
+int sys_fsync(int fd) {
+  int r = -1;
+
+#ifdef WINDOWS
+  fd_t *f;
+
+  if ((f = ptr_lock(fd, TAG_FD)) == NULL) {
+    return -1;
+  }
+
+  if (f->type == FD_FILE) {
+    r = FlushFileBuffers(f->handle) ? 0 : -1;
+  }
+
+  ptr_unlock(fd, TAG_FD);
+
+#else
+  r = fsync(fd);
+#endif
+
+  return r;
+}
+
 int sys_pipe(int *fd) {
 #ifdef WINDOWS
   HANDLE r, w;
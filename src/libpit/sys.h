@@ -108,6 +108,15 @@ typedef int64_t sys_ptrdiff_t;
 
 typedef struct sys_dir_t sys_dir_t;
 
+typedef struct sys_watch_t sys_watch_t;
+
+#define SYS_WATCH_CREATE   0x01
+#define SYS_WATCH_DELETE   0x02
+#define SYS_WATCH_WRITE    0x04
+#define SYS_WATCH_DIR      0x10
+#define SYS_WATCH_IGNORED  0x20
+#define SYS_WATCH_OVERFLOW 0x40
+
 #define FDSET_SIZE 1024
 
 typedef struct {
@@ -157,6 +166,14 @@ int sys_readdir(sys_dir_t *dir, char *name, int len);
 
 int sys_closedir(sys_dir_t *dir);
 
+sys_watch_t *sys_watch_open(void);
+
+int sys_watch_add(sys_watch_t *w, const char *pathname, int events);
+
+int sys_watch_next(sys_watch_t *w, int *wd, char *name, int len);
+
+int sys_watch_close(sys_watch_t *w);
+
 int sys_chdir(char *path);
 
 int sys_getcwd(char *buf, int len);
@@ -177,6 +194,8 @@ int64_t sys_seek(int fd, int64_t offset, sys_seek_t whence);
 
 int sys_truncate(int fd, int64_t offset);
 
+int sys_fsync(int fd);
+
 int sys_pipe(int *fd);
 
 int sys_peek(int fd);
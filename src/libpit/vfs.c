@@ -35,6 +35,7 @@ struct vfs_file_t {
   int (*close)(struct vfs_fpriv_t *f);
   uint32_t (*seek)(vfs_fpriv_t *f, uint32_t pos, int fromend);
   int (*truncate)(vfs_fpriv_t *f, uint32_t offset);
+  int (*sync)(vfs_fpriv_t *f);
   vfs_ent_t *(*fstat)(vfs_fpriv_t *fpriv);
   char buf[MAX_BUF];
 };
@@ -275,6 +276,30 @@ char *vfs_getmount(vfs_session_t *session, char *path) {
   return s;
 }
 
+// host path of a path on a mount backed by the local file system
+int vfs_localpath(vfs_session_t *session, char *path, char *buf, int len) {
+  vfs_mount_t *mount;
+  char *abspath, *local;
+  int pos, r = -1;
+
+  if ((abspath = vfs_abspath(session->cwd, path)) == NULL) {
+    return -1;
+  }
+
+  if (mutex_lock(mutex) == 0) {
+    if ((mount = vfs_find(abspath, &pos)) != NULL) {
+      if (mount->callback.getmount && (local = mount->callback.getmount(mount->data)) != NULL) {
+        sys_snprintf(buf, len-1, "%s%s", local, &abspath[pos]);
+        r = 0;
+      }
+    }
+    mutex_unlock(mutex);
+  }
+  xfree(abspath);
+
+  return r;
+}
+
 int vfs_checktype(vfs_session_t *session, char *path) {
   vfs_mount_t *mount;
   char *abspath;
@@ -545,6 +570,7 @@ vfs_file_t *vfs_open(vfs_session_t *session, char *path, int mode) {
   vfile->close = mount->callback.close;
   vfile->seek  = mount->callback.seek;
   vfile->truncate  = mount->callback.truncate;
+  vfile->sync  = mount->callback.sync;
   vfile->fstat = mount->callback.fstat;
   mutex_unlock(mutex);
   xfree(abspath);
@@ -660,6 +686,14 @@ int vfs_truncate(vfs_file_t *f, uint32_t offset) {
   return -1;
 }
 
+int vfs_sync(vfs_file_t *f) {
+  if (f) {
+    return f->sync ? f->sync(f->fpriv) : -1;
+  }
+
+  return -1;
+}
+
 void vfs_rewind(vfs_file_t *f) {
   vfs_seek(f, 0, 0);
 }
@@ -81,6 +81,8 @@ typedef struct {
   void *(*loadlib)(char *path, int *first_load, void *data);
 
   int (*truncate)(vfs_fpriv_t *f, uint32_t offset);
+
+  int (*sync)(vfs_fpriv_t *f);
 } vfs_callback_t;
 
 int vfs_map(char *label, char *path, void *data, vfs_callback_t *callback, int raw);
@@ -95,6 +97,8 @@ int vfs_statfs(vfs_session_t *session, char *path, uint64_t *total, uint64_t *fr
 
 char *vfs_getmount(vfs_session_t *session, char *path);
 
+int vfs_localpath(vfs_session_t *session, char *path, char *buf, int len);
+
 int vfs_checktype(vfs_session_t *session, char *path);
 
 int vfs_chdir(vfs_session_t *session, char *path);
@@ -125,6 +129,8 @@ uint32_t vfs_seek(vfs_file_t *f, uint32_t pos, int fromend);
 
 int vfs_truncate(vfs_file_t *f, uint32_t offset);
 
+int vfs_sync(vfs_file_t *f);
+
 void vfs_rewind(vfs_file_t *f);
 
 vfs_ent_t *vfs_fstat(vfs_file_t *f);
@@ -37,6 +37,7 @@ static int vfs_local_write(vfs_fpriv_t *fpriv, uint8_t *buf, uint32_t len);
 static int vfs_local_close(vfs_fpriv_t *fpriv);
 static uint32_t vfs_local_seek(vfs_fpriv_t *fpriv, uint32_t pos, int fromend);
 static int vfs_local_truncate(vfs_fpriv_t *fpriv, uint32_t offset);
+static int vfs_local_sync(vfs_fpriv_t *fpriv);
 static vfs_ent_t *vfs_local_fstat(vfs_fpriv_t *fpriv);
 static vfs_ent_t *vfs_local_stat(char *path, void *data, vfs_ent_t *ent);
 
@@ -67,7 +68,8 @@ static vfs_callback_t local_callback = {
   vfs_local_mkdir,
   vfs_local_statfs,
   vfs_local_loadlib,
-  vfs_local_truncate
+  vfs_local_truncate,
+  vfs_local_sync
 };
 
 int vfs_local_mount(char *local, char *path) {
@@ -355,6 +357,16 @@ static int vfs_local_truncate(vfs_fpriv_t *fpriv, uint32_t offset) {
   return r;
 }
 
+static int vfs_local_sync(vfs_fpriv_t *fpriv) {
+  int r = -1;
+
+  if (fpriv && fpriv->fd) {
+    r = sys_fsync(fpriv->fd);
+  }
+
+  return r;
+}
+
 static vfs_fpriv_t *vfs_local_open(char *path, int mode, void *_data) {
   vfsassets_mount_t *data;
   vfs_fpriv_t *fpriv;
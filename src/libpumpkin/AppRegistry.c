@@ -248,6 +248,22 @@ static UInt16 AppRegistryCompatCallback(AppRegistryEntry *e, void *d, UInt16 siz
   return sizeof(AppRegistryCompat);
 }
 
+static UInt16 AppRegistryEngineCallback(AppRegistryEntry *e, void *d, UInt16 size, Boolean set) {
+  AppRegistryEngine *e1 = (AppRegistryEngine *)e->data;
+  AppRegistryEngine *e2 = (AppRegistryEngine *)d;
+  char st[8];
+
+  if (set) {
+    pumpkin_id2s(e->creator, st);
+    debug(DEBUG_INFO, "AppReg", "updating engine %d for '%s'", e2->engine, st);
+    e1->engine = e2->engine;
+  } else {
+    e2->engine = e1->engine;
+  }
+
+  return sizeof(AppRegistryEngine);
+}
+
 static UInt16 AppRegistryNotificationCallback(AppRegistryEntry *e, void *d, UInt16 size, Boolean set) {
   AppRegistryNotification *n1 = (AppRegistryNotification *)e->data;
   AppRegistryNotification *n2 = (AppRegistryNotification *)d;
@@ -337,6 +353,9 @@ void AppRegistrySet(AppRegistryType *ar, UInt32 creator, AppRegistryID id, UInt1
     case appRegistryNotification:
       AppRegistryProcess(ar, creator, id, seq, AppRegistryNotificationCallback, p, sizeof(AppRegistryNotification), true);
       break;
+    case appRegistryEngine:
+      AppRegistryProcess(ar, creator, id, seq, AppRegistryEngineCallback, p, sizeof(AppRegistryEngine), true);
+      break;
     default:
       break;
   }
@@ -359,6 +378,9 @@ Boolean AppRegistryGet(AppRegistryType *ar, UInt32 creator, AppRegistryID id, UI
     case appRegistryPosition:
       r = AppRegistryProcess(ar, creator, id, seq, AppRegistryPositionCallback, p, sizeof(AppRegistryPosition), false);
       break;
+    case appRegistryEngine:
+      r = AppRegistryProcess(ar, creator, id, seq, AppRegistryEngineCallback, p, sizeof(AppRegistryEngine), false);
+      break;
     default:
       break;
   }
@@ -414,6 +436,9 @@ void AppRegistryEnum(AppRegistryType *ar, void (*callback)(UInt32 creator, UInt1
         case appRegistryPosition:
           callback(ar->registry[i].creator, ar->registry[i].seq, index, appRegistryPosition, ar->registry[i].data, 0, data);
           break;
+        case appRegistryEngine:
+          callback(ar->registry[i].creator, ar->registry[i].seq, index, appRegistryEngine, ar->registry[i].data, 0, data);
+          break;
         case appRegistryNotification:
           num = ar->registry[i].size / sizeof(AppRegistryNotification);
           n = (AppRegistryNotification *)ar->registry[i].data;
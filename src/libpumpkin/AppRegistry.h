@@ -7,6 +7,7 @@ typedef enum {
   appRegistryNotification,
   appRegistrySavedPref,
   appRegistryUnsavedPref,
+  appRegistryEngine,
   appRegistryLast
 } AppRegistryID;
 
@@ -29,6 +30,10 @@ typedef struct {
   UInt32 priority;
 } AppRegistryNotification;
 
+typedef struct {
+  UInt16 engine;
+} AppRegistryEngine;
+
 enum {
   appCompatUnknown,
   appCompatOk,
@@ -37,6 +42,14 @@ enum {
   appCompatCrash
 };
 
+// how 68K code is executed
+enum {
+  appEngineDefault,     // block cache, unless instructions or traps are traced
+  appEngineInterpreter, // one instruction at a time
+  appEngineBlocks,      // block cache
+  appEngineCheck        // block cache checked against the interpreter
+};
+
 AppRegistryType *AppRegistryInit(char *regname);
 void AppRegistryFinish(AppRegistryType *ar);
 
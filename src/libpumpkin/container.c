@@ -0,0 +1,619 @@
+#include "sys.h"
+#include "vfs.h"
+#include "bytes.h"
+#include "xalloc.h"
+#include "debug.h"
+
+#include "container.h"
+#include "lzpack.h"
+
+#define CONTAINER_MAGIC   'PCnt'
+#define CONTAINER_VERSION 2
+
+// all blobs start on a block boundary
+#define CONTAINER_BLOCK   32
+#define CONTAINER_HEADER  32
+#define CONTAINER_ENTRY   24
+#define CONTAINER_ENTRY1  20
+
+#define CONTAINER_PAGE    256
+#define CONTAINER_BUCKETS 64
+#define CONTAINER_COPY    4096
+
+// compact on close when at least this many bytes are unused
+// and they account for more than half of the file
+#define CONTAINER_SLACK   16384
+
+// blobs are compressed only from this size, and only when that saves an eighth of it
+#define CONTAINER_PACK    128
+
+// size is the size of the blob, stored the number of bytes it takes in the
+// file. A blob is compressed when stored is smaller than size.
+typedef struct {
+  uint32_t key1, key2;
+  uint32_t offset, size, capacity, stored;
+  int32_t next;
+} container_entry_t;
+
+struct container_t {
+  vfs_session_t *session;
+  vfs_file_t *f;
+  char path[VFS_PATH];
+  container_entry_t *entries;
+  uint32_t count, total;
+  int32_t *buckets;
+  uint32_t nbuckets;
+  uint32_t dirOffset, dirSize;
+  uint32_t spareOffset, spareSize;
+  uint32_t end, waste;
+  int dirty, compress;
+};
+
+static uint32_t container_round(uint32_t size) {
+  return (size + CONTAINER_BLOCK - 1) & ~(CONTAINER_BLOCK - 1);
+}
+
+static uint32_t container_hash(uint32_t key1, uint32_t key2) {
+  uint32_t h;
+
+  h = key1 * 2654435761u;
+  h ^= key2 * 40503u;
+  h ^= h >> 16;
+
+  return h;
+}
+
+static int container_rehash(container_t *c, uint32_t n) {
+  int32_t *buckets;
+  uint32_t i, b;
+  int r = -1;
+
+  if ((buckets = xcalloc(n, sizeof(int32_t))) != NULL) {
+    for (i = 0; i < n; i++) {
+      buckets[i] = -1;
+    }
+    for (i = 0; i < c->count; i++) {
+      b = container_hash(c->entries[i].key1, c->entries[i].key2) & (n - 1);
+      c->entries[i].next = buckets[b];
+      buckets[b] = i;
+    }
+    if (c->buckets) xfree(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = n;
+    r = 0;
+  }
+
+  return r;
+}
+
+static int32_t container_find(container_t *c, uint32_t key1, uint32_t key2) {
+  int32_t i;
+
+  for (i = c->buckets[container_hash(key1, key2) & (c->nbuckets - 1)]; i != -1; i = c->entries[i].next) {
+    if (c->entries[i].key1 == key1 && c->entries[i].key2 == key2) break;
+  }
+
+  return i;
+}
+
+static void container_link(container_t *c, int32_t i) {
+  uint32_t b;
+
+  b = container_hash(c->entries[i].key1, c->entries[i].key2) & (c->nbuckets - 1);
+  c->entries[i].next = c->buckets[b];
+  c->buckets[b] = i;
+}
+
+static void container_unlink(container_t *c, int32_t i) {
+  int32_t *p;
+
+  p = &c->buckets[container_hash(c->entries[i].key1, c->entries[i].key2) & (c->nbuckets - 1)];
+  for (; *p != -1; p = &c->entries[*p].next) {
+    if (*p == i) {
+      *p = c->entries[i].next;
+      break;
+    }
+  }
+}
+
+static int32_t container_add(container_t *c, uint32_t key1, uint32_t key2) {
+  container_entry_t *entries;
+  int32_t i;
+
+  if (c->count == c->total) {
+    if ((entries = xrealloc(c->entries, (c->total + CONTAINER_PAGE) * sizeof(container_entry_t))) == NULL) {
+      return -1;
+    }
+    c->entries = entries;
+    c->total += CONTAINER_PAGE;
+  }
+
+  i = c->count++;
+  xmemset(&c->entries[i], 0, sizeof(container_entry_t));
+  c->entries[i].key1 = key1;
+  c->entries[i].key2 = key2;
+
+  if (c->count > c->nbuckets) {
+    container_rehash(c, c->nbuckets * 2);
+  } else {
+    container_link(c, i);
+  }
+
+  return i;
+}
+
+static void container_delete(container_t *c, int32_t i) {
+  int32_t last;
+
+  container_unlink(c, i);
+  last = c->count - 1;
+  if (i != last) {
+    container_unlink(c, last);
+    c->entries[i] = c->entries[last];
+    container_link(c, i);
+  }
+  c->count--;
+}
+
+static int container_pread(vfs_file_t *f, uint32_t offset, uint8_t *buf, uint32_t size) {
+  if (vfs_seek(f, offset, 0) != offset) return -1;
+  return vfs_read(f, buf, size);
+}
+
+static int container_pwrite(vfs_file_t *f, uint32_t offset, uint8_t *buf, uint32_t size) {
+  uint8_t zero[256];
+  uint32_t n, len;
+
+  if (vfs_seek(f, offset, 0) != offset) return -1;
+  if (buf) return vfs_write(f, buf, size);
+
+  xmemset(zero, 0, sizeof(zero));
+  for (n = 0; n < size; n += len) {
+    len = size - n;
+    if (len > sizeof(zero)) len = sizeof(zero);
+    if (vfs_write(f, zero, len) != len) return -1;
+  }
+
+  return size;
+}
+
+static int container_write_header(container_t *c) {
+  uint8_t buf[CONTAINER_HEADER];
+  int i;
+
+  xmemset(buf, 0, sizeof(buf));
+  i = 0;
+  i += put4b(CONTAINER_MAGIC, buf, i);
+  i += put4b(CONTAINER_VERSION, buf, i);
+  i += put4b(CONTAINER_BLOCK, buf, i);
+  i += put4b(c->dirOffset, buf, i);
+  i += put4b(c->count, buf, i);
+  i += put4b(c->end, buf, i);
+  i += put4b(c->waste, buf, i);
+
+  return container_pwrite(c->f, 0, buf, sizeof(buf)) == sizeof(buf) ? 0 : -1;
+}
+
+static int container_load(container_t *c) {
+  uint8_t header[CONTAINER_HEADER], *buf;
+  uint32_t magic, version, block, count, size, esize, i, n;
+  container_entry_t *e;
+  int j, r = -1;
+
+  if (container_pread(c->f, 0, header, sizeof(header)) != sizeof(header)) {
+    debug(DEBUG_ERROR, "STOR", "container \"%s\" header too short", c->path);
+    return -1;
+  }
+
+  j = 0;
+  j += get4b(&magic, header, j);
+  j += get4b(&version, header, j);
+  j += get4b(&block, header, j);
+  j += get4b(&c->dirOffset, header, j);
+  j += get4b(&count, header, j);
+  j += get4b(&c->end, header, j);
+  j += get4b(&c->waste, header, j);
+
+  if (magic != CONTAINER_MAGIC || (version != 1 && version != CONTAINER_VERSION) || block != CONTAINER_BLOCK) {
+    debug(DEBUG_ERROR, "STOR", "container \"%s\" invalid header 0x%08X %u %u", c->path, magic, version, block);
+    return -1;
+  }
+
+  // version 1 has no compressed blobs
+  esize = version == 1 ? CONTAINER_ENTRY1 : CONTAINER_ENTRY;
+  size = count * esize;
+  c->dirSize = container_round(size);
+  if (count == 0) return 0;
+
+  c->total = ((count + CONTAINER_PAGE - 1) / CONTAINER_PAGE) * CONTAINER_PAGE;
+  c->entries = xcalloc(c->total, sizeof(container_entry_t));
+  buf = xcalloc(1, size);
+
+  if (c->entries && buf) {
+    if (container_pread(c->f, c->dirOffset, buf, size) == size) {
+      for (i = 0, j = 0; i < count; i++) {
+        e = &c->entries[i];
+        j += get4b(&e->key1, buf, j);
+        j += get4b(&e->key2, buf, j);
+        j += get4b(&e->offset, buf, j);
+        j += get4b(&e->size, buf, j);
+        j += get4b(&e->capacity, buf, j);
+        e->stored = e->size;
+        if (version != 1) j += get4b(&e->stored, buf, j);
+      }
+      c->count = count;
+      for (n = c->nbuckets; n < count; n *= 2);
+      r = container_rehash(c, n);
+    } else {
+      debug(DEBUG_ERROR, "STOR", "container \"%s\" directory too short", c->path);
+    }
+  }
+  if (buf) xfree(buf);
+
+  return r;
+}
+
+container_t *container_open(vfs_session_t *session, char *path, int create) {
+  container_t *c;
+  vfs_file_t *f = NULL;
+  int created = 0;
+
+  if (vfs_checktype(session, path) == VFS_FILE) {
+    f = vfs_open(session, path, VFS_RDWR);
+  } else if (create) {
+    f = vfs_open(session, path, VFS_RDWR | VFS_TRUNC);
+    created = 1;
+  }
+
+  if (f == NULL) {
+    return NULL;
+  }
+
+  if ((c = xcalloc(1, sizeof(container_t))) != NULL) {
+    c->session = session;
+    c->f = f;
+    sys_strncpy(c->path, path, VFS_PATH - 1);
+
+    if (container_rehash(c, CONTAINER_BUCKETS) == 0) {
+      if (created) {
+        c->end = CONTAINER_HEADER;
+        c->dirty = 1;
+        if (container_sync(c) == 0) {
+          debug(DEBUG_TRACE, "STOR", "container \"%s\" created", path);
+          return c;
+        }
+      } else if (container_load(c) == 0) {
+        debug(DEBUG_TRACE, "STOR", "container \"%s\" opened with %u entries", path, c->count);
+        return c;
+      }
+    }
+
+    if (c->entries) xfree(c->entries);
+    if (c->buckets) xfree(c->buckets);
+    xfree(c);
+  }
+  vfs_close(f);
+
+  return NULL;
+}
+
+// Writes the directory to space the header does not point to and only then the header,
+// so that the header always points to a complete directory. The space of the previous
+// directory is kept as a spare and reused by the next sync when the directory fits in it,
+// so repeated syncs alternate between two places instead of growing the file.
+
+int container_sync(container_t *c) {
+  container_entry_t *e;
+  uint8_t *buf;
+  uint32_t i, size, capacity, offset, oldOffset, oldSize, end, waste;
+  int j, r = -1;
+
+  if (c == NULL) return -1;
+  if (!c->dirty) return 0;
+
+  size = c->count * CONTAINER_ENTRY;
+  if ((buf = xcalloc(1, size ? size : 1)) != NULL) {
+    for (i = 0, j = 0; i < c->count; i++) {
+      e = &c->entries[i];
+      j += put4b(e->key1, buf, j);
+      j += put4b(e->key2, buf, j);
+      j += put4b(e->offset, buf, j);
+      j += put4b(e->size, buf, j);
+      j += put4b(e->capacity, buf, j);
+      j += put4b(e->stored, buf, j);
+    }
+
+    // unused space, including the spare, is counted as waste until it is used again
+    end = c->end;
+    waste = c->waste;
+    if (c->spareOffset && container_round(size) <= c->spareSize) {
+      offset = c->spareOffset;
+      capacity = c->spareSize;
+      waste -= c->spareSize;
+    } else {
+      // leave room for the directory to grow, so that the spare keeps fitting it
+      offset = end;
+      capacity = container_round(size + size / 4);
+      end += capacity;
+    }
+
+    if (container_pwrite(c->f, offset, buf, size) == size) {
+      oldOffset = c->dirOffset;
+      oldSize = c->dirSize;
+      c->dirOffset = offset;
+      c->dirSize = capacity;
+      c->end = end;
+      c->waste = waste + (oldOffset ? oldSize : 0);
+      if (container_write_header(c) == 0) {
+        c->spareOffset = oldOffset;
+        c->spareSize = oldOffset ? oldSize : 0;
+        c->dirty = 0;
+        r = 0;
+      } else {
+        // the header may still point to the old directory, so neither place can be reused
+        c->spareOffset = 0;
+        c->spareSize = 0;
+      }
+    }
+    xfree(buf);
+  }
+
+  if (r == -1) {
+    debug(DEBUG_ERROR, "STOR", "container \"%s\" sync failed", c->path);
+  }
+
+  return r;
+}
+
+// Copies every live blob to a new file, writes its directory and then replaces the old file.
+
+static int container_compact(container_t *c) {
+  char tmp[VFS_PATH];
+  container_entry_t *e;
+  vfs_file_t *f, *old;
+  uint32_t *offsets, offset, i, n, len;
+  uint8_t *buf;
+  int r = -1;
+
+  sys_snprintf(tmp, VFS_PATH - 1, "%s.tmp", c->path);
+  debug(DEBUG_INFO, "STOR", "container \"%s\" compacting %u of %u bytes", c->path, c->waste, c->end);
+
+  if ((f = vfs_open(c->session, tmp, VFS_RDWR | VFS_TRUNC)) == NULL) {
+    return -1;
+  }
+
+  buf = xcalloc(1, CONTAINER_COPY);
+  offsets = xcalloc(c->count + 1, sizeof(uint32_t));
+
+  if (buf && offsets) {
+    offset = CONTAINER_HEADER;
+    for (i = 0; i < c->count; i++) {
+      e = &c->entries[i];
+      offsets[i] = offset;
+      for (n = 0; n < e->stored; n += len) {
+        len = e->stored - n;
+        if (len > CONTAINER_COPY) len = CONTAINER_COPY;
+        if (container_pread(c->f, e->offset + n, buf, len) != len) break;
+        if (container_pwrite(f, offset + n, buf, len) != len) break;
+      }
+      if (n < e->stored) break;
+      offset += container_round(e->stored);
+    }
+
+    if (i == c->count) {
+      for (i = 0; i < c->count; i++) {
+        e = &c->entries[i];
+        e->offset = offsets[i];
+        e->capacity = container_round(e->stored);
+      }
+      old = c->f;
+      c->f = f;
+      c->end = offset;
+      c->dirOffset = 0;
+      c->dirSize = 0;
+      c->spareOffset = 0;
+      c->spareSize = 0;
+      c->waste = 0;
+      c->dirty = 1;
+      r = container_sync(c);
+      vfs_close(f);
+      vfs_close(old);
+      f = NULL;
+      c->f = NULL;
+      if (r == 0) {
+        r = vfs_rename(c->session, tmp, c->path);
+      }
+    }
+  }
+
+  if (offsets) xfree(offsets);
+  if (buf) xfree(buf);
+
+  if (f) {
+    vfs_close(f);
+    vfs_unlink(c->session, tmp);
+  }
+
+  return r;
+}
+
+int container_close(container_t *c) {
+  int r = -1;
+
+  if (c) {
+    r = container_sync(c);
+    if (r == 0 && c->waste > CONTAINER_SLACK && c->waste * 2 > c->end) {
+      r = container_compact(c);
+    }
+    if (c->f) vfs_close(c->f);
+    if (c->entries) xfree(c->entries);
+    if (c->buckets) xfree(c->buckets);
+    xfree(c);
+  }
+
+  return r;
+}
+
+void container_compress(container_t *c, int compress) {
+  if (c) c->compress = compress;
+}
+
+int container_rename(container_t *c, char *path) {
+  if (c == NULL || path == NULL) return -1;
+  sys_strncpy(c->path, path, VFS_PATH - 1);
+
+  return 0;
+}
+
+uint32_t container_num(container_t *c) {
+  return c ? c->count : 0;
+}
+
+int container_get(container_t *c, uint32_t i, uint32_t *key1, uint32_t *key2, uint32_t *size) {
+  if (c == NULL || i >= c->count) return -1;
+
+  if (key1) *key1 = c->entries[i].key1;
+  if (key2) *key2 = c->entries[i].key2;
+  if (size) *size = c->entries[i].size;
+
+  return 0;
+}
+
+int container_size(container_t *c, uint32_t key1, uint32_t key2, uint32_t *size) {
+  int32_t i;
+
+  if (c == NULL || (i = container_find(c, key1, key2)) == -1) return -1;
+  if (size) *size = c->entries[i].size;
+
+  return 0;
+}
+
+// Compressed blobs are always decompressed as a whole, even when only part of them is read.
+static int container_unpack(container_t *c, container_entry_t *e, uint8_t *buf, uint32_t size) {
+  uint8_t *packed, *tmp;
+  int r = -1;
+
+  if ((packed = xcalloc(1, e->stored)) == NULL) return -1;
+
+  if (container_pread(c->f, e->offset, packed, e->stored) == e->stored) {
+    if (size == e->size) {
+      if (lzpack_decompress(packed, e->stored, buf, size) == size) r = size;
+    } else if ((tmp = xcalloc(1, e->size)) != NULL) {
+      if (lzpack_decompress(packed, e->stored, tmp, e->size) == e->size) {
+        xmemcpy(buf, tmp, size);
+        r = size;
+      }
+      xfree(tmp);
+    }
+  }
+  xfree(packed);
+
+  if (r == -1) {
+    debug(DEBUG_ERROR, "STOR", "container \"%s\" invalid compressed blob 0x%08X 0x%08X", c->path, e->key1, e->key2);
+  }
+
+  return r;
+}
+
+int container_read(container_t *c, uint32_t key1, uint32_t key2, uint8_t *buf, uint32_t size) {
+  container_entry_t *e;
+  int32_t i;
+
+  if (c == NULL || buf == NULL || (i = container_find(c, key1, key2)) == -1) return -1;
+
+  e = &c->entries[i];
+  if (size > e->size) size = e->size;
+  if (size == 0) return 0;
+
+  if (e->stored < e->size) {
+    return container_unpack(c, e, buf, size);
+  }
+
+  return container_pread(c->f, e->offset, buf, size);
+}
+
+// Writes a blob in place when it fits in the space already reserved for it, otherwise
+// appends it to the end of the file. A NULL buf writes a blob filled with zeros.
+// With compression enabled the blob is written compressed when that pays off.
+
+int container_write(container_t *c, uint32_t key1, uint32_t key2, uint8_t *buf, uint32_t size) {
+  container_entry_t *e;
+  uint8_t *packed = NULL;
+  uint32_t stored, offset, capacity;
+  int32_t i;
+  int n, added = 0, r = -1;
+
+  if (c == NULL) return -1;
+
+  if ((i = container_find(c, key1, key2)) == -1) {
+    if ((i = container_add(c, key1, key2)) == -1) return -1;
+    added = 1;
+  }
+
+  stored = size;
+  if (c->compress && buf && size >= CONTAINER_PACK && (packed = xcalloc(1, size)) != NULL) {
+    if ((n = lzpack_compress(buf, size, packed, size - size / 8)) > 0) {
+      stored = n;
+    } else {
+      xfree(packed);
+      packed = NULL;
+    }
+  }
+
+  e = &c->entries[i];
+  offset = e->offset;
+  capacity = e->capacity;
+  if (stored > capacity) {
+    offset = c->end;
+    capacity = container_round(stored);
+  }
+
+  // the entry only changes once its blob has been written
+  if (stored == 0 || container_pwrite(c->f, offset, packed ? packed : buf, stored) == stored) {
+    if (offset != e->offset || capacity != e->capacity) {
+      c->waste += e->capacity;
+      c->end += capacity;
+      e->offset = offset;
+      e->capacity = capacity;
+    }
+    e->size = size;
+    e->stored = stored;
+    c->dirty = 1;
+    r = size;
+  } else if (added) {
+    container_delete(c, i);
+  }
+  if (packed) xfree(packed);
+
+  return r;
+}
+
+int container_remove(container_t *c, uint32_t key1, uint32_t key2) {
+  int32_t i;
+
+  if (c == NULL || (i = container_find(c, key1, key2)) == -1) return -1;
+
+  c->waste += c->entries[i].capacity;
+  container_delete(c, i);
+  c->dirty = 1;
+
+  return 0;
+}
+
+int container_rekey(container_t *c, uint32_t key1, uint32_t key2, uint32_t newkey1, uint32_t newkey2) {
+  int32_t i;
+
+  if (c == NULL) return -1;
+  if (key1 == newkey1 && key2 == newkey2) return 0;
+
+  container_remove(c, newkey1, newkey2);
+  if ((i = container_find(c, key1, key2)) == -1) return -1;
+
+  container_unlink(c, i);
+  c->entries[i].key1 = newkey1;
+  c->entries[i].key2 = newkey2;
+  container_link(c, i);
+  c->dirty = 1;
+
+  return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef PIT_CONTAINER_H
+#define PIT_CONTAINER_H
+
+// A container keeps all elements (records or resources) of a database in a
+// single paged file: a fixed header, the data blobs and a directory of
+// entries keyed by (key1, key2). Records use (uniqueID, 0) and resources
+// use (type, id). Blobs written while compression is enabled are stored
+// compressed when that makes them smaller, and are decompressed on read.
+
+typedef struct container_t container_t;
+
+container_t *container_open(vfs_session_t *session, char *path, int create);
+int container_close(container_t *c);
+int container_sync(container_t *c);
+void container_compress(container_t *c, int compress);
+int container_rename(container_t *c, char *path);
+uint32_t container_num(container_t *c);
+int container_get(container_t *c, uint32_t i, uint32_t *key1, uint32_t *key2, uint32_t *size);
+int container_size(container_t *c, uint32_t key1, uint32_t key2, uint32_t *size);
+int container_read(container_t *c, uint32_t key1, uint32_t key2, uint8_t *buf, uint32_t size);
+int container_write(container_t *c, uint32_t key1, uint32_t key2, uint8_t *buf, uint32_t size);
+int container_remove(container_t *c, uint32_t key1, uint32_t key2);
+int container_rekey(container_t *c, uint32_t key1, uint32_t key2, uint32_t newkey1, uint32_t newkey2);
+
+#endif
@@ -0,0 +1,201 @@
+#include "sys.h"
+#include "thread.h"
+#include "mutex.h"
+#include "xalloc.h"
+#include "debug.h"
+
+#include "dblock.h"
+
+#define DBLOCK_NAME    32
+#define DBLOCK_READERS 16
+
+typedef struct {
+  int handle;
+  int count;
+} dblock_reader_t;
+
+struct dblock_t {
+  char name[DBLOCK_NAME];
+  dblock_table_t *t;
+  uint32_t refs;
+  int writer, writes;
+  uint32_t numReaders;
+  dblock_reader_t readers[DBLOCK_READERS];
+  struct dblock_t *next;
+};
+
+struct dblock_table_t {
+  mutex_t *mutex;
+  cond_t *cond;
+  dblock_t *list;
+};
+
+dblock_table_t *dblock_create(void) {
+  dblock_table_t *t;
+
+  if ((t = xcalloc(1, sizeof(dblock_table_t))) != NULL) {
+    t->mutex = mutex_create("dblock");
+    t->cond = cond_create("dblock");
+    if (t->mutex == NULL || t->cond == NULL) {
+      if (t->mutex) mutex_destroy(t->mutex);
+      if (t->cond) cond_destroy(t->cond);
+      xfree(t);
+      t = NULL;
+    }
+  }
+
+  return t;
+}
+
+void dblock_destroy(dblock_table_t *t) {
+  dblock_t *l, *next;
+
+  if (t) {
+    for (l = t->list; l; l = next) {
+      next = l->next;
+      debug(DEBUG_ERROR, "STOR", "database lock \"%s\" still referenced", l->name);
+      xfree(l);
+    }
+    cond_destroy(t->cond);
+    mutex_destroy(t->mutex);
+    xfree(t);
+  }
+}
+
+dblock_t *dblock_get(dblock_table_t *t, char *name) {
+  dblock_t *l = NULL;
+
+  if (t && name && mutex_lock(t->mutex) == 0) {
+    for (l = t->list; l; l = l->next) {
+      if (!sys_strncmp(l->name, name, DBLOCK_NAME)) break;
+    }
+    if (l == NULL && (l = xcalloc(1, sizeof(dblock_t))) != NULL) {
+      sys_strncpy(l->name, name, DBLOCK_NAME - 1);
+      l->t = t;
+      l->next = t->list;
+      t->list = l;
+    }
+    if (l) l->refs++;
+    mutex_unlock(t->mutex);
+  }
+
+  return l;
+}
+
+void dblock_put(dblock_t *l) {
+  dblock_table_t *t;
+  dblock_t **p;
+
+  if (l) {
+    t = l->t;
+    if (mutex_lock(t->mutex) == 0) {
+      if (--l->refs == 0) {
+        for (p = &t->list; *p; p = &(*p)->next) {
+          if (*p == l) {
+            *p = l->next;
+            break;
+          }
+        }
+        if (l->writes || l->numReaders) {
+          debug(DEBUG_ERROR, "STOR", "database lock \"%s\" released while held", l->name);
+        }
+        xfree(l);
+      }
+      mutex_unlock(t->mutex);
+    }
+  }
+}
+
+static dblock_reader_t *dblock_reader(dblock_t *l, int handle) {
+  uint32_t i;
+
+  for (i = 0; i < DBLOCK_READERS; i++) {
+    if (l->readers[i].count && l->readers[i].handle == handle) return &l->readers[i];
+  }
+
+  return NULL;
+}
+
+static dblock_reader_t *dblock_new_reader(dblock_t *l, int handle) {
+  uint32_t i;
+
+  for (i = 0; i < DBLOCK_READERS; i++) {
+    if (l->readers[i].count == 0) {
+      l->readers[i].handle = handle;
+      l->numReaders++;
+      return &l->readers[i];
+    }
+  }
+
+  return NULL;
+}
+
+int dblock_lock(dblock_t *l, int write, int block) {
+  dblock_reader_t *reader;
+  int handle, r = -1;
+
+  if (l && mutex_lock(l->t->mutex) == 0) {
+    handle = thread_get_handle();
+
+    for (;;) {
+      if (l->writes && l->writer == handle) {
+        // nested lock taken by the writer
+        l->writes++;
+        r = 0;
+        break;
+      }
+
+      reader = dblock_reader(l, handle);
+      if (write) {
+        if (l->writes == 0 && l->numReaders == (reader ? 1 : 0)) {
+          l->writer = handle;
+          l->writes = 1;
+          r = 0;
+          break;
+        }
+      } else if (reader) {
+        reader->count++;
+        r = 0;
+        break;
+      } else if (l->writes == 0 && (reader = dblock_new_reader(l, handle)) != NULL) {
+        reader->count = 1;
+        r = 0;
+        break;
+      }
+
+      if (!block || cond_wait(l->t->cond, l->t->mutex) != 0) break;
+    }
+
+    mutex_unlock(l->t->mutex);
+  }
+
+  return r;
+}
+
+int dblock_unlock(dblock_t *l) {
+  dblock_reader_t *reader;
+  int handle, r = -1;
+
+  if (l && mutex_lock(l->t->mutex) == 0) {
+    handle = thread_get_handle();
+
+    if (l->writes && l->writer == handle) {
+      if (--l->writes == 0) {
+        cond_broadcast(l->t->cond);
+      }
+      r = 0;
+    } else if ((reader = dblock_reader(l, handle)) != NULL) {
+      if (--reader->count == 0) {
+        l->numReaders--;
+        cond_broadcast(l->t->cond);
+      }
+      r = 0;
+    } else {
+      debug(DEBUG_ERROR, "STOR", "database lock \"%s\" not held", l->name);
+    }
+
+    mutex_unlock(l->t->mutex);
+  }
+
+  return r;
+}
@@ -0,0 +1,20 @@
+#ifndef PIT_DBLOCK_H
+#define PIT_DBLOCK_H
+
+// Process wide reader/writer locks for databases, keyed by database name.
+// Every task keeps its own view of an open database, so tasks that open the
+// same database share the lock through the table. Locks are reentrant: the
+// thread holding the write lock may take the lock again for reading or
+// writing, and a thread that is the only reader may upgrade to writing.
+
+typedef struct dblock_table_t dblock_table_t;
+typedef struct dblock_t dblock_t;
+
+dblock_table_t *dblock_create(void);
+void dblock_destroy(dblock_table_t *t);
+dblock_t *dblock_get(dblock_table_t *t, char *name);
+void dblock_put(dblock_t *l);
+int dblock_lock(dblock_t *l, int write, int block);
+int dblock_unlock(dblock_t *l);
+
+#endif
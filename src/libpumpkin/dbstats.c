@@ -0,0 +1,232 @@
+#include "sys.h"
+#include "mutex.h"
+#include "xalloc.h"
+#include "debug.h"
+
+#include "dbstats.h"
+
+#define DBSTATS_NAME 32
+
+struct dbstats_entry_t {
+  char name[DBSTATS_NAME];
+  uint64_t count[DBSTATS_NUM];
+  uint64_t amount[DBSTATS_NUM];
+  struct dbstats_entry_t *next;
+};
+
+struct dbstats_t {
+  mutex_t *mutex;
+  dbstats_entry_t total;
+  dbstats_entry_t *list;
+};
+
+typedef struct {
+  char *buf;
+  uint32_t len, size;
+} dbstats_buf_t;
+
+// name of each event and of its amount in the JSON output, events without an amount are only counted
+static const char *dbstats_names[DBSTATS_NUM][2] = {
+  { "open",    NULL    },
+  { "file",    NULL    },
+  { "read",    "bytes" },
+  { "write",   "bytes" },
+  { "inflate", "bytes" },
+  { "cached",  "bytes" },
+  { "decode",  "us"    },
+  { "lock",    "us"    }
+};
+
+dbstats_t *dbstats_create(void) {
+  dbstats_t *s;
+
+  if ((s = xcalloc(1, sizeof(dbstats_t))) != NULL) {
+    if ((s->mutex = mutex_create("dbstats")) == NULL) {
+      xfree(s);
+      s = NULL;
+    }
+  }
+
+  return s;
+}
+
+void dbstats_destroy(dbstats_t *s) {
+  dbstats_entry_t *e, *next;
+
+  if (s) {
+    for (e = s->list; e; e = next) {
+      next = e->next;
+      xfree(e);
+    }
+    mutex_destroy(s->mutex);
+    xfree(s);
+  }
+}
+
+static dbstats_entry_t *dbstats_find(dbstats_t *s, char *name) {
+  dbstats_entry_t *e;
+
+  for (e = s->list; e; e = e->next) {
+    if (!sys_strncmp(e->name, name, DBSTATS_NAME)) break;
+  }
+
+  return e;
+}
+
+dbstats_entry_t *dbstats_get(dbstats_t *s, char *name) {
+  dbstats_entry_t *e = NULL;
+
+  if (s && name && mutex_lock(s->mutex) == 0) {
+    if ((e = dbstats_find(s, name)) == NULL && (e = xcalloc(1, sizeof(dbstats_entry_t))) != NULL) {
+      sys_strncpy(e->name, name, DBSTATS_NAME - 1);
+      e->next = s->list;
+      s->list = e;
+    }
+    mutex_unlock(s->mutex);
+  }
+
+  return e;
+}
+
+// Counts the event for the process and, when e is not NULL, for its database.
+// Counters are updated atomically, the mutex only guards the list of entries.
+void dbstats_count(dbstats_t *s, dbstats_entry_t *e, int event, uint64_t amount) {
+  if (s && event >= 0 && event < DBSTATS_NUM) {
+    __atomic_add_fetch(&s->total.count[event], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->total.amount[event], amount, __ATOMIC_RELAXED);
+    if (e) {
+      __atomic_add_fetch(&e->count[event], 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&e->amount[event], amount, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// reads the counters of a database, or the process counters when name is NULL
+int dbstats_read(dbstats_t *s, char *name, int event, uint64_t *count, uint64_t *amount) {
+  dbstats_entry_t *e;
+  int r = -1;
+
+  if (s && event >= 0 && event < DBSTATS_NUM && mutex_lock(s->mutex) == 0) {
+    if ((e = name ? dbstats_find(s, name) : &s->total) != NULL) {
+      if (count) *count = __atomic_load_n(&e->count[event], __ATOMIC_RELAXED);
+      if (amount) *amount = __atomic_load_n(&e->amount[event], __ATOMIC_RELAXED);
+      r = 0;
+    }
+    mutex_unlock(s->mutex);
+  }
+
+  return r;
+}
+
+static void dbstats_reset_entry(dbstats_entry_t *e) {
+  int i;
+
+  for (i = 0; i < DBSTATS_NUM; i++) {
+    __atomic_store_n(&e->count[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->amount[i], 0, __ATOMIC_RELAXED);
+  }
+}
+
+// events counted while the counters are being reset may be kept or lost
+void dbstats_reset(dbstats_t *s) {
+  dbstats_entry_t *e;
+
+  if (s && mutex_lock(s->mutex) == 0) {
+    dbstats_reset_entry(&s->total);
+    for (e = s->list; e; e = e->next) {
+      dbstats_reset_entry(e);
+    }
+    mutex_unlock(s->mutex);
+  }
+}
+
+static int dbstats_append(dbstats_buf_t *b, const char *fmt, ...) {
+  sys_va_list ap;
+  char *buf;
+  int n;
+
+  for (;;) {
+    sys_va_start(ap, fmt);
+    n = sys_vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+    sys_va_end(ap);
+    if (n < 0) return -1;
+    if (b->len + n < b->size) break;
+    if ((buf = xrealloc(b->buf, b->size + n + 1024)) == NULL) return -1;
+    b->buf = buf;
+    b->size += n + 1024;
+  }
+  b->len += n;
+
+  return 0;
+}
+
+// database names are escaped byte by byte, bytes outside ASCII are taken as Latin-1
+static int dbstats_append_name(dbstats_buf_t *b, char *name) {
+  uint8_t *p;
+  int r = 0;
+
+  r |= dbstats_append(b, "\"");
+  for (p = (uint8_t *)name; *p && r == 0; p++) {
+    if (*p == '"' || *p == '\\') {
+      r |= dbstats_append(b, "\\%c", *p);
+    } else if (*p < 0x20 || *p >= 0x7F) {
+      r |= dbstats_append(b, "\\u%04x", *p);
+    } else {
+      r |= dbstats_append(b, "%c", *p);
+    }
+  }
+  r |= dbstats_append(b, "\"");
+
+  return r;
+}
+
+static int dbstats_append_entry(dbstats_buf_t *b, dbstats_entry_t *e) {
+  int i, r = 0;
+
+  r |= dbstats_append(b, "{");
+  for (i = 0; i < DBSTATS_NUM && r == 0; i++) {
+    r |= dbstats_append(b, "%s\"%s\":{\"count\":%llu", i ? "," : "", dbstats_names[i][0], (unsigned long long)__atomic_load_n(&e->count[i], __ATOMIC_RELAXED));
+    if (dbstats_names[i][1]) {
+      r |= dbstats_append(b, ",\"%s\":%llu", dbstats_names[i][1], (unsigned long long)__atomic_load_n(&e->amount[i], __ATOMIC_RELAXED));
+    }
+    r |= dbstats_append(b, "}");
+  }
+  r |= dbstats_append(b, "}");
+
+  return r;
+}
+
+// Returns the counters as a JSON object allocated with xmalloc:
+// {"total":{"open":{"count":n},"read":{"count":n,"bytes":n},...},"databases":{"name":{...},...}}
+char *dbstats_json(dbstats_t *s) {
+  dbstats_buf_t b;
+  dbstats_entry_t *e;
+  int r = 0;
+
+  if (s == NULL) return NULL;
+  xmemset(&b, 0, sizeof(b));
+
+  if (mutex_lock(s->mutex) == 0) {
+    r |= dbstats_append(&b, "{\"total\":");
+    r |= dbstats_append_entry(&b, &s->total);
+    r |= dbstats_append(&b, ",\"databases\":{");
+    for (e = s->list; e && r == 0; e = e->next) {
+      if (e != s->list) r |= dbstats_append(&b, ",");
+      r |= dbstats_append_name(&b, e->name);
+      r |= dbstats_append(&b, ":");
+      r |= dbstats_append_entry(&b, e);
+    }
+    r |= dbstats_append(&b, "}}");
+    mutex_unlock(s->mutex);
+  } else {
+    r = -1;
+  }
+
+  if (r != 0) {
+    debug(DEBUG_ERROR, "STOR", "storage counters could not be formatted");
+    if (b.buf) xfree(b.buf);
+    b.buf = NULL;
+  }
+
+  return b.buf;
+}
@@ -0,0 +1,32 @@
+#ifndef PIT_DBSTATS_H
+#define PIT_DBSTATS_H
+
+// Storage counters. Every event is counted together with an amount: bytes
+// for transfers, microseconds for decoding and for waiting on locks. There
+// is one set of counters for the whole process and one for each database,
+// keyed by name. Entries live as long as the table, so a task may keep the
+// entry of a database it has open, and counters survive closing it. Counting
+// does not lock, so a count and its amount read together may be one event apart.
+
+#define DBSTATS_OPEN    0  // databases opened
+#define DBSTATS_FILE    1  // files opened under the storage root
+#define DBSTATS_READ    2  // records and resources read from storage, bytes
+#define DBSTATS_WRITE   3  // records and resources written to storage, bytes
+#define DBSTATS_INFLATE 4  // records loaded into memory, bytes
+#define DBSTATS_CACHED  5  // resources found in the shared cache, bytes
+#define DBSTATS_DECODE  6  // resources decoded, microseconds
+#define DBSTATS_LOCK    7  // locks taken, microseconds spent waiting
+#define DBSTATS_NUM     8
+
+typedef struct dbstats_t dbstats_t;
+typedef struct dbstats_entry_t dbstats_entry_t;
+
+dbstats_t *dbstats_create(void);
+void dbstats_destroy(dbstats_t *s);
+dbstats_entry_t *dbstats_get(dbstats_t *s, char *name);
+void dbstats_count(dbstats_t *s, dbstats_entry_t *e, int event, uint64_t amount);
+int dbstats_read(dbstats_t *s, char *name, int event, uint64_t *count, uint64_t *amount);
+void dbstats_reset(dbstats_t *s);
+char *dbstats_json(dbstats_t *s);
+
+#endif
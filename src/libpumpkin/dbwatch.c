@@ -0,0 +1,218 @@
+#include "sys.h"
+#include "mutex.h"
+#include "vfs.h"
+#include "xalloc.h"
+#include "debug.h"
+
+#include "dbwatch.h"
+
+#define DBWATCH_NAME   128
+#define DBWATCH_EVENTS 256
+
+typedef struct {
+  int wd;
+  char name[DBWATCH_NAME];
+} dbwatch_dir_t;
+
+typedef struct {
+  int type;
+  char name[DBWATCH_NAME];
+} dbwatch_event_t;
+
+struct dbwatch_t {
+  sys_watch_t *sw;
+  mutex_t *mutex;
+  char root[VFS_PATH];
+  char file[DBWATCH_NAME];
+  int rootWd;
+  dbwatch_dir_t *dirs;
+  uint32_t numDirs, maxDirs;
+  dbwatch_event_t events[DBWATCH_EVENTS];
+  uint32_t head;  // position of the next event, events before head - DBWATCH_EVENTS are gone
+};
+
+static void dbwatch_push(dbwatch_t *w, int type, char *name) {
+  dbwatch_event_t *ev;
+
+  ev = &w->events[w->head % DBWATCH_EVENTS];
+  ev->type = type;
+  sys_strncpy(ev->name, name, DBWATCH_NAME - 1);
+  ev->name[DBWATCH_NAME - 1] = 0;
+  w->head++;
+}
+
+static dbwatch_dir_t *dbwatch_find(dbwatch_t *w, int wd) {
+  uint32_t i;
+
+  for (i = 0; i < w->numDirs; i++) {
+    if (w->dirs[i].wd == wd) return &w->dirs[i];
+  }
+
+  return NULL;
+}
+
+static int dbwatch_file_exists(dbwatch_t *w, char *name) {
+  char path[VFS_PATH];
+  sys_stat_t st;
+
+  sys_snprintf(path, sizeof(path)-1, "%s%s/%s", w->root, name, w->file);
+
+  return sys_stat(path, &st) == 0;
+}
+
+// watches a database directory for writes to the file
+static int dbwatch_add_dir(dbwatch_t *w, char *name) {
+  dbwatch_dir_t *dirs;
+  char path[VFS_PATH];
+  int wd;
+
+  sys_snprintf(path, sizeof(path)-1, "%s%s", w->root, name);
+  if ((wd = sys_watch_add(w->sw, path, SYS_WATCH_CREATE | SYS_WATCH_WRITE | SYS_WATCH_DIR)) == -1) {
+    return -1;
+  }
+
+  if (dbwatch_find(w, wd) == NULL) {
+    if (w->numDirs == w->maxDirs) {
+      if ((dirs = xrealloc(w->dirs, (w->maxDirs + 64) * sizeof(dbwatch_dir_t))) == NULL) {
+        return -1;
+      }
+      w->dirs = dirs;
+      w->maxDirs += 64;
+    }
+    w->dirs[w->numDirs].wd = wd;
+    sys_strncpy(w->dirs[w->numDirs].name, name, DBWATCH_NAME - 1);
+    w->dirs[w->numDirs].name[DBWATCH_NAME - 1] = 0;
+    w->numDirs++;
+  }
+
+  return 0;
+}
+
+static void dbwatch_remove_dir(dbwatch_t *w, dbwatch_dir_t *dir) {
+  *dir = w->dirs[--w->numDirs];
+}
+
+// moves pending notifications into the ring, called with the mutex held
+static void dbwatch_drain(dbwatch_t *w) {
+  char name[VFS_NAME];
+  dbwatch_dir_t *dir;
+  int events, wd;
+
+  for (;;) {
+    if ((events = sys_watch_next(w->sw, &wd, name, sizeof(name))) <= 0) break;
+
+    if (events & SYS_WATCH_OVERFLOW) {
+      debug(DEBUG_INFO, "STOR", "watch \"%s\" lost notifications", w->root);
+      dbwatch_push(w, DBWATCH_RESCAN, "");
+      continue;
+    }
+
+    if (wd == w->rootWd) {
+      if (!(events & SYS_WATCH_DIR) || name[0] == 0 || name[0] == '.' || sys_strlen(name) >= DBWATCH_NAME) continue;
+      if (events & SYS_WATCH_CREATE) {
+        // the file may have been written before the directory was watched
+        dbwatch_add_dir(w, name);
+        dbwatch_push(w, DBWATCH_ADD, name);
+        if (dbwatch_file_exists(w, name)) {
+          dbwatch_push(w, DBWATCH_MODIFY, name);
+        }
+      } else if (events & SYS_WATCH_DELETE) {
+        dbwatch_push(w, DBWATCH_REMOVE, name);
+      }
+    } else if ((dir = dbwatch_find(w, wd)) != NULL) {
+      if (events & SYS_WATCH_IGNORED) {
+        dbwatch_remove_dir(w, dir);
+      } else if (!(events & SYS_WATCH_DIR) && !sys_strcmp(name, w->file)) {
+        dbwatch_push(w, DBWATCH_MODIFY, dir->name);
+      }
+    }
+  }
+}
+
+dbwatch_t *dbwatch_create(char *root, char *file) {
+  dbwatch_t *w;
+  sys_dir_t *dir;
+  sys_stat_t st;
+  char name[VFS_NAME], path[VFS_PATH];
+  int len;
+
+  if ((w = xcalloc(1, sizeof(dbwatch_t))) == NULL) {
+    return NULL;
+  }
+
+  len = sys_strlen(root);
+  sys_snprintf(w->root, sizeof(w->root)-1, "%s%s", root, (len && root[len-1] == '/') ? "" : "/");
+  sys_strncpy(w->file, file, DBWATCH_NAME - 1);
+
+  if ((w->sw = sys_watch_open()) == NULL) {
+    xfree(w);
+    return NULL;
+  }
+
+  if ((w->mutex = mutex_create("dbwatch")) == NULL ||
+      (w->rootWd = sys_watch_add(w->sw, w->root, SYS_WATCH_CREATE | SYS_WATCH_DELETE | SYS_WATCH_DIR)) == -1) {
+    dbwatch_destroy(w);
+    return NULL;
+  }
+
+  // directories created from now on are watched as their creation is seen
+  if ((dir = sys_opendir(w->root)) != NULL) {
+    while (sys_readdir(dir, name, sizeof(name)-1) == 0) {
+      if (name[0] == '.' || sys_strlen(name) >= DBWATCH_NAME) continue;
+      sys_snprintf(path, sizeof(path)-1, "%s%s", w->root, name);
+      if (sys_stat(path, &st) == 0 && (st.mode & SYS_IFDIR)) {
+        dbwatch_add_dir(w, name);
+      }
+    }
+    sys_closedir(dir);
+  }
+
+  debug(DEBUG_INFO, "STOR", "watching \"%s\" with %u databases", w->root, w->numDirs);
+
+  return w;
+}
+
+void dbwatch_destroy(dbwatch_t *w) {
+  if (w) {
+    if (w->sw) sys_watch_close(w->sw);
+    if (w->mutex) mutex_destroy(w->mutex);
+    if (w->dirs) xfree(w->dirs);
+    xfree(w);
+  }
+}
+
+// current end of the ring, a task starts reading from here before it scans the root
+uint32_t dbwatch_position(dbwatch_t *w) {
+  uint32_t pos = 0;
+
+  if (w && mutex_lock(w->mutex) == 0) {
+    dbwatch_drain(w);
+    pos = w->head;
+    mutex_unlock(w->mutex);
+  }
+
+  return pos;
+}
+
+// returns the next event after pos and advances pos, 0 if there is none
+int dbwatch_next(dbwatch_t *w, uint32_t *pos, char *name, int len) {
+  dbwatch_event_t *ev;
+  int type = 0;
+
+  if (w && mutex_lock(w->mutex) == 0) {
+    dbwatch_drain(w);
+    if (w->head - *pos > DBWATCH_EVENTS) {
+      *pos = w->head;
+      type = DBWATCH_RESCAN;
+    } else if (*pos != w->head) {
+      ev = &w->events[*pos % DBWATCH_EVENTS];
+      type = ev->type;
+      sys_strncpy(name, ev->name, len - 1);
+      name[len - 1] = 0;
+      (*pos)++;
+    }
+    mutex_unlock(w->mutex);
+  }
+
+  return type;
+}
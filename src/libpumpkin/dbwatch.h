@@ -0,0 +1,22 @@
+#ifndef PIT_DBWATCH_H
+#define PIT_DBWATCH_H
+
+// Change notification for a storage root. Database directories added to or
+// removed from the root, and writes to one given file inside each database
+// directory, are recorded in a ring of events shared by all tasks. Each task
+// keeps its own position in the ring. A task that falls too far behind, or a
+// lost notification, is told to rescan the root instead.
+
+#define DBWATCH_ADD    1
+#define DBWATCH_REMOVE 2
+#define DBWATCH_MODIFY 3
+#define DBWATCH_RESCAN 4
+
+typedef struct dbwatch_t dbwatch_t;
+
+dbwatch_t *dbwatch_create(char *root, char *file);
+void dbwatch_destroy(dbwatch_t *w);
+uint32_t dbwatch_position(dbwatch_t *w);
+int dbwatch_next(dbwatch_t *w, uint32_t *pos, char *name, int len);
+
+#endif
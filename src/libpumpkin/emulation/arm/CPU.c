@@ -46,6 +46,13 @@
 
 
 
+#define CPU_BLOCK_BITS	10	//number of cached blocks is 2^BITS
+#define CPU_BLOCK_LEN	32	//maximum number of instructions in a block
+
+#define CPU_SYSCALL_BASE	0x04000000UL	//native syscalls live above this address
+
+
+
 #define REG_NO_SP		13
 #define REG_NO_LR		14
 #define REG_NO_PC		15
@@ -70,6 +77,16 @@ struct ArmBankedRegs {
 };
 
 
+//straight-line code fetched once and replayed, valid for one icache generation
+struct ArmBlock {
+	uint32_t pc;			//address of the first instruction
+	uint32_t gen;
+	uint8_t T, M;			//mode the block was fetched in
+	uint8_t num;			//number of instructions
+	uint32_t instr[CPU_BLOCK_LEN];	//arm instructions, or thumb instructions in the low half
+};
+
+
 struct ArmCpu {
 	uint32_t regs[16];		//current active regs as per current mode
 	uint32_t SPSR;
@@ -98,6 +115,7 @@ struct ArmCpu {
 	uint32_t pid;			//for fcse
 	
 	struct icache *ic;
+	struct ArmBlock *blocks;
 	struct ArmMmu *mmu;
 	struct ArmMem *mem;
 	struct ArmCP15 *cp15;
@@ -808,6 +826,9 @@ static int cpuPrvMemOpEx(struct ArmCpu *cpu, void* buf, uint32_t vaddr, uint8_t
 		return 0;
 	}
 	
+	if (write)
+		icacheWrite(cpu->ic, vaddr, size);
+	
 	return 1;
 }
 
@@ -1840,7 +1861,7 @@ static void cpuPrvCycleArm(struct ArmCpu *cpu)
 	cpu->curInstrPC = fetchPc = pc = cpu->regs[REG_NO_PC];
 //debug(1, "XXX", "cpuPrvCycleArm pc=0x%08X", pc);
 	
-  if (fetchPc >= 0x04000000) {
+  if (fetchPc >= CPU_SYSCALL_BASE) {
     // native ARM syscall emulation: the address identifies which syscall is being called,
     // no matter which instruction is contained in that address.
     uint32_t group, function;
@@ -1849,6 +1870,7 @@ static void cpuPrvCycleArm(struct ArmCpu *cpu)
     debug(DEBUG_TRACE, "ARM", "native syscall group %d function 0x%04X", group, function);
     cpu->regs[0] = emupalmos_arm_syscall(group, function, cpu->regs[0], cpu->regs[1], cpu->regs[2], cpu->regs[3]);
 		cpu->regs[REG_NO_PC] = cpu->regs[REG_NO_LR]; // return from subroutine
+    icacheInval(cpu->ic); // the syscall may have written code behind our back
     return;
   }
 
@@ -1870,12 +1892,14 @@ static void cpuPrvCycleArm(struct ArmCpu *cpu)
 }
 
 
+static void cpuPrvExecThumb(struct ArmCpu *cpu, uint16_t instrT, int privileged);
+
 static void cpuPrvCycleThumb(struct ArmCpu *cpu) {
 	
-	int privileged, vB, specialPC = 0, ok;
-	uint32_t t, instr = 0xE0000000UL /*most likely thing*/, pc, fetchPc;
-	uint16_t instrT, v16;
-	uint8_t v8, fsr;
+	int privileged, ok;
+	uint32_t pc, fetchPc;
+	uint16_t instrT;
+	uint8_t fsr;
 
 	
 	privileged = cpu->M != ARM_SR_MODE_USR;
@@ -1892,6 +1916,16 @@ static void cpuPrvCycleThumb(struct ArmCpu *cpu) {
 		return;						//exit here so that debugger can see us execute first instr of execption handler
 	}
 	cpu->regs[REG_NO_PC] += 2;
+	
+	cpuPrvExecThumb(cpu, instrT, privileged);
+}
+
+static void cpuPrvExecThumb(struct ArmCpu *cpu, uint16_t instrT, int privileged) {
+	
+	int vB, specialPC = 0;
+	uint32_t t, instr = 0xE0000000UL /*most likely thing*/;
+	uint16_t v16;
+	uint8_t v8;
 
 	switch (instrT >> 12) {
 		
@@ -2192,6 +2226,7 @@ struct ArmCpu* cpuInit(uint32_t pc, struct ArmMem *mem, int xscale, int omap, ui
 
 		cpu->mmu = mmuInit(mem, xscale);
 		cpu->ic = icacheInit(mem, cpu->mmu);
+		cpu->blocks = (struct ArmBlock*)sys_calloc(1 << CPU_BLOCK_BITS, sizeof(struct ArmBlock));
 		cpu->cp15 = cp15Init(cpu, cpu->mmu, cpu->ic, cpuid, cacheId, xscale, omap);
 	}
 
@@ -2202,6 +2237,7 @@ void cpuDeinit(struct ArmCpu *cpu) {
   if (cpu) {
     cp15Deinit(cpu->cp15);
     icacheDeinit(cpu->ic);
+    if (cpu->blocks) sys_free(cpu->blocks);
     mmuDeinit(cpu->mmu);
     sys_free(cpu);
   }
@@ -2211,13 +2247,17 @@ uint32_t cpuReg(struct ArmCpu *cpu, uint8_t reg) {
   return cpu->regs[reg];
 }
 
-void cpuCycle(struct ArmCpu *cpu) {
+static void cpuPrvInterrupts(struct ArmCpu *cpu) {
 
 	if (unlikely(cpu->waitingFiqs && !cpu->F))
 		cpuPrvException(cpu, cpu->vectorBase + ARM_VECTOR_OFFT_FIQ, cpu->regs[REG_NO_PC] + 4, ARM_SR_MODE_FIQ | ARM_SR_I | ARM_SR_F);
 	else if (unlikely(cpu->waitingIrqs && !cpu->I))
 		cpuPrvException(cpu, cpu->vectorBase + ARM_VECTOR_OFFT_IRQ, cpu->regs[REG_NO_PC] + 4, ARM_SR_MODE_IRQ | ARM_SR_I);
+}
 
+void cpuCycle(struct ArmCpu *cpu) {
+
+	cpuPrvInterrupts(cpu);
 	cp15Cycle(cpu->cp15);
 
 	if (cpu->T)
@@ -2226,6 +2266,112 @@ void cpuCycle(struct ArmCpu *cpu) {
 		cpuPrvCycleArm(cpu);
 }
 
+//fetches and runs instructions from pc on, recording them in the block while control flows straight
+static uint32_t cpuPrvBlockRecord(struct ArmCpu *cpu, struct ArmBlock *b, uint32_t gen) {
+
+	uint32_t start, pc, fetchPc, instr = 0, step = cpu->T ? 2 : 4;
+	int privileged = cpu->M != ARM_SR_MODE_USR, failed = 0;
+	uint16_t instrT = 0;
+	uint8_t T = cpu->T, M = cpu->M, fsr, i;
+
+	start = cpu->regs[REG_NO_PC];
+	
+	for (i = 0; i < CPU_BLOCK_LEN;) {
+		cp15Cycle(cpu->cp15);
+		cpu->curInstrPC = fetchPc = pc = cpu->regs[REG_NO_PC];
+		if (i > 0 && pc >= CPU_SYSCALL_BASE)
+			break;
+		
+		//FCSE
+		if (fetchPc < 0x02000000UL)
+			fetchPc |= cpu->pid;
+		
+		if (!icacheFetch(cpu->ic, fetchPc, step, privileged, &fsr, T ? (void *)&instrT : (void *)&instr)) {
+			cpuPrvHandleMemErr(cpu, pc, step, 0, 1, fsr);
+			failed = 1;
+			break;
+		}
+		icacheMarkCode(cpu->ic, fetchPc);
+		b->instr[i++] = T ? instrT : instr;
+		
+		cpu->regs[REG_NO_PC] += step;
+		if (T)
+			cpuPrvExecThumb(cpu, instrT, privileged);
+		else
+			cpuPrvExecInstr(cpu, instr, 0, privileged, 0);
+		
+		if (cpu->regs[REG_NO_PC] != pc + step || cpu->T != T || cpu->M != M)
+			break;
+	}
+	
+	b->pc = start;
+	b->T = T;
+	b->M = M;
+	b->num = i;
+	b->gen = i ? gen : 0;	//a write into the block while recording already moved the generation on
+	
+	return i + failed;
+}
+
+//runs a recorded block, leaving it as soon as control does not flow straight or the code may have changed
+static uint32_t cpuPrvBlockReplay(struct ArmCpu *cpu, struct ArmBlock *b) {
+
+	uint32_t pc = b->pc, step = b->T ? 2 : 4;
+	int privileged = b->M != ARM_SR_MODE_USR;
+	uint8_t i;
+
+	for (i = 0; i < b->num;) {
+		cp15Cycle(cpu->cp15);
+		cpu->curInstrPC = pc;
+		pc += step;
+		cpu->regs[REG_NO_PC] = pc;
+		if (b->T)
+			cpuPrvExecThumb(cpu, b->instr[i++], privileged);
+		else
+			cpuPrvExecInstr(cpu, b->instr[i++], 0, privileged, 0);
+		
+		if (cpu->regs[REG_NO_PC] != pc || cpu->T != b->T || cpu->M != b->M || icacheGen(cpu->ic) != b->gen)
+			break;
+	}
+	
+	return i;
+}
+
+//Runs one block of straight-line code and returns the number of instructions executed, always at least one.
+//Blocks are fetched once and then replayed without going through the icache and the MMU again. Interrupts
+//are taken between blocks only, and a caller comparing pc against exit addresses only needs to do it here.
+uint32_t cpuRun(struct ArmCpu *cpu) {
+
+	struct ArmBlock *b;
+	uint32_t pc, gen;
+
+	cpuPrvInterrupts(cpu);
+	pc = cpu->regs[REG_NO_PC];
+	
+	if (pc >= CPU_SYSCALL_BASE || !cpu->blocks) {
+		cp15Cycle(cpu->cp15);
+		if (cpu->T)
+			cpuPrvCycleThumb(cpu);
+		else
+			cpuPrvCycleArm(cpu);
+		return 1;
+	}
+	
+	gen = icacheGen(cpu->ic);
+	b = &cpu->blocks[(pc >> (cpu->T ? 1 : 2)) & ((1 << CPU_BLOCK_BITS) - 1)];
+	
+	if (b->gen == gen && b->pc == pc && b->T == cpu->T && b->M == cpu->M)
+		return cpuPrvBlockReplay(cpu, b);
+	
+	return cpuPrvBlockRecord(cpu, b, gen);
+}
+
+//memory was written without going through the cpu, code may have changed
+void cpuInvalCode(struct ArmCpu *cpu) {
+
+	icacheInval(cpu->ic);
+}
+
 void cpuIrq(struct ArmCpu *cpu, int fiq, int raise) {	//unraise when acknowledged
 
 	if (fiq) {
@@ -2274,6 +2420,8 @@ void cpuSetCPAR(struct ArmCpu *cpu, uint16_t cpar)
 
 void cpuSetPid(struct ArmCpu *cpu, uint32_t pid)
 {
+	if (pid != cpu->pid)
+		icacheInval(cpu->ic);	//blocks are looked up before FCSE
 	cpu->pid = pid;
 }
 
@@ -61,6 +61,8 @@ struct ArmCpu *cpuInit(uint32_t pc, struct ArmMem *mem, int xscale, int omap, ui
 void cpuDeinit(struct ArmCpu *cpu);
 
 void cpuCycle(struct ArmCpu *cpu);
+uint32_t cpuRun(struct ArmCpu *cpu);  //runs one block of straight-line code, returns the number of instructions
+void cpuInvalCode(struct ArmCpu *cpu);
 void cpuIrq(struct ArmCpu *cpu, int fiq, int raise);  //unraise when acknowledged
 
 
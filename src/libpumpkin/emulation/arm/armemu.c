@@ -50,10 +50,20 @@ void armSetReg(arm_emu_t *arm, uint32_t reg, uint32_t value) {
  cpuSetReg(arm->cpu, reg, value);
 }
 
+void armInvalCode(arm_emu_t *arm) {
+  cpuInvalCode(arm->cpu);
+}
+
+// Runs at least n instructions. Code is run a block at a time, and the return and call68K
+// addresses can only be reached by a jump, that is, at the start of a block. When tracing,
+// instructions are run one by one so that each of them is disassembled.
 int armRun(arm_emu_t *arm, uint32_t n, uint32_t call68KAddr, call68KFunc_f f, uint32_t returnAddr) {
   uint32_t i, r, pc, a0, a1, a2, a3;
+  int trace;
+
+  trace = debug_getsyslevel("ARM") == DEBUG_TRACE;
 
-  for (i = 0; i < n && !emupalmos_finished(); i++) {
+  for (i = 0; i < n && !emupalmos_finished();) {
     pc = armGetReg(arm, 15);
     if (pc == returnAddr) {
       debug(DEBUG_TRACE, "EmuPalmOS", "armRun return address");
@@ -72,8 +82,15 @@ int armRun(arm_emu_t *arm, uint32_t n, uint32_t call68KAddr, call68KFunc_f f, ui
       a0 = armGetReg(arm, 14);
       armSetReg(arm, 15, a0);
 
-    } else {
+      // the 68K code may have written over ARM code
+      cpuInvalCode(arm->cpu);
+      i++;
+
+    } else if (trace) {
       cpuCycle(arm->cpu);
+      i++;
+    } else {
+      i += cpuRun(arm->cpu);
     }
   }
 
@@ -16,6 +16,10 @@
 #define ICACHE_BUCKET_SZ	(ICACHE_A)
 
 
+#define ICACHE_CODE_L		10	//granularity of the code page filter is 2^L bytes
+#define ICACHE_CODE_NUM		4096	//number of bits in the code page filter
+
+
 #define ICACHE_ADDR_MASK	((uint32_t)-ICACHE_LINE_SZ)
 #define ICACHE_USED_MASK	1UL
 #define ICACHE_PRIV_MASK	2UL
@@ -33,18 +37,36 @@ struct icache {
 	
 	struct icacheLine lines[ICACHE_BUCKET_NUM][ICACHE_BUCKET_SZ];
 	uint8_t ptr[ICACHE_BUCKET_NUM];
+	uint8_t used;	//some line was filled since the last invalidation
+	
+	//decoded code (the cpu block cache) is valid only within one generation, and the
+	//pages it came from are remembered so that data writes to them end the generation
+	uint32_t gen;
+	uint32_t code[ICACHE_CODE_NUM / 32];
 };
 
 
+static void icachePrvInvalCode(struct icache *ic)
+{
+	if (++ic->gen == 0)		//zero is never a valid generation
+		ic->gen = 1;
+	sys_memset(ic->code, 0, sizeof(ic->code));
+}
+
+
 void icacheInval(struct icache *ic)
 {
 	uint_fast16_t i, j;
 	
-	for (i = 0; i < ICACHE_BUCKET_NUM; i++) {
-		for(j = 0; j < ICACHE_BUCKET_SZ; j++)
-			ic->lines[i][j].info = 0;
-		ic->ptr[i] = 0;
+	if (ic->used) {
+		for (i = 0; i < ICACHE_BUCKET_NUM; i++) {
+			for(j = 0; j < ICACHE_BUCKET_SZ; j++)
+				ic->lines[i][j].info = 0;
+			ic->ptr[i] = 0;
+		}
+		ic->used = 0;
 	}
+	icachePrvInvalCode(ic);
 }
 
 struct icache* icacheInit(struct ArmMem* mem, struct ArmMmu *mmu)
@@ -56,6 +78,7 @@ struct icache* icacheInit(struct ArmMem* mem, struct ArmMmu *mmu)
 	
 		ic->mem = mem;
 		ic->mmu = mmu;
+		ic->used = 1;
 	
 		icacheInval(ic);
 	}
@@ -96,6 +119,33 @@ void icacheInvalAddr(struct icache* ic, uint32_t va)
 		if ((lines[j].info & (ICACHE_ADDR_MASK | ICACHE_USED_MASK)) == (va | ICACHE_USED_MASK))	//found it!
 			lines[j].info = 0;
 	}
+	
+	icachePrvInvalCode(ic);		//decoded code is not tracked per line
+}
+
+uint32_t icacheGen(struct icache *ic)
+{
+	return ic->gen;
+}
+
+static uint32_t icachePrvCodeBit(uint32_t va)
+{
+	return (va >> ICACHE_CODE_L) % ICACHE_CODE_NUM;
+}
+
+void icacheMarkCode(struct icache *ic, uint32_t va)
+{
+	uint32_t bit = icachePrvCodeBit(va);
+	
+	ic->code[bit / 32] |= 1UL << (bit % 32);
+}
+
+void icacheWrite(struct icache *ic, uint32_t va, uint32_t sz)
+{
+	uint32_t first = icachePrvCodeBit(va), last = icachePrvCodeBit(va + sz - 1);
+	
+	if ((ic->code[first / 32] & (1UL << (first % 32))) || (ic->code[last / 32] & (1UL << (last % 32))))
+		icachePrvInvalCode(ic);
 }
 
 int icacheFetch(struct icache* ic, uint32_t va, uint_fast8_t sz, int priviledged, uint_fast8_t* fsrP, void* buf)
@@ -182,6 +232,7 @@ debug(1, "XXX", "icacheFetch memAccess2");
 		}
 	
 		sys_memcpy(line->data, data, ICACHE_LINE_SZ);
+		ic->used = 1;
 		line->info = va | (priviledged ? ICACHE_PRIV_MASK : 0) | ICACHE_USED_MASK;
 	}
 		
@@ -15,4 +15,8 @@ int icacheFetch(struct icache *ic, uint32_t va, uint8_t sz, int priviledged, uin
 void icacheInval(struct icache *ic);
 void icacheInvalAddr(struct icache *ic, uint32_t addr);
 
+uint32_t icacheGen(struct icache *ic);	//changes whenever decoded code may be stale
+void icacheMarkCode(struct icache *ic, uint32_t va);
+void icacheWrite(struct icache *ic, uint32_t va, uint32_t sz);	//data write, ends the generation if it hits code
+
 #endif
@@ -200,10 +200,70 @@ uint32_t emupalmos_trap_out(void *address) {
 
 static uint32_t monitor_start = 0, monitor_end = 0;
 
+// The legacy screen starts at 0x2000 and its length depends on the depth of the display,
+// up to 160x160 pixels at 16 bits. The whole range is kept out of the page table, so that
+// changing the depth does not have to invalidate anything.
+#define LEGACY_SCREEN_START 0x00002000
+#define LEGACY_SCREEN_END   (LEGACY_SCREEN_START + 160 * 160 * 2)
+
+// Maps each page of plain RAM to its host address. Pages that must go through the slow path
+// (the legacy screen, monitored addresses and the incomplete last page) are left NULL.
+// Addresses beyond the table (the trap area and the registers) are always slow.
+static void emupalmos_map_pages(emu_state_t *state) {
+  uint8_t *ram = pumpkin_heap_base();
+  uint32_t i, n, start, end;
+
+  state->numPages = 0;
+
+  // memory hooks see every access
+  if (state->read_byte || state->read_word || state->read_long ||
+      state->write_byte || state->write_word || state->write_long) return;
+
+  n = pumpkin_heap_size() >> EMU_PAGE_BITS;
+  if (state->pages == NULL && (state->pages = xcalloc(n, sizeof(uint8_t *))) == NULL) return;
+  state->numPages = n;
+
+  for (i = 0; i < state->numPages; i++) {
+    start = i << EMU_PAGE_BITS;
+    end = start + EMU_PAGE_SIZE;
+    if ((start < LEGACY_SCREEN_END && end > LEGACY_SCREEN_START) ||
+        (monitor_start > 0 && start < monitor_end && end > monitor_start)) {
+      state->pages[i] = NULL;
+    } else {
+      state->pages[i] = ram + start;
+    }
+  }
+}
+
+// Returns the host address of the page holding n bytes at address, or NULL when the access has to take the slow path.
+static inline uint8_t *emupalmos_page(emu_state_t *state, uint32_t address, uint32_t n) {
+  uint32_t page = address >> EMU_PAGE_BITS;
+
+  if (page < state->numPages && (address & EMU_PAGE_MASK) <= EMU_PAGE_SIZE - n) {
+    return state->pages[page];
+  }
+
+  return NULL;
+}
+
+// Host address of the code at address, for the block cache of the 68K core.
+// Only code in plain RAM is cached, anything else is always fetched with cpu_read_word.
+uint8_t *cpu_code_pointer(uint32_t address) {
+  emu_state_t *state = pumpkin_get_local_storage(emu_key);
+  uint8_t *page;
+
+  if ((page = emupalmos_page(state, address, 2)) == NULL) return NULL;
+
+  return page + (address & EMU_PAGE_MASK);
+}
+
 void emupalmos_monitor(uint32_t addr, uint32_t size) {
+  emu_state_t *state = pumpkin_get_local_storage(emu_key);
+
   monitor_start = addr;
   monitor_end = addr + size;
   debug(DEBUG_INFO, "EmuPalmOS", "monitor access from 0x%08X to 0x%08X (%d bytes)", monitor_start, monitor_end-1, size);
+  if (state) emupalmos_map_pages(state);
 }
 
 static int emupalmos_check_address(uint32_t address, int size, int read) {
@@ -231,6 +291,7 @@ uint8_t cpu_read_byte(uint32_t address) {
   uint8_t *ram;
   uint32_t value;
 
+  if ((ram = emupalmos_page(state, address, 1)) != NULL) return READ_BYTE(ram, address & EMU_PAGE_MASK);
   if (state->read_byte) return state->read_byte(address);
 
   if (address >= 0xFFFFF000) {
@@ -253,12 +314,15 @@ uint8_t cpu_read_byte(uint32_t address) {
 
 uint16_t cpu_read_word(uint32_t address) {
   emu_state_t *state = pumpkin_get_local_storage(emu_key);
-  uint32_t size = pumpkin_heap_size();
+  uint32_t size;
   uint8_t *ram;
   uint32_t value;
 
+  if ((ram = emupalmos_page(state, address, 2)) != NULL) return READ_WORD(ram, address & EMU_PAGE_MASK);
   if (state->read_word) return state->read_word(address);
 
+  size = pumpkin_heap_size();
+
   if ((address & 1) == 0 && address >= size && address < (size + TRAPS_SIZE)) {
     debug(DEBUG_TRACE, "EmuPalmOS", "returning RTS for address 0x%08X", address);
     return 0x4E75; // RTS
@@ -288,6 +352,7 @@ uint32_t cpu_read_long(uint32_t address) {
   uint32_t b, value = 0;
   uint8_t *ram;
 
+  if ((ram = emupalmos_page(state, address, 4)) != NULL) return READ_LONG(ram, address & EMU_PAGE_MASK);
   if (state->read_long) return state->read_long(address);
 
   if (address >= 0xFFFFF000) {
@@ -331,6 +396,10 @@ void cpu_write_byte(uint32_t address, uint8_t value) {
   emu_state_t *state = pumpkin_get_local_storage(emu_key);
   uint8_t *ram;
 
+  if ((ram = emupalmos_page(state, address, 1)) != NULL) {
+    WRITE_BYTE(ram, address & EMU_PAGE_MASK, value);
+    return;
+  }
   if (state->write_byte) return state->write_byte(address, value);
 
   if (address >= 0xFFFFF000) {
@@ -352,6 +421,10 @@ void cpu_write_word(uint32_t address, uint16_t value) {
   emu_state_t *state = pumpkin_get_local_storage(emu_key);
   uint8_t *ram;
 
+  if ((ram = emupalmos_page(state, address, 2)) != NULL) {
+    WRITE_WORD(ram, address & EMU_PAGE_MASK, value);
+    return;
+  }
   if (state->write_word) return state->write_word(address, value);
 
   if (address >= 0xFFFFF000) {
@@ -374,6 +447,10 @@ void cpu_write_long(uint32_t address, uint32_t value) {
   emu_state_t *state = pumpkin_get_local_storage(emu_key);
   uint8_t *ram;
 
+  if ((ram = emupalmos_page(state, address, 4)) != NULL) {
+    WRITE_LONG(ram, address & EMU_PAGE_MASK, value);
+    return;
+  }
   if (state->write_long) return state->write_long(address, value);
 
   if (address >= 0xFFFFF000) {
@@ -1508,6 +1585,9 @@ uint32_t arm_native_call(uint32_t code, uint32_t data, uint32_t userData) {
   armSetReg(state->arm, 1, userData);
   armSetReg(state->arm, 2, callAddr);
 
+  // the code, and the addresses above, may have been written since the last call
+  armInvalCode(state->arm);
+
   for (; !emupalmos_finished();) {
     if (armRun(state->arm, 1000, callAddr, call68K_func, retAddr)) break;
   }
@@ -1620,6 +1700,36 @@ static int cpu_instr_callback(unsigned int pc) {
   return 0;
 }
 
+// Selects how 68K code runs for the current app (see appEngine* in AppRegistry.h).
+static void emupalmos_engine(emu_state_t *state) {
+  uint32_t creator = pumpkin_get_app_creator();
+  int engine = pumpkin_get_engine(creator);
+  char st[8];
+
+  switch (engine) {
+    case appEngineInterpreter:
+      break;
+    case appEngineBlocks:
+      m68k_set_block_cache(&state->m68k_state, M68K_BLOCK_ON);
+      break;
+    case appEngineCheck:
+      // the hook is still called for every instruction, so tracing works too
+      m68k_set_block_cache(&state->m68k_state, M68K_BLOCK_CHECK);
+      break;
+    default:
+      // blocks skip the per instruction hook, which is where instructions and traps are traced
+      if (!debug_on && debug_getsyslevel("Trap") != DEBUG_TRACE) {
+        m68k_set_block_cache(&state->m68k_state, M68K_BLOCK_ON);
+      }
+      break;
+  }
+
+  if (engine != appEngineDefault) {
+    pumpkin_id2s(creator, st);
+    debug(DEBUG_INFO, "EmuPalmOS", "using 68K engine %d for '%s'", engine, st);
+  }
+}
+
 static emu_state_t *emupalmos_new(void) {
   emu_state_t *state;
 
@@ -1650,6 +1760,8 @@ static emu_state_t *emupalmos_new(void) {
       uiFunctions[i]   = 0x04000000 | 0x00300000 | (i << 2); // group 3: UI
     }
 #endif
+    emupalmos_map_pages(state);
+    emupalmos_engine(state);
   }
 
   return state;
@@ -1665,6 +1777,8 @@ static void emupalmos_destroy(emu_state_t *state) {
     pumpkin_heap_free(ram + state->systable[3], "uiFunctions");
     pumpkin_heap_free(state->systable, "sysTable");
 #endif
+    if (state->pages) xfree(state->pages);
+    m68k_set_block_cache(&state->m68k_state, M68K_BLOCK_OFF);
     xfree(state);
   }
 }
@@ -1674,7 +1788,10 @@ int emupalmos_debug_on(void) {
 }
 
 void emupalmos_debug(int on) {
+  emu_state_t *state = pumpkin_get_local_storage(emu_key);
+
   debug_on = 1;
+  if (state) m68k_set_block_cache(&state->m68k_state, M68K_BLOCK_OFF);
 }
 
 int emupalmos_init(void) {
@@ -1836,6 +1953,8 @@ void emupalmos_memory_hooks(
   state->write_byte = write_byte;
   state->write_word = write_word;
   state->write_long = write_long;
+  emupalmos_map_pages(state);
+  m68k_set_block_cache(&state->m68k_state, M68K_BLOCK_OFF);
 }
 
 static uint8_t *getParamBlock(uint16_t launchCode, void *param, uint8_t *ram) {
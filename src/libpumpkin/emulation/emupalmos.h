@@ -40,6 +40,11 @@
 
 #define stackSize 4096
 
+// guest memory is mapped in pages of 4KB for the fast path of cpu_read_* and cpu_write_*
+#define EMU_PAGE_BITS 12
+#define EMU_PAGE_SIZE (1 << EMU_PAGE_BITS)
+#define EMU_PAGE_MASK (EMU_PAGE_SIZE - 1)
+
 #define sysTrapFrmGetEventHandler68K   0xA500
 #define sysTrapCtlGetStyle68K          0xA501
 #define sysTrapFrmGetGadgetPtr68K      0xA502
@@ -88,6 +93,8 @@ typedef struct {
   void (*write_word)(uint32_t address, uint16_t value);
   void (*write_long)(uint32_t address, uint32_t value);
   void *extra;
+  uint8_t **pages;
+  uint32_t numPages;
 } emu_state_t;
 
 emu_state_t *m68k_get_emu_state(void);
@@ -209,6 +209,12 @@ void m68k_write_memory_32(uint32_t address, uint32_t value);
  */
 void m68k_write_memory_32_pd(uint32_t address, uint32_t value);
 
+/* Host address of the code at a guest address, used by the block cache
+ * (see M68K_BLOCK_CACHE in m68kconf.h). Return NULL when the code at that
+ * address must always be fetched with the read functions above.
+ */
+uint8_t *m68k_code_pointer(uint32_t address);
+
 
 
 /* ======================================================================== */
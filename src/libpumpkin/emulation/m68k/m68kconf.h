@@ -164,6 +164,18 @@
 //#define M68K_INSTRUCTION_CALLBACK(pc) cpu_instr_callback(pc)
 
 
+/* If ON, the CPU will remember straight-line runs of instructions with their
+ * opcode handlers, and replay them without fetching and decoding each opcode
+ * again. The instruction hook is then called once per run instead of before
+ * every instruction. Runs are only recorded where m68k_code_pointer() returns
+ * a host address, and each opcode is compared with memory before it is
+ * replayed. Enable it per CPU with m68k_set_block_cache(), where the
+ * M68K_BLOCK_CHECK mode also compares every replayed instruction with what
+ * the interpreter would fetch and decode, and calls the hook for each one.
+ */
+#define M68K_BLOCK_CACHE            OPT_ON
+
+
 /* If ON, the CPU will emulate the 4-byte prefetch queue of a real 68000 */
 #define M68K_EMULATE_PREFETCH       OPT_OFF
 
@@ -212,6 +224,8 @@
 #define m68k_write_memory_16(A, V) cpu_write_word(A, V)
 #define m68k_write_memory_32(A, V) cpu_write_long(A, V)
 
+#define m68k_code_pointer(A) cpu_code_pointer(A)
+
 
 #endif /* M68K_COMPILE_FOR_MAME */
 
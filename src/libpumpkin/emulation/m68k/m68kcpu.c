@@ -41,6 +41,7 @@
 #include "m68kcpu.h"
 #include "m68kops.h"
 #include "debug.h"
+#include "xalloc.h"
 
 extern void m68040_fpu_op0(m68k_state_t *m68k_state);
 extern void m68040_fpu_op1(m68k_state_t *m68k_state);
@@ -970,6 +971,168 @@ void m68k_set_cpu_type(unsigned int cpu_type)
 	}
 }
 
+/* ======================================================================== */
+/* ============================== BLOCK CACHE ============================= */
+/* ======================================================================== */
+
+#if M68K_BLOCK_CACHE
+
+#define M68K_BLOCK_LINES    1024 /* blocks, indexed by their first address */
+#define M68K_BLOCK_SIZE     16   /* instructions per block */
+#define M68K_MAX_INSTR_SIZE 22   /* longest 68020 instruction, in bytes */
+
+/* A run of instructions as it was last executed from its first address.
+ * Nothing in a block is trusted when it is replayed: the PC and the opcode
+ * are checked before each instruction, so a block that no longer matches
+ * the code (taken branch, exception, self-modifying code, code loaded over
+ * freed memory) just stops the replay.
+ */
+typedef struct {
+	uint pc;    /* address of the first instruction, 0 when the line is empty */
+	uint8 *host;/* host address of the first instruction */
+	int num;
+	uint ipc[M68K_BLOCK_SIZE];
+	uint16 ir[M68K_BLOCK_SIZE];
+	void (*handler[M68K_BLOCK_SIZE])(m68k_state_t *m68k_state);
+} m68ki_block_t;
+
+typedef struct m68ki_block_cache_t {
+	int mode;           /* M68K_BLOCK_ON or M68K_BLOCK_CHECK */
+	uint mismatches;    /* instructions the interpreter would have run differently */
+	m68ki_block_t *rec; /* block being recorded */
+	m68ki_block_t lines[M68K_BLOCK_LINES];
+} m68ki_block_cache_t;
+
+#define M68K_BLOCK_LINE(cache, pc) (&(cache)->lines[((pc) >> 1) & (M68K_BLOCK_LINES-1)])
+
+int m68k_set_block_cache(m68k_state_t *m68k_state, int mode)
+{
+	if (mode != M68K_BLOCK_OFF) {
+		if (m68k_state->blocks == NULL) {
+			m68k_state->blocks = xcalloc(1, sizeof(m68ki_block_cache_t));
+			if (m68k_state->blocks == NULL) return -1;
+		}
+		m68k_state->blocks->mode = mode;
+	} else if (m68k_state->blocks) {
+		if (m68k_state->blocks->mode == M68K_BLOCK_CHECK) {
+			debug(DEBUG_INFO, "M68K", "block cache checked, %u mismatches", m68k_state->blocks->mismatches);
+		}
+		xfree(m68k_state->blocks);
+		m68k_state->blocks = NULL;
+	}
+
+	return 0;
+}
+
+/* In check mode every replayed instruction is also fetched and decoded the way
+ * the interpreter does it, and the instruction hook is called for it. Returns
+ * 0 when both agree, otherwise the interpreter runs the instruction instead.
+ */
+static int m68ki_block_check(m68k_state_t *m68k_state, m68ki_block_t *b, int i, uint8 *p)
+{
+	m68ki_block_cache_t *cache = m68k_state->blocks;
+	uint ir;
+
+	ir = m68k_read_memory_16(ADDRESS_68K(REG_PC));
+	if (m68k_code_pointer(REG_PC) != p || ir != b->ir[i] || m68ki_instruction_jump_table[ir] != b->handler[i]) {
+		debug(DEBUG_ERROR, "M68K", "block 0x%08X instruction %d at 0x%08X: cached opcode 0x%04X, interpreter opcode 0x%04X",
+			b->pc, i, REG_PC, b->ir[i], ir);
+		cache->mismatches++;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Called with every instruction executed outside a block. An instruction
+ * that starts shortly after the last one recorded extends the block, any
+ * other starts a new block in its line. A short forward branch may be taken
+ * for straight-line code, which is harmless since replay checks the PC.
+ */
+static void m68ki_block_record(m68ki_block_cache_t *cache, uint pc, uint ir)
+{
+	m68ki_block_t *b = cache->rec;
+	uint8 *host;
+	uint last;
+
+	if (b && b->num > 0 && b->num < M68K_BLOCK_SIZE) {
+		last = b->ipc[b->num-1];
+		if (pc > last && pc - last <= M68K_MAX_INSTR_SIZE && (host = m68k_code_pointer(pc)) != NULL && host == b->host + (pc - b->pc)) {
+			b->ipc[b->num] = pc;
+			b->ir[b->num] = ir;
+			b->handler[b->num] = m68ki_instruction_jump_table[ir];
+			b->num++;
+			return;
+		}
+	}
+
+	cache->rec = NULL;
+	if (pc == 0 || (pc & 1) || (host = m68k_code_pointer(pc)) == NULL) return;
+
+	b = M68K_BLOCK_LINE(cache, pc);
+	b->pc = pc;
+	b->host = host;
+	b->ipc[0] = pc;
+	b->ir[0] = ir;
+	b->handler[0] = m68ki_instruction_jump_table[ir];
+	b->num = 1;
+	cache->rec = b;
+}
+
+/* Replays the block starting at REG_PC, returns the number of instructions
+ * executed, or -1 when the instruction hook asked to stop (check mode only)
+ */
+static int m68ki_block_execute(m68k_state_t *m68k_state)
+{
+	m68ki_block_cache_t *cache = m68k_state->blocks;
+	m68ki_block_t *b = M68K_BLOCK_LINE(cache, REG_PC);
+	uint8 *p;
+	int i, j;
+
+	if (b->pc != REG_PC || b->num == 0) return 0;
+
+	for (i = 0; i < b->num;) {
+		/* the line may be recorded again by a nested m68k_execute, so it is read fresh every time */
+		p = b->host + (b->ipc[i] - b->pc);
+		if (REG_PC != b->ipc[i] || ((p[0] << 8) | p[1]) != b->ir[i]) break;
+		if (cache->mode == M68K_BLOCK_CHECK) {
+			/* the hook was already called for the first instruction */
+			if (i > 0 && m68ki_instr_hook(REG_PC) == -1) return -1;
+			if (m68ki_block_check(m68k_state, b, i, p) == -1) break;
+		}
+
+		m68ki_trace_t1(); /* auto-disable (see m68kcpu.h) */
+		m68ki_use_data_space(); /* auto-disable (see m68kcpu.h) */
+
+		REG_PPC = REG_PC;
+		for (j = 15; j >= 0; j--){
+			REG_DA_SAVE[j] = REG_DA[j];
+		}
+
+		REG_IR = b->ir[i];
+		REG_PC += 2;
+		b->handler[i++](m68k_state);
+		USE_CYCLES(CYC_INSTRUCTION[REG_IR]);
+
+		m68ki_exception_if_trace(); /* auto-disable (see m68kcpu.h) */
+		if (GET_CYCLES() <= 0 || CPU_STOPPED || m68k_state->finish) break;
+	}
+
+	/* when the first instruction does not match, it is executed and recorded again as usual */
+	if (i > 0) cache->rec = NULL;
+
+	return i;
+}
+
+#else
+
+int m68k_set_block_cache(m68k_state_t *m68k_state, int mode)
+{
+	return mode != M68K_BLOCK_OFF ? -1 : 0;
+}
+
+#endif /* M68K_BLOCK_CACHE */
+
 /* Execute some instructions until we use up num_cycles clock cycles */
 /* ASG: removed per-instruction interrupt checks */
 int m68k_execute(m68k_state_t *m68k_state, int num_cycles)
@@ -1013,6 +1176,15 @@ int m68k_execute(m68k_state_t *m68k_state, int num_cycles)
 
 			/* Record previous program counter */
 			if (REG_PC == 0) return -1;
+
+#if M68K_BLOCK_CACHE
+			/* Replay a known run of instructions, the hook was called for its first one */
+			if (m68k_state->blocks) {
+				int n = m68ki_block_execute(m68k_state);
+				if (n == -1) return -1;
+				if (n > 0) continue;
+			}
+#endif
 			REG_PPC = REG_PC;
 
 			/* Record previous D/A register state (in case of bus error) */
@@ -1022,6 +1194,9 @@ int m68k_execute(m68k_state_t *m68k_state, int num_cycles)
 
 			/* Read an instruction and call its handler */
 			REG_IR = m68ki_read_imm_16();
+#if M68K_BLOCK_CACHE
+			if (m68k_state->blocks) m68ki_block_record(m68k_state->blocks, REG_PPC, REG_IR);
+#endif
 			m68ki_instruction_jump_table[REG_IR](m68k_state);
 			USE_CYCLES(CYC_INSTRUCTION[REG_IR]);
 
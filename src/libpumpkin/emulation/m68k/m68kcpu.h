@@ -1031,6 +1031,7 @@ typedef struct {
   uint s_m68ki_aerr_fc;
   //jmp_buf s_m68ki_bus_error_jmp_buf;
   int finish;
+  struct m68ki_block_cache_t *blocks;
 } m68k_state_t;
 
 m68k_state_t *m68k_get_state(void);
@@ -1038,6 +1039,13 @@ m68k_state_t *m68k_get_state(void);
 
 int m68k_execute(m68k_state_t *m68k_state, int num_cycles);
 
+/* Block cache modes (see M68K_BLOCK_CACHE in m68kconf.h) */
+#define M68K_BLOCK_OFF   0 /* interpret every instruction */
+#define M68K_BLOCK_ON    1 /* replay cached blocks */
+#define M68K_BLOCK_CHECK 2 /* replay cached blocks, checking each instruction against the interpreter */
+
+int m68k_set_block_cache(m68k_state_t *m68k_state, int mode);
+
 /* Forward declarations to keep some of the macros happy */
 static inline uint m68ki_read_16_fc (uint address, uint fc);
 static inline uint m68ki_read_32_fc (uint address, uint fc);
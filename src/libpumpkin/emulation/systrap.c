@@ -37,7 +37,16 @@ static void palmos_libtrap(uint16_t refNum, uint16_t trap) {
   }
 }
 
-static int palmos_systrap_gen(uint16_t trap) {
+// Traps are dispatched by the switch statements below, which the compiler turns into jump
+// tables indexed by the trap number. What used to dominate the cost of a trap was tracing:
+// every trap body logs its arguments at DEBUG_TRACE level, and each message looked up the
+// level and evaluated its arguments even when nothing was printed. Within this file trace
+// messages are skipped unless palmos_systrap found the emulator tracing.
+#undef debug
+#define debug(level, sys, fmt, args...) \
+  do { if ((level) < DEBUG_TRACE || trace) debug_full(__FILE__, __FUNCTION__, __LINE__, level, sys, fmt, ##args); } while (0)
+
+static int palmos_systrap_gen(uint16_t trap, int trace) {
   uint32_t sp;
   uint16_t idx;
   int handled = 1;
@@ -62,14 +71,17 @@ uint32_t palmos_systrap(uint16_t trap) {
   char *s;
   Err err;
   emu_state_t *state = m68k_get_emu_state();
+  int trace = debug_getsyslevel("EmuPalmOS") == DEBUG_TRACE;
   uint32_t r = 0;
 
   // MathLib seems to use trap numbers like 0x0306 instead of 0xA306.
   trap = (trap & 0x0FFF) | 0xA000;
-  s = trapName(trap, &selector, 0);
-  debug(DEBUG_TRACE, "EmuPalmOS", "trap 0x%04X begin (%s)", trap, s ? s : "unknown");
+  if (trace) {
+    s = trapName(trap, &selector, 0);
+    debug(DEBUG_TRACE, "EmuPalmOS", "trap 0x%04X begin (%s)", trap, s ? s : "unknown");
+  }
 
-  if (palmos_systrap_gen(trap)) {
+  if (palmos_systrap_gen(trap, trace)) {
     debug(DEBUG_TRACE, "EmuPalmOS", "trap 0x%04X end (gen)", trap);
     pumpkin_debug_check();
     return 0;
@@ -0,0 +1,419 @@
+#include "sys.h"
+#include "mutex.h"
+#include "vfs.h"
+#include "bytes.h"
+#include "xalloc.h"
+#include "debug.h"
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC  'PJnl'
+
+// group header: magic, size of the operations, checksum of the operations, number of operations
+#define JOURNAL_HEADER 16
+
+// operation header: op, offset, size, length of the first path, length of the second path
+#define JOURNAL_OP     16
+
+#define JOURNAL_PUT    1
+#define JOURNAL_WRITE  2
+#define JOURNAL_UNLINK 3
+#define JOURNAL_RENAME 4
+
+// the journal is emptied when it grows past this size
+#define JOURNAL_LIMIT  (256*1024)
+
+// files waiting to be synced before the journal can be emptied
+#define JOURNAL_FILES  64
+
+#define JOURNAL_PAGE   4096
+
+struct journal_t {
+  mutex_t *mutex;
+  cond_t *cond;
+  vfs_session_t *session;
+  vfs_file_t *f;
+  char path[VFS_PATH];
+  uint32_t size;
+  char (*files)[VFS_PATH];
+  uint32_t numFiles;
+  uint32_t applying;
+  uint32_t groups, checkpoints;
+};
+
+struct journal_tx_t {
+  journal_t *j;
+  uint8_t *buf;
+  uint32_t size, capacity, count, renames;
+};
+
+static uint32_t journal_checksum(uint8_t *buf, uint32_t size) {
+  uint32_t h = 2166136261u;
+  uint32_t i;
+
+  for (i = 0; i < size; i++) {
+    h = (h ^ buf[i]) * 16777619u;
+  }
+
+  return h;
+}
+
+static int journal_sync_file(journal_t *j, char *path) {
+  vfs_file_t *f;
+  int r = -1;
+
+  if (vfs_checktype(j->session, path) == VFS_FILE && (f = vfs_open(j->session, path, VFS_WRITE)) != NULL) {
+    r = vfs_sync(f);
+    vfs_close(f);
+  }
+
+  return r;
+}
+
+static void journal_sync_files(journal_t *j) {
+  uint32_t i;
+
+  for (i = 0; i < j->numFiles; i++) {
+    journal_sync_file(j, j->files[i]);
+  }
+  j->numFiles = 0;
+}
+
+// Remembers a file written by a group, so that it is synced before the group
+// leaves the journal. Groups applied outside the journal mutex take it here.
+static void journal_touch(journal_t *j, char *path, int locked) {
+  uint32_t i;
+
+  if (!locked && mutex_lock(j->mutex) != 0) return;
+
+  for (i = 0; i < j->numFiles; i++) {
+    if (!sys_strcmp(j->files[i], path)) break;
+  }
+
+  if (i == j->numFiles) {
+    if (j->numFiles < JOURNAL_FILES) {
+      sys_strncpy(j->files[j->numFiles++], path, VFS_PATH - 1);
+    } else {
+      journal_sync_file(j, path);
+    }
+  }
+
+  if (!locked) mutex_unlock(j->mutex);
+}
+
+static int journal_apply_op(journal_t *j, uint32_t op, uint32_t offset, char *path1, char *path2, uint8_t *data, uint32_t size, int locked) {
+  vfs_file_t *f;
+  int r = -1;
+
+  switch (op) {
+    case JOURNAL_PUT:
+      if ((f = vfs_open(j->session, path1, VFS_WRITE | VFS_TRUNC)) != NULL) {
+        r = (size == 0 || vfs_write(f, data, size) == size) ? 0 : -1;
+        vfs_close(f);
+        journal_touch(j, path1, locked);
+      }
+      break;
+    case JOURNAL_WRITE:
+      if ((f = vfs_open(j->session, path1, VFS_WRITE)) != NULL) {
+        if (vfs_seek(f, offset, 0) == offset && vfs_write(f, data, size) == size) {
+          r = 0;
+        }
+        vfs_close(f);
+        journal_touch(j, path1, locked);
+      }
+      break;
+    case JOURNAL_UNLINK:
+      r = vfs_unlink(j->session, path1);
+      break;
+    case JOURNAL_RENAME:
+      if ((r = vfs_rename(j->session, path1, path2)) == 0) {
+        journal_touch(j, path2, locked);
+      }
+      break;
+  }
+
+  return r;
+}
+
+// Applies the operations of a group. Returns -1 if the group is malformed,
+// failed operations are only logged, since a replayed group may find some of
+// its operations already done.
+static int journal_apply(journal_t *j, uint8_t *buf, uint32_t size, uint32_t count, int locked) {
+  char path1[VFS_PATH], path2[VFS_PATH];
+  uint32_t op, offset, len, i, k;
+  uint16_t len1, len2;
+
+  for (i = 0, k = 0; k < count; k++) {
+    if (i + JOURNAL_OP > size) return -1;
+    i += get4b(&op, buf, i);
+    i += get4b(&offset, buf, i);
+    i += get4b(&len, buf, i);
+    i += get2b(&len1, buf, i);
+    i += get2b(&len2, buf, i);
+    if (len1 >= VFS_PATH || len2 >= VFS_PATH || i + len1 + len2 > size || i + len1 + len2 + len < i || i + len1 + len2 + len > size) return -1;
+    xmemcpy(path1, &buf[i], len1);
+    path1[len1] = 0;
+    i += len1;
+    xmemcpy(path2, &buf[i], len2);
+    path2[len2] = 0;
+    i += len2;
+    if (journal_apply_op(j, op, offset, path1, path2, &buf[i], len, locked) == -1) {
+      debug(DEBUG_INFO, "STOR", "journal operation %u on \"%s\" failed", op, path1);
+    }
+    i += len;
+  }
+
+  return 0;
+}
+
+// Applies again every complete group found in the journal. A group with a
+// bad size or checksum was being written when the crash happened, so it was
+// never applied and it is where the valid part of the journal ends.
+static int journal_replay(journal_t *j) {
+  uint8_t header[JOURNAL_HEADER], *buf;
+  uint32_t total, magic, size, checksum, count, i, n;
+  vfs_file_t *f;
+
+  if (vfs_checktype(j->session, j->path) != VFS_FILE) return 0;
+  if ((f = vfs_open(j->session, j->path, VFS_READ)) == NULL) return -1;
+
+  total = vfs_seek(f, 0, 1);
+  vfs_seek(f, 0, 0);
+  n = 0;
+
+  if (total != 0xFFFFFFFF && total > 0) {
+    for (i = 0; i + JOURNAL_HEADER <= total; i += JOURNAL_HEADER + size) {
+      if (vfs_read(f, header, JOURNAL_HEADER) != JOURNAL_HEADER) break;
+      get4b(&magic, header, 0);
+      get4b(&size, header, 4);
+      get4b(&checksum, header, 8);
+      get4b(&count, header, 12);
+      if (magic != JOURNAL_MAGIC || size > total - i - JOURNAL_HEADER) break;
+      if ((buf = xcalloc(1, size ? size : 1)) == NULL) break;
+      if (vfs_read(f, buf, size) != size || journal_checksum(buf, size) != checksum || journal_apply(j, buf, size, count, 1) != 0) {
+        xfree(buf);
+        break;
+      }
+      xfree(buf);
+      n++;
+    }
+    if (n > 0 || i < total) {
+      debug(DEBUG_INFO, "STOR", "journal \"%s\" replayed %u groups, %u bytes discarded", j->path, n, total - i);
+    }
+  }
+  vfs_close(f);
+
+  return 0;
+}
+
+journal_t *journal_open(char *path) {
+  journal_t *j;
+
+  if ((j = xcalloc(1, sizeof(journal_t))) != NULL) {
+    sys_strncpy(j->path, path, VFS_PATH - 1);
+    j->mutex = mutex_create("journal");
+    j->cond = cond_create("journal");
+    j->session = vfs_open_session();
+    j->files = xcalloc(JOURNAL_FILES, VFS_PATH);
+
+    if (j->mutex && j->cond && j->session && j->files) {
+      // what was replayed is synced before the old journal is gone
+      journal_replay(j);
+      journal_sync_files(j);
+      if ((j->f = vfs_open(j->session, j->path, VFS_RDWR | VFS_TRUNC)) != NULL) {
+        vfs_sync(j->f);
+        return j;
+      }
+      debug(DEBUG_ERROR, "STOR", "journal \"%s\" could not be created", path);
+    }
+
+    if (j->files) xfree(j->files);
+    if (j->session) vfs_close_session(j->session);
+    if (j->cond) cond_destroy(j->cond);
+    if (j->mutex) mutex_destroy(j->mutex);
+    xfree(j);
+  }
+
+  return NULL;
+}
+
+void journal_close(journal_t *j) {
+  if (j) {
+    journal_checkpoint(j);
+    debug(DEBUG_INFO, "STOR", "journal \"%s\": %u groups, %u checkpoints", j->path, j->groups, j->checkpoints);
+    vfs_close(j->f);
+    xfree(j->files);
+    vfs_close_session(j->session);
+    cond_destroy(j->cond);
+    mutex_destroy(j->mutex);
+    xfree(j);
+  }
+}
+
+// Must only be called when no group is being applied, since the groups being
+// applied are still needed in the journal if a crash happens.
+static int journal_checkpoint_locked(journal_t *j) {
+  if (j->size == 0 && j->numFiles == 0) return 0;
+
+  journal_sync_files(j);
+  j->size = 0;
+  j->checkpoints++;
+
+  if (vfs_truncate(j->f, 0) != 0) return -1;
+
+  return vfs_sync(j->f);
+}
+
+int journal_checkpoint(journal_t *j) {
+  int r = -1;
+
+  if (j && mutex_lock(j->mutex) == 0) {
+    while (j->applying > 0) cond_wait(j->cond, j->mutex);
+    r = journal_checkpoint_locked(j);
+    mutex_unlock(j->mutex);
+  }
+
+  return r;
+}
+
+journal_tx_t *journal_begin(journal_t *j) {
+  journal_tx_t *tx;
+
+  if (j == NULL) return NULL;
+
+  if ((tx = xcalloc(1, sizeof(journal_tx_t))) != NULL) {
+    if ((tx->buf = xcalloc(1, JOURNAL_PAGE)) != NULL) {
+      tx->j = j;
+      tx->capacity = JOURNAL_PAGE;
+      tx->size = JOURNAL_HEADER;
+    } else {
+      xfree(tx);
+      tx = NULL;
+    }
+  }
+
+  return tx;
+}
+
+static int journal_add(journal_tx_t *tx, uint32_t op, char *path1, char *path2, uint32_t offset, uint8_t *buf, uint32_t size) {
+  uint32_t len1, len2, need, capacity;
+  uint8_t *p;
+  int i;
+
+  if (tx == NULL || path1 == NULL) return -1;
+
+  len1 = sys_strlen(path1);
+  len2 = path2 ? sys_strlen(path2) : 0;
+  if (len1 >= VFS_PATH || len2 >= VFS_PATH) return -1;
+
+  need = tx->size + JOURNAL_OP + len1 + len2 + size;
+  if (need < tx->size) return -1;
+  if (need > tx->capacity) {
+    for (capacity = tx->capacity; capacity < need; capacity *= 2);
+    if ((p = xrealloc(tx->buf, capacity)) == NULL) return -1;
+    tx->buf = p;
+    tx->capacity = capacity;
+  }
+
+  i = tx->size;
+  i += put4b(op, tx->buf, i);
+  i += put4b(offset, tx->buf, i);
+  i += put4b(size, tx->buf, i);
+  i += put2b(len1, tx->buf, i);
+  i += put2b(len2, tx->buf, i);
+  xmemcpy(&tx->buf[i], path1, len1);
+  i += len1;
+  if (len2) xmemcpy(&tx->buf[i], path2, len2);
+  i += len2;
+  if (size) {
+    if (buf) {
+      xmemcpy(&tx->buf[i], buf, size);
+    } else {
+      xmemset(&tx->buf[i], 0, size);
+    }
+  }
+  tx->size = need;
+  tx->count++;
+
+  return 0;
+}
+
+// Replaces the contents of a file. A NULL buf writes a file filled with zeros.
+int journal_put(journal_tx_t *tx, char *path, uint8_t *buf, uint32_t size) {
+  return journal_add(tx, JOURNAL_PUT, path, NULL, 0, buf, size);
+}
+
+// Writes at an offset of an existing file, without truncating it.
+int journal_write(journal_tx_t *tx, char *path, uint32_t offset, uint8_t *buf, uint32_t size) {
+  return buf ? journal_add(tx, JOURNAL_WRITE, path, NULL, offset, buf, size) : -1;
+}
+
+int journal_unlink(journal_tx_t *tx, char *path) {
+  return journal_add(tx, JOURNAL_UNLINK, path, NULL, 0, NULL, 0);
+}
+
+int journal_rename(journal_tx_t *tx, char *path1, char *path2) {
+  if (path2 == NULL || journal_add(tx, JOURNAL_RENAME, path1, path2, 0, NULL, 0) != 0) return -1;
+  tx->renames++;
+
+  return 0;
+}
+
+// The group is written to the journal under the journal mutex and applied
+// outside of it, so that a task applying a large group does not hold up the
+// others. A group with renames is the exception: it waits for the groups being
+// applied, is applied under the mutex and empties the journal right away.
+int journal_commit(journal_tx_t *tx) {
+  journal_t *j;
+  uint32_t size;
+  int r = -1;
+
+  if (tx == NULL) return -1;
+  j = tx->j;
+
+  if (tx->count == 0) {
+    r = 0;
+  } else if (mutex_lock(j->mutex) == 0) {
+    if (tx->renames) {
+      while (j->applying > 0) cond_wait(j->cond, j->mutex);
+    }
+
+    size = tx->size - JOURNAL_HEADER;
+    put4b(JOURNAL_MAGIC, tx->buf, 0);
+    put4b(size, tx->buf, 4);
+    put4b(journal_checksum(&tx->buf[JOURNAL_HEADER], size), tx->buf, 8);
+    put4b(tx->count, tx->buf, 12);
+
+    if (vfs_seek(j->f, j->size, 0) == j->size && vfs_write(j->f, tx->buf, tx->size) == tx->size && vfs_sync(j->f) == 0) {
+      j->size += tx->size;
+      j->groups++;
+      r = 0;
+    } else {
+      // the group is not in the journal, so it is applied like an unjournaled update
+      debug(DEBUG_ERROR, "STOR", "journal \"%s\" write failed", j->path);
+      vfs_truncate(j->f, j->size);
+    }
+
+    if (tx->renames) {
+      // unlike the other operations a rename is not safe to apply twice: replayed
+      // after later groups it would move whatever they created at the old path
+      journal_apply(j, &tx->buf[JOURNAL_HEADER], size, tx->count, 1);
+      journal_checkpoint_locked(j);
+    } else {
+      j->applying++;
+      mutex_unlock(j->mutex);
+      journal_apply(j, &tx->buf[JOURNAL_HEADER], size, tx->count, 0);
+      mutex_lock(j->mutex);
+      if (--j->applying == 0) {
+        if (j->size >= JOURNAL_LIMIT) journal_checkpoint_locked(j);
+        cond_broadcast(j->cond);
+      }
+    }
+    mutex_unlock(j->mutex);
+  }
+
+  xfree(tx->buf);
+  xfree(tx);
+
+  return r;
+}
@@ -0,0 +1,33 @@
+#ifndef PIT_JOURNAL_H
+#define PIT_JOURNAL_H
+
+// Write ahead journal of a storage root. Updates that span several files are
+// collected in a transaction and committed as a group: the group is appended
+// to the journal and synced once, and only then applied to the files. Groups
+// left in the journal by a crash are applied again when the journal is
+// opened. Once the journal grows past a limit the files it touched are synced
+// and the journal is emptied, and so it is right after any group that renames
+// a file, since only the last group can then be replayed over a done rename.
+// The journal is shared by all tasks. Groups are applied outside the journal
+// mutex, so groups that update the same files must be committed in order by
+// the caller's own locking.
+//
+// Operations added to a transaction reach the files only when it is
+// committed: until then a reader, including the task that owns the
+// transaction, still sees the old contents. A transaction must not depend on
+// reading back what it has put or written.
+
+typedef struct journal_t journal_t;
+typedef struct journal_tx_t journal_tx_t;
+
+journal_t *journal_open(char *path);
+void journal_close(journal_t *j);
+int journal_checkpoint(journal_t *j);
+journal_tx_t *journal_begin(journal_t *j);
+int journal_put(journal_tx_t *tx, char *path, uint8_t *buf, uint32_t size);
+int journal_write(journal_tx_t *tx, char *path, uint32_t offset, uint8_t *buf, uint32_t size);
+int journal_unlink(journal_tx_t *tx, char *path);
+int journal_rename(journal_tx_t *tx, char *path1, char *path2);
+int journal_commit(journal_tx_t *tx);
+
+#endif
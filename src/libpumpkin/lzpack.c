@@ -0,0 +1,159 @@
+#include "sys.h"
+#include "xalloc.h"
+#include "debug.h"
+
+#include "lzpack.h"
+
+#define LZPACK_HASH_BITS  12
+#define LZPACK_MIN_MATCH  4
+#define LZPACK_MAX_OFFSET 65535
+
+// the last bytes of a block are always literals, and no match starts close to the end
+#define LZPACK_LAST_LITERALS 5
+#define LZPACK_MFLIMIT       12
+
+static uint32_t lzpack_read32(uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t lzpack_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZPACK_HASH_BITS);
+}
+
+static int lzpack_length(uint8_t *dst, uint32_t *o, uint32_t max, uint32_t len) {
+  for (; len >= 255; len -= 255) {
+    if (*o >= max) return -1;
+    dst[(*o)++] = 255;
+  }
+  if (*o >= max) return -1;
+  dst[(*o)++] = len;
+
+  return 0;
+}
+
+// writes a sequence: a run of literals followed by a match, or by nothing at the end of the block
+static int lzpack_sequence(uint8_t *dst, uint32_t *o, uint32_t max, uint8_t *lit, uint32_t litLen, uint32_t offset, uint32_t matchLen) {
+  uint32_t t;
+  uint8_t token;
+
+  if ((t = *o) >= max) return -1;
+  token = (litLen >= 15 ? 15 : litLen) << 4;
+  if (matchLen) token |= (matchLen - LZPACK_MIN_MATCH >= 15) ? 15 : matchLen - LZPACK_MIN_MATCH;
+  (*o)++;
+
+  if (litLen >= 15 && lzpack_length(dst, o, max, litLen - 15) == -1) return -1;
+  if (litLen > max - *o) return -1;
+  xmemcpy(&dst[*o], lit, litLen);
+  *o += litLen;
+
+  if (matchLen) {
+    if (*o + 2 > max) return -1;
+    dst[(*o)++] = offset & 0xFF;
+    dst[(*o)++] = offset >> 8;
+    if (matchLen - LZPACK_MIN_MATCH >= 15 && lzpack_length(dst, o, max, matchLen - LZPACK_MIN_MATCH - 15) == -1) return -1;
+  }
+  dst[t] = token;
+
+  return 0;
+}
+
+// Returns the compressed size, or 0 when the result would not fit in max bytes.
+int lzpack_compress(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max) {
+  uint32_t *table, ip, ref, anchor, limit, matchLimit, len, v, h, o;
+
+  if (src == NULL || dst == NULL) return 0;
+  if ((table = xcalloc(1 << LZPACK_HASH_BITS, sizeof(uint32_t))) == NULL) return 0;
+
+  o = 0;
+  anchor = 0;
+
+  if (size > LZPACK_MFLIMIT) {
+    limit = size - LZPACK_MFLIMIT;
+    matchLimit = size - LZPACK_LAST_LITERALS;
+
+    for (ip = 0; ip < limit;) {
+      v = lzpack_read32(&src[ip]);
+      h = lzpack_hash(v);
+      ref = table[h];
+      // positions are stored plus one, so that zero means empty
+      table[h] = ip + 1;
+
+      if (ref == 0 || ip - (ref - 1) > LZPACK_MAX_OFFSET || lzpack_read32(&src[ref - 1]) != v) {
+        ip++;
+        continue;
+      }
+      ref--;
+
+      while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+        ip--;
+        ref--;
+      }
+      for (len = LZPACK_MIN_MATCH; ip + len < matchLimit && src[ip + len] == src[ref + len]; len++);
+
+      if (lzpack_sequence(dst, &o, max, &src[anchor], ip - anchor, ip - ref, len) == -1) {
+        xfree(table);
+        return 0;
+      }
+      ip += len;
+      anchor = ip;
+    }
+  }
+
+  if (lzpack_sequence(dst, &o, max, &src[anchor], size - anchor, 0, 0) == -1) {
+    o = 0;
+  }
+  xfree(table);
+
+  return o;
+}
+
+// Returns the decompressed size, or -1 when the block is invalid or does not fit in max bytes.
+int lzpack_decompress(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max) {
+  uint32_t i, o, len, offset;
+  uint8_t token, b;
+
+  if (src == NULL || dst == NULL) return -1;
+
+  for (i = 0, o = 0; i < size;) {
+    token = src[i++];
+
+    len = token >> 4;
+    if (len == 15) {
+      do {
+        if (i >= size) return -1;
+        b = src[i++];
+        len += b;
+      } while (b == 255);
+    }
+    if (len > size - i || len > max - o) return -1;
+    xmemcpy(&dst[o], &src[i], len);
+    i += len;
+    o += len;
+
+    // the last sequence has no match
+    if (i == size) break;
+
+    if (size - i < 2) return -1;
+    offset = src[i] | (src[i + 1] << 8);
+    i += 2;
+    if (offset == 0 || offset > o) return -1;
+
+    len = token & 15;
+    if (len == 15) {
+      do {
+        if (i >= size) return -1;
+        b = src[i++];
+        len += b;
+      } while (b == 255);
+    }
+    len += LZPACK_MIN_MATCH;
+    if (len > max - o) return -1;
+
+    // matches may overlap the bytes they produce
+    for (; len > 0; len--, o++) {
+      dst[o] = dst[o - offset];
+    }
+  }
+
+  return o;
+}
@@ -0,0 +1,12 @@
+#ifndef PIT_LZPACK_H
+#define PIT_LZPACK_H
+
+// Fast LZ77 block compression, in the LZ4 block format: literal runs and
+// matches of at least 4 bytes within the previous 64KB. It trades ratio for
+// speed, decompression is a copy loop. A block is compressed and
+// decompressed as a whole, the decompressed size has to be kept elsewhere.
+
+int lzpack_compress(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max);
+int lzpack_decompress(uint8_t *src, uint32_t size, uint8_t *dst, uint32_t max);
+
+#endif
@@ -0,0 +1,161 @@
+#include "sys.h"
+#include "vfs.h"
+#include "bytes.h"
+#include "xalloc.h"
+#include "debug.h"
+
+#include "prcimage.h"
+
+// header up to the number of resources, and one entry of the resource table
+#define PRCIMAGE_HEADER 78
+#define PRCIMAGE_ENTRY  10
+
+// resource database flag in the attributes of the header
+#define PRCIMAGE_RESDB  0x0001
+
+typedef struct {
+  uint32_t type, id;
+  uint32_t offset, size;
+} prcimage_entry_t;
+
+struct prcimage_t {
+  vfs_file_t *f;
+  char path[VFS_PATH];
+  prcimage_entry_t *entries;
+  uint32_t count;
+};
+
+static int prcimage_compare(const void *e1, const void *e2) {
+  const prcimage_entry_t *p1 = (const prcimage_entry_t *)e1;
+  const prcimage_entry_t *p2 = (const prcimage_entry_t *)e2;
+
+  if (p1->type != p2->type) return p1->type < p2->type ? -1 : 1;
+  if (p1->id != p2->id) return p1->id < p2->id ? -1 : 1;
+
+  return 0;
+}
+
+static int prcimage_load(prcimage_t *img) {
+  uint8_t header[PRCIMAGE_HEADER], *buf;
+  uint16_t attr, count, id;
+  uint32_t total, size, i;
+  prcimage_entry_t *e;
+  int j, r = -1;
+
+  if ((total = vfs_seek(img->f, 0, 1)) == 0xFFFFFFFF || vfs_seek(img->f, 0, 0) != 0) {
+    debug(DEBUG_ERROR, "STOR", "image \"%s\" seek failed", img->path);
+    return -1;
+  }
+
+  if (vfs_read(img->f, header, sizeof(header)) != sizeof(header)) {
+    debug(DEBUG_ERROR, "STOR", "image \"%s\" header too short", img->path);
+    return -1;
+  }
+
+  get2b(&attr, header, 32);
+  get2b(&count, header, 76);
+  if (!(attr & PRCIMAGE_RESDB)) {
+    debug(DEBUG_ERROR, "STOR", "image \"%s\" is not a resource database", img->path);
+    return -1;
+  }
+  if (count == 0) return 0;
+
+  size = count * PRCIMAGE_ENTRY;
+  img->entries = xcalloc(count, sizeof(prcimage_entry_t));
+  buf = xcalloc(1, size);
+
+  if (img->entries && buf) {
+    if (vfs_read(img->f, buf, size) == size) {
+      for (i = 0, j = 0; i < count; i++) {
+        e = &img->entries[i];
+        j += get4b(&e->type, buf, j);
+        j += get2b(&id, buf, j);
+        j += get4b(&e->offset, buf, j);
+        e->id = id;
+      }
+      // resources are laid out in table order, each one ends where the next one starts
+      for (i = 0; i < count; i++) {
+        e = &img->entries[i];
+        size = i < count - 1 ? img->entries[i+1].offset : total;
+        if (e->offset < PRCIMAGE_HEADER || e->offset > size) {
+          debug(DEBUG_ERROR, "STOR", "image \"%s\" resource %u out of bounds", img->path, i);
+          break;
+        }
+        e->size = size - e->offset;
+      }
+      if (i == count) {
+        sys_qsort(img->entries, count, sizeof(prcimage_entry_t), prcimage_compare);
+        img->count = count;
+        r = 0;
+      }
+    } else {
+      debug(DEBUG_ERROR, "STOR", "image \"%s\" resource table too short", img->path);
+    }
+  }
+  if (buf) xfree(buf);
+
+  return r;
+}
+
+prcimage_t *prcimage_open(vfs_session_t *session, char *path) {
+  prcimage_t *img;
+  vfs_file_t *f;
+
+  if ((f = vfs_open(session, path, VFS_READ)) == NULL) {
+    return NULL;
+  }
+
+  if ((img = xcalloc(1, sizeof(prcimage_t))) != NULL) {
+    img->f = f;
+    sys_strncpy(img->path, path, VFS_PATH - 1);
+
+    if (prcimage_load(img) == 0) {
+      debug(DEBUG_TRACE, "STOR", "image \"%s\" opened with %u resources", path, img->count);
+      return img;
+    }
+
+    if (img->entries) xfree(img->entries);
+    xfree(img);
+  }
+  vfs_close(f);
+
+  return NULL;
+}
+
+void prcimage_close(prcimage_t *img) {
+  if (img) {
+    vfs_close(img->f);
+    if (img->entries) xfree(img->entries);
+    xfree(img);
+  }
+}
+
+uint32_t prcimage_num(prcimage_t *img) {
+  return img ? img->count : 0;
+}
+
+int prcimage_get(prcimage_t *img, uint32_t i, uint32_t *type, uint32_t *id, uint32_t *size) {
+  if (img == NULL || i >= img->count) return -1;
+
+  if (type) *type = img->entries[i].type;
+  if (id) *id = img->entries[i].id;
+  if (size) *size = img->entries[i].size;
+
+  return 0;
+}
+
+int prcimage_read(prcimage_t *img, uint32_t type, uint32_t id, uint8_t *buf, uint32_t size) {
+  prcimage_entry_t key, *e;
+
+  if (img == NULL || buf == NULL) return -1;
+
+  key.type = type;
+  key.id = id;
+  if ((e = sys_bsearch(&key, img->entries, img->count, sizeof(prcimage_entry_t), prcimage_compare)) == NULL) return -1;
+
+  if (size > e->size) size = e->size;
+  if (size == 0) return 0;
+  if (vfs_seek(img->f, e->offset, 0) != e->offset) return -1;
+
+  return vfs_read(img->f, buf, size);
+}
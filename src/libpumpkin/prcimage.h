@@ -0,0 +1,16 @@
+#ifndef PIT_PRCIMAGE_H
+#define PIT_PRCIMAGE_H
+
+// Read only view of a PRC image (a resource database in the format it is
+// distributed in). Only the header and the resource table are loaded when
+// the image is opened, resources are read from their offsets on demand.
+
+typedef struct prcimage_t prcimage_t;
+
+prcimage_t *prcimage_open(vfs_session_t *session, char *path);
+void prcimage_close(prcimage_t *img);
+uint32_t prcimage_num(prcimage_t *img);
+int prcimage_get(prcimage_t *img, uint32_t i, uint32_t *type, uint32_t *id, uint32_t *size);
+int prcimage_read(prcimage_t *img, uint32_t type, uint32_t id, uint8_t *buf, uint32_t size);
+
+#endif
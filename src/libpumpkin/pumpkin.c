@@ -592,6 +592,7 @@ int pumpkin_global_init(script_engine_t *engine, window_provider_t *wp, audio_pr
   StoRemoveLocks(APP_STORAGE);
 
   pumpkin_module.heap = heap_init(NULL, HEAP_SIZE*8, wp);
+  StoInitCache();
   StoInit(APP_STORAGE, pumpkin_module.fs_mutex);
 
   SysUInitModule(); // sto calls SysQSortP
@@ -859,6 +860,30 @@ void pumpkin_set_fullrefresh(int fullrefresh) {
   pumpkin_module.fullrefresh = fullrefresh;
 }
 
+void pumpkin_set_container(int container) {
+  StoSetContainer(container);
+}
+
+void pumpkin_set_images(int images) {
+  StoSetImages(images);
+}
+
+void pumpkin_set_compress(int compress) {
+  StoSetCompress(compress);
+}
+
+void pumpkin_set_journal(int journal) {
+  StoSetJournal(journal);
+}
+
+void pumpkin_set_watch(int watch) {
+  StoSetWatch(watch);
+}
+
+void pumpkin_set_record_cache(int size) {
+  StoSetRecordCache(size);
+}
+
 int pumpkin_dia_get_trigger(void) {
   int r = -1;
 
@@ -1015,6 +1040,7 @@ int pumpkin_global_finish(void) {
 
   SysUFinishModule();
   StoFinish();
+  StoFinishCache();
   heap_finish(pumpkin_module.heap);
   thread_key_delete(task_key);
   mutex_destroy(pumpkin_module.fs_mutex);
@@ -2967,6 +2993,8 @@ static int pumpkin_event_multi_thread(int *key, int *mods, int *buttons, uint8_t
 }
 
 int pumpkin_event(int *key, int *mods, int *buttons, uint8_t *data, uint32_t *n, uint32_t usec) {
+  StoSync();
+
   return pumpkin_module.dia || pumpkin_module.single ?
     pumpkin_event_single_thread(key, mods, buttons, data, n, usec) :
     pumpkin_event_multi_thread(key, mods, buttons, data, n, usec);
@@ -3718,6 +3746,22 @@ void pumpkin_set_compat(uint32_t creator, int compat, int code) {
   AppRegistrySet(pumpkin_module.registry, creator, appRegistryCompat, 0, &c);
 }
 
+void pumpkin_set_engine(uint32_t creator, int engine) {
+  AppRegistryEngine e;
+  e.engine = engine;
+  AppRegistrySet(pumpkin_module.registry, creator, appRegistryEngine, 0, &e);
+}
+
+int pumpkin_get_engine(uint32_t creator) {
+  AppRegistryEngine e;
+
+  if (!AppRegistryGet(pumpkin_module.registry, creator, appRegistryEngine, 0, &e)) {
+    e.engine = appEngineDefault;
+  }
+
+  return e.engine;
+}
+
 void pumpkin_enum_compat(void (*callback)(UInt32 creator, UInt16 seq, UInt16 index, UInt16 id, void *p, UInt16 size, void *data), void *data) {
   AppRegistryEnum(pumpkin_module.registry, callback, 0, 0, data);
 }
@@ -4143,6 +4187,29 @@ static int pumpkin_httpd_file(int pe) {
   return script_push_boolean(pe, r == 0);
 }
 
+// replies with the storage counters as JSON
+static int pumpkin_httpd_stats(int pe) {
+  http_connection_t *con;
+  script_int_t ptr;
+  char *json;
+  int r = -1;
+
+  if (script_get_integer(pe, 0, &ptr) == 0) {
+    if ((con = (http_connection_t *)ptr_lock(ptr, TAG_CONN)) != NULL) {
+      if ((json = StoGetStatsJson()) != NULL) {
+        httpd_string(con, 200, json, "application/json");
+        xfree(json);
+      } else {
+        httpd_reply(con, 500);
+      }
+      ptr_unlock(ptr, TAG_CONN);
+      r = 0;
+    }
+  }
+
+  return script_push_boolean(pe, r == 0);
+}
+
 static int pumpkin_httpd_read(int pe) {
   http_connection_t *con;
   script_int_t ptr, len;
@@ -4460,6 +4527,7 @@ pumpkin_httpd_t *pumpkin_httpd_create(UInt16 port, UInt16 scriptId, char *worker
       script_add_function(h->pe, obj, "read",     pumpkin_httpd_read);
       script_add_function(h->pe, obj, "template", pumpkin_httpd_template);
       script_add_function(h->pe, obj, "install",  pumpkin_httpd_install);
+      script_add_function(h->pe, obj, "stats",    pumpkin_httpd_stats);
 
       obj = pumpkin_script_create_obj(h->pe, "template");
       script_add_function(h->pe, obj, "create",   pumpkin_template_create);
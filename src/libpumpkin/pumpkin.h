@@ -220,6 +220,12 @@ void pumpkin_set_mono(int mono);
 int pumpkin_get_encoding(void);
 int pumpkin_get_current(void);
 void pumpkin_set_fullrefresh(int fullrefresh);
+void pumpkin_set_container(int container);
+void pumpkin_set_images(int images);
+void pumpkin_set_compress(int compress);
+void pumpkin_set_journal(int journal);
+void pumpkin_set_watch(int watch);
+void pumpkin_set_record_cache(int size);
 
 void pumpkin_set_secure(void *secure);
 int pumpkin_http_get(char *url, int timeout, int (*callback)(int ptr, void *_data), void *data);
@@ -248,6 +254,8 @@ void pumpkin_generic_error(char *msg, int code);
 void pumpkin_set_size(uint32_t creator, uint16_t width, uint16_t height);
 void pumpkin_create_compat(uint32_t creator);
 void pumpkin_set_compat(uint32_t creator, int compat, int code);
+void pumpkin_set_engine(uint32_t creator, int engine);
+int pumpkin_get_engine(uint32_t creator);
 void pumpkin_enum_compat(void (*callback)(UInt32 creator, UInt16 seq, UInt16 index, UInt16 id, void *p, UInt16 size, void *data), void *data);
 void pumpkin_compat_log(void);
 void pumpkin_set_lasterr(Err err);
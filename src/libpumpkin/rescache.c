@@ -0,0 +1,225 @@
+#include "sys.h"
+#include "mutex.h"
+#include "xalloc.h"
+#include "debug.h"
+
+#include "rescache.h"
+
+#define RESCACHE_NAME    32
+#define RESCACHE_BUCKETS 256
+
+typedef struct rescache_entry_t {
+  char name[RESCACHE_NAME];
+  uint64_t version;
+  uint32_t type;
+  uint16_t id;
+  uint32_t size, refs;
+  int removed;
+  uint8_t *buf;
+  struct rescache_entry_t *next;              // bucket chain
+  struct rescache_entry_t *older, *newer;     // lru list
+} rescache_entry_t;
+
+struct rescache_t {
+  mutex_t *mutex;
+  rescache_entry_t *buckets[RESCACHE_BUCKETS];
+  rescache_entry_t *oldest, *newest;
+  uint32_t maxSize, maxEntry;
+  uint32_t size, entries;
+  uint32_t hits, misses;
+};
+
+static uint32_t rescache_hash(char *name, uint32_t type, uint16_t id) {
+  uint32_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < RESCACHE_NAME && name[i]; i++) {
+    h = (h ^ (uint8_t)name[i]) * 16777619u;
+  }
+  h ^= type * 2654435761u;
+  h ^= id * 40503u;
+  h ^= h >> 16;
+
+  return h & (RESCACHE_BUCKETS - 1);
+}
+
+static rescache_entry_t **rescache_find(rescache_t *c, char *name, uint64_t version, uint32_t type, uint16_t id) {
+  rescache_entry_t **p;
+
+  for (p = &c->buckets[rescache_hash(name, type, id)]; *p; p = &(*p)->next) {
+    if ((*p)->type == type && (*p)->id == id && (*p)->version == version && !sys_strncmp((*p)->name, name, RESCACHE_NAME)) break;
+  }
+
+  return p;
+}
+
+static void rescache_unlink_lru(rescache_t *c, rescache_entry_t *e) {
+  if (e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+  if (e->newer) e->newer->older = e->older; else c->newest = e->older;
+  e->older = e->newer = NULL;
+}
+
+static void rescache_link_lru(rescache_t *c, rescache_entry_t *e) {
+  e->older = c->newest;
+  e->newer = NULL;
+  if (c->newest) c->newest->newer = e; else c->oldest = e;
+  c->newest = e;
+}
+
+static void rescache_free(rescache_entry_t *e) {
+  xfree(e->buf);
+  xfree(e);
+}
+
+// An entry that is being copied out is only taken out of the cache here,
+// and freed by rescache_get once the copy is done.
+static void rescache_remove(rescache_t *c, rescache_entry_t **p) {
+  rescache_entry_t *e = *p;
+
+  *p = e->next;
+  rescache_unlink_lru(c, e);
+  c->size -= e->size;
+  c->entries--;
+  if (e->refs) {
+    e->removed = 1;
+  } else {
+    rescache_free(e);
+  }
+}
+
+rescache_t *rescache_create(uint32_t maxSize, uint32_t maxEntry) {
+  rescache_t *c;
+
+  if ((c = xcalloc(1, sizeof(rescache_t))) != NULL) {
+    if ((c->mutex = mutex_create("rescache")) != NULL) {
+      c->maxSize = maxSize;
+      c->maxEntry = maxEntry;
+    } else {
+      xfree(c);
+      c = NULL;
+    }
+  }
+
+  return c;
+}
+
+void rescache_destroy(rescache_t *c) {
+  uint32_t i;
+
+  if (c) {
+    debug(DEBUG_INFO, "STOR", "resource cache: %u entries, %u bytes, %u hits, %u misses", c->entries, c->size, c->hits, c->misses);
+    for (i = 0; i < RESCACHE_BUCKETS; i++) {
+      while (c->buckets[i]) {
+        rescache_remove(c, &c->buckets[i]);
+      }
+    }
+    mutex_destroy(c->mutex);
+    xfree(c);
+  }
+}
+
+// Copies an entry into a buffer obtained from alloc, which is called with the
+// size of the entry. The entry is held with a reference instead of the cache
+// lock while the buffer is allocated and filled, so alloc is free to take other
+// locks or to release memory. Contents of an entry never change once it is put.
+// Returns the buffer, or NULL on a miss or if alloc failed.
+uint8_t *rescache_get(rescache_t *c, char *name, uint64_t version, uint32_t type, uint16_t id, void *(*alloc)(uint32_t size, void *data), void *data, uint32_t *size) {
+  rescache_entry_t **p, *e = NULL;
+  uint8_t *buf = NULL;
+
+  if (c && alloc && size && mutex_lock(c->mutex) == 0) {
+    p = rescache_find(c, name, version, type, id);
+    if ((e = *p) != NULL) {
+      e->refs++;
+      rescache_unlink_lru(c, e);
+      rescache_link_lru(c, e);
+    } else {
+      c->misses++;
+    }
+    mutex_unlock(c->mutex);
+  }
+
+  if (e) {
+    if ((buf = alloc(e->size, data)) != NULL) {
+      xmemcpy(buf, e->buf, e->size);
+      *size = e->size;
+    }
+    if (mutex_lock(c->mutex) == 0) {
+      if (buf) c->hits++; else c->misses++;
+      if (--e->refs == 0 && e->removed) {
+        rescache_free(e);
+      }
+      mutex_unlock(c->mutex);
+    }
+  }
+
+  return buf;
+}
+
+int rescache_put(rescache_t *c, char *name, uint64_t version, uint32_t type, uint16_t id, uint8_t *buf, uint32_t size) {
+  rescache_entry_t **p, *e;
+  int r = -1;
+
+  if (c && buf && size && size <= c->maxEntry && mutex_lock(c->mutex) == 0) {
+    p = rescache_find(c, name, version, type, id);
+    if (*p) {
+      rescache_remove(c, p);
+    }
+
+    while (c->oldest && c->size + size > c->maxSize) {
+      e = c->oldest;
+      rescache_remove(c, rescache_find(c, e->name, e->version, e->type, e->id));
+    }
+
+    if ((e = xcalloc(1, sizeof(rescache_entry_t))) != NULL) {
+      if ((e->buf = xcalloc(1, size)) != NULL) {
+        sys_strncpy(e->name, name, RESCACHE_NAME - 1);
+        e->version = version;
+        e->type = type;
+        e->id = id;
+        e->size = size;
+        xmemcpy(e->buf, buf, size);
+        p = &c->buckets[rescache_hash(name, type, id)];
+        e->next = *p;
+        *p = e;
+        rescache_link_lru(c, e);
+        c->size += size;
+        c->entries++;
+        r = 0;
+      } else {
+        xfree(e);
+      }
+    }
+    mutex_unlock(c->mutex);
+  }
+
+  return r;
+}
+
+void rescache_invalidate(rescache_t *c, char *name) {
+  rescache_entry_t **p;
+  uint32_t i;
+
+  if (c && mutex_lock(c->mutex) == 0) {
+    for (i = 0; i < RESCACHE_BUCKETS; i++) {
+      for (p = &c->buckets[i]; *p;) {
+        if (!sys_strncmp((*p)->name, name, RESCACHE_NAME)) {
+          rescache_remove(c, p);
+        } else {
+          p = &(*p)->next;
+        }
+      }
+    }
+    mutex_unlock(c->mutex);
+  }
+}
+
+void rescache_stats(rescache_t *c, uint32_t *entries, uint32_t *size, uint32_t *hits, uint32_t *misses) {
+  if (c && mutex_lock(c->mutex) == 0) {
+    if (entries) *entries = c->entries;
+    if (size) *size = c->size;
+    if (hits) *hits = c->hits;
+    if (misses) *misses = c->misses;
+    mutex_unlock(c->mutex);
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef PIT_RESCACHE_H
+#define PIT_RESCACHE_H
+
+// Process wide cache of resource contents, as they are after decoding
+// (decompressed bitmaps, raw bytes for everything else). Entries are keyed
+// by database name, a database version that changes with every write and the
+// resource (type, id). Contents are copied in and out, so tasks never share
+// pointers into each other's heaps. The least recently used entries are
+// dropped when the cache grows past its size limit.
+
+typedef struct rescache_t rescache_t;
+
+rescache_t *rescache_create(uint32_t maxSize, uint32_t maxEntry);
+void rescache_destroy(rescache_t *c);
+uint8_t *rescache_get(rescache_t *c, char *name, uint64_t version, uint32_t type, uint16_t id, void *(*alloc)(uint32_t size, void *data), void *data, uint32_t *size);
+int rescache_put(rescache_t *c, char *name, uint64_t version, uint32_t type, uint16_t id, uint8_t *buf, uint32_t size);
+void rescache_invalidate(rescache_t *c, char *name);
+void rescache_stats(rescache_t *c, uint32_t *entries, uint32_t *size, uint32_t *hits, uint32_t *misses);
+
+#endif
@@ -12,6 +12,13 @@
 #include "xalloc.h"
 #include "debug.h"
 #include "storage.h"
+#include "container.h"
+#include "prcimage.h"
+#include "rescache.h"
+#include "dblock.h"
+#include "journal.h"
+#include "dbwatch.h"
+#include "dbstats.h"
 
 #define MAX_STORAGE_PATH 256
 
@@ -31,6 +38,51 @@
 #define STO_FILE_AINFO   5
 #define STO_FILE_SINFO   6
 #define STO_FILE_LOCK    7
+#define STO_FILE_CONTAINER 8
+#define STO_FILE_RINDEX  9
+#define STO_FILE_IMAGE   10
+
+#define STO_BACKEND_DIR       0
+#define STO_BACKEND_CONTAINER 1
+#define STO_BACKEND_IMAGE     2
+
+// binary record index: header, numRecs entries and a journal of incremental updates
+#define STO_INDEX_MAGIC   'PIdx'
+#define STO_INDEX_VERSION 2
+#define STO_INDEX_HEADER  20
+#define STO_INDEX_HEADER1 16
+#define STO_INDEX_ENTRY   16
+#define STO_INDEX_JOURNAL (4 + STO_INDEX_ENTRY)
+#define STO_INDEX_SLACK   64
+
+// Records mapped from the binary index get their handle on first use. Until then
+// their slot in db->elements holds the offset of their entry in db->lazy, shifted
+// left with the low bit set, which no handle pointer has.
+#define STO_LAZY(h)       ((uintptr_t)(h) & 1)
+#define STO_LAZY_SLOT(j)  ((storage_handle_t *)(((uintptr_t)(j) << 1) | 1))
+#define STO_LAZY_ENTRY(h) ((uint32_t)((uintptr_t)(h) >> 1))
+
+// released records kept in memory per database, and how long a dirty one may wait to be written
+#define STO_RECORD_CACHE (256*1024)
+#define STO_FLUSH_DELAY  2
+
+// upper bound of the arena holding record contents while a database is sorted
+#define STO_SORT_ARENA (2*1024*1024)
+
+// bytes of each record kept in the index as its sort key
+#define STO_SORT_KEY 4
+
+// size of the header of a PRC/PDB image, up to the number of records
+#define STO_IMAGE_HEADER 78
+
+// images loaded ahead of the one being installed by StoDeployFiles
+#define STO_DEPLOY_WORKERS 4
+#define STO_DEPLOY_AHEAD   8
+
+#define STO_INDEX_INSERT  1
+#define STO_INDEX_REMOVE  2
+#define STO_INDEX_UPDATE  3
+#define STO_INDEX_MOVE    4
 
 #define ATTR_MASK (dmRecAttrDelete | dmRecAttrSecret | dmRecAttrCategoryMask)
 
@@ -42,6 +94,46 @@
 
 static const char *watchName = "tempData";
 
+// backend used for new record and resource databases
+static uint32_t stoBackend = STO_BACKEND_DIR;
+
+// compress blobs written to containers
+static int stoCompress;
+
+// install resource databases as read only images instead of exploding them
+static int stoImages = 0;
+
+// bumped whenever the chain of open databases or the contents of a resource database change,
+// by any task, so it is only accessed through StoResChanged and StoResGen
+static uint32_t stoResGen = 1;
+
+// decoded resources shared by all tasks
+#define STO_CACHE_SIZE  (4*1024*1024)
+#define STO_CACHE_ENTRY (256*1024)
+
+static rescache_t *stoCache;
+
+// reader/writer locks of open databases, shared by all tasks
+static dblock_table_t *stoLocks;
+
+// write ahead journal of the storage root, shared by all tasks; it costs a sync
+// per group and can be turned off with the "journal" libos parameter
+#define STO_JOURNAL_FILE ".journal"
+
+static journal_t *stoJournal;
+static int stoJournaling = 1;
+
+// change notification of the storage root, shared by all tasks
+#define STO_WATCH_FILE "header"
+
+static dbwatch_t *stoWatch;
+static int stoWatching = 1;
+
+// storage counters, shared by all tasks
+static dbstats_t *stoStats;
+
+static uint32_t stoRecordCache = STO_RECORD_CACHE;
+
 typedef struct storage_handle_t {
   uint32_t magic;
   uint16_t htype;
@@ -53,12 +145,15 @@ typedef struct storage_handle_t {
     struct {
       uint32_t uniqueID;
       uint16_t attr;
+      uint32_t key;
+      struct storage_handle_t *cachePrev, *cacheNext;
     } rec;
     struct {
       void *decoded;
       void (*destructor)(void *);
       void *(*encoder)(void *, uint32_t *size);
       uint32_t decodedSize;
+      uint32_t storedSize;
       uint32_t type;
       uint16_t id;
       uint16_t attr;
@@ -67,6 +162,20 @@ typedef struct storage_handle_t {
   uint8_t *buf;
 } storage_handle_t;
 
+// Positions of the visible (not deleted) records of a record database, in
+// ascending order. pos[0..numAll-1] holds all of them, followed by one run per
+// category: category c is pos[start[c]..start[c+1]-1]. There is one view with
+// and one without secret records, each built on demand.
+typedef struct {
+  uint16_t *pos;
+  uint32_t capacity, numAll, valid;
+  uint32_t start[dmRecNumCategories + 1];
+} storage_category_view_t;
+
+typedef struct {
+  storage_category_view_t view[2];
+} storage_category_t;
+
 typedef struct storage_db_t {
   uint32_t ftype, readCount, writeCount, uniqueIDSeed;
   uint16_t mode, numRecs, protect;
@@ -75,18 +184,57 @@ typedef struct storage_db_t {
   uint32_t attributes, version, appInfoID, sortInfoID;
   char name[dmDBNameLength];
   vfs_file_t *f;
+  uint32_t backend;
+  container_t *container;
+  prcimage_t *image;
+  uint32_t indexJournal, indexLegacy, indexEnd;
+  uint8_t *lazy;
+  uint16_t keyOffset, keyMode;
+  uint32_t *hash, hashSize, hashValid;
+  storage_category_t *categories;
+  uint32_t cacheSize, flushTime;
+  storage_handle_t *cacheHead, *cacheTail;
+  dblock_t *lock;
+  dbstats_entry_t *stats;
+  char escaped[4*dmDBNameLength];
+  uint32_t escapedLen;
 
   storage_handle_t **elements;
   uint32_t totalElements;
   struct storage_db_t *next;
+  struct storage_db_t *nameNext, *tcNext;
 } storage_db_t;
 
+typedef struct {
+  storage_handle_t *h;
+  uint8_t *buf;
+  uint32_t key, tie;
+  uint32_t size, uniqueID;
+  uint16_t attr;
+} storage_sort_key_t;
+
+typedef struct {
+  uint32_t uniqueID, attr, size;
+} storage_record_file_t;
+
 typedef struct DmOpenType {
   LocalID dbID;
   UInt16 mode;
   struct DmOpenType *prev, *next;
 } DmOpenType;
 
+#define STO_RES_CACHE 256
+
+// buckets of the database name and (type, creator) hash tables
+#define STO_DB_BUCKETS 256
+
+typedef struct {
+  uint32_t gen, type;
+  uint16_t id, index;
+  Boolean firstOnly;
+  DmOpenType *dbRef;
+} storage_res_cache_t;
+
 typedef struct {
   mutex_t *mutex;
   uint8_t *base;
@@ -105,16 +253,34 @@ typedef struct {
   Int16 other;
   LocalID watchID;
   storage_db_t *tmpDb;
+  storage_res_cache_t resCache[STO_RES_CACHE];
+  uint32_t flushTime;
+  storage_db_t *nameHash[STO_DB_BUCKETS];
+  storage_db_t *tcHash[STO_DB_BUCKETS];
+  journal_tx_t *tx;
+  uint32_t txDepth;
+  uint32_t watchPos;
 } storage_t;
 
-static void StoDecodeResource(storage_handle_t *res);
+static void StoDecodeResource(storage_db_t *db, storage_handle_t *res);
+static void StoReleaseCache(storage_t *sto, storage_handle_t *except);
+static int StoDetachImage(storage_t *sto, storage_db_t *db);
+static int StoHandleFind(storage_db_t *db, storage_handle_t *h);
 
 static void *StoPtrNew(storage_handle_t *h, UInt32 size, UInt32 type, UInt16 id) {
+  storage_t *sto;
   void **q;
   char st[8];
   UInt8 *p = NULL;
 
-  if ((q = pumpkin_heap_alloc(sizeof(storage_handle_t *) + size, "HandlePtr")) != NULL) {
+  q = pumpkin_heap_alloc(sizeof(storage_handle_t *) + size, "HandlePtr");
+  if (q == NULL && (sto = (storage_t *)pumpkin_get_local_storage(sto_key)) != NULL) {
+    // the heap is full: give back the records kept by the record cache and try again
+    StoReleaseCache(sto, h);
+    q = pumpkin_heap_alloc(sizeof(storage_handle_t *) + size, "HandlePtr");
+  }
+
+  if (q != NULL) {
     if (type) {
       pumpkin_id2s(type, st);
       debug(DEBUG_TRACE, "Heap", "RSRC %p %p %s %d", h, q, st, id);
@@ -193,174 +359,938 @@ static void StoEscapeName(uint8_t *src, char *dst, int n) {
   for (i = 0; src[i] && j < n-1; i++, j += 2) {
     sys_snprintf(&dst[j], n-j, "%02X", src[i]);
   }
-  dst[j++] = 0;
+  dst[j++] = 0;
+
+  debug(DEBUG_TRACE, "STOR", "StoEscapeName \"%s\" -> \"%s\"", src, dst);
+}
+
+static void StoUnescapeName(char *src, char *dst, int n) {
+  char buf[4];
+  int i, j, c;
+
+  for (j = 0, i = 0; src[j]; j++) {
+    if (src[j] == '_') i = j;
+  }
+
+  for (j = 0, i++; src[i] && j < n-1; i += 2) {
+    buf[0] = src[i];
+    buf[1] = src[i+1];
+    buf[2] = 0;
+    sys_sscanf(buf, "%02X", &c);
+    dst[j++] = c;
+  }
+  dst[j] = 0;
+
+  debug(DEBUG_TRACE, "STOR", "StoUnescapeName \"%s\" -> \"%s\"", src, dst);
+}
+
+static vfs_file_t *StoVfsOpen(vfs_session_t *session, char *path, int mode) {
+  vfs_file_t *f;
+
+  if ((f = vfs_open(session, path, mode)) != NULL) {
+    dbstats_count(stoStats, NULL, DBSTATS_FILE, 0);
+  }
+
+  return f;
+}
+
+static int StoVfsMkdir(vfs_session_t *session, char *path) {
+  return vfs_mkdir(session, path);
+}
+
+static int StoVfsRename(vfs_session_t *session, char *path1, char *path2) {
+  return vfs_rename(session, path1, path2);
+}
+
+static int StoVfsUnlink(vfs_session_t *session, char *path) {
+  return vfs_unlink(session, path);
+}
+
+static vfs_dir_t *StoVfsOpendir(vfs_session_t *session, char *path) {
+  return vfs_opendir(session, path);
+}
+
+static vfs_ent_t *StoVfsReaddir(vfs_dir_t *dir) {
+  return vfs_readdir(dir);
+}
+
+static int StoVfsChecktype(vfs_session_t *session, char *path) {
+  return vfs_checktype(session, path);
+}
+
+static void *StoVfsLoadlib(vfs_session_t *session, char *path, int *first_load) {
+  return vfs_loadlib(session, path, first_load);
+}
+
+// Database files (headers, indexes, app and sort info, and records and resources
+// of the directory backend) are updated through the journal. Updates made between
+// StoBeginWrite and the matching StoEndWrite are committed as one group, with a
+// single sync, by the outermost StoEndWrite; any other update is a group of its
+// own. Files are only written when their group is committed, so a group must not
+// read back what it has written. Containers, images and stream data keep their
+// own files and are written directly: a container writes its directory to free
+// space before its header points to it, and an image is synced before the
+// database header names it.
+
+static void StoBeginWrite(storage_t *sto) {
+  if (stoJournal && sto->txDepth++ == 0) {
+    sto->tx = journal_begin(stoJournal);
+  }
+}
+
+static void StoEndWrite(storage_t *sto) {
+  if (stoJournal && sto->txDepth > 0 && --sto->txDepth == 0) {
+    if (sto->tx) {
+      journal_commit(sto->tx);
+      sto->tx = NULL;
+    }
+  }
+}
+
+// Replaces the contents of a file, a NULL p writes a file filled with zeros.
+// Returns the number of bytes written, like vfs_write.
+static int StoPutFile(storage_t *sto, char *path, uint8_t *p, uint32_t size) {
+  uint8_t zero[256];
+  vfs_file_t *f;
+  uint32_t n;
+  int r = -1;
+
+  StoBeginWrite(sto);
+  if (sto->tx) {
+    r = journal_put(sto->tx, path, p, size) == 0 ? size : -1;
+  } else if ((f = StoVfsOpen(sto->session, path, VFS_WRITE | VFS_TRUNC)) != NULL) {
+    if (p) {
+      r = vfs_write(f, p, size);
+    } else {
+      xmemset(zero, 0, sizeof(zero));
+      for (n = 0; (n + sizeof(zero)) < size; n += sizeof(zero)) {
+        vfs_write(f, zero, sizeof(zero));
+      }
+      if (size > n) {
+        vfs_write(f, zero, size - n);
+      }
+      r = size;
+    }
+    vfs_close(f);
+  }
+  StoEndWrite(sto);
+
+  return r;
+}
+
+// Writes at an offset of an existing file.
+static int StoWriteFileAt(storage_t *sto, char *path, uint32_t offset, uint8_t *p, uint32_t size) {
+  vfs_file_t *f;
+  int r = -1;
+
+  StoBeginWrite(sto);
+  if (sto->tx) {
+    r = journal_write(sto->tx, path, offset, p, size) == 0 ? size : -1;
+  } else if ((f = StoVfsOpen(sto->session, path, VFS_WRITE)) != NULL) {
+    if (vfs_seek(f, offset, 0) == offset) {
+      r = vfs_write(f, p, size);
+    }
+    vfs_close(f);
+  }
+  StoEndWrite(sto);
+
+  return r;
+}
+
+static int StoUnlinkFile(storage_t *sto, char *path) {
+  int r;
+
+  StoBeginWrite(sto);
+  r = sto->tx ? journal_unlink(sto->tx, path) : StoVfsUnlink(sto->session, path);
+  StoEndWrite(sto);
+
+  return r;
+}
+
+static int StoRenameFile(storage_t *sto, char *path1, char *path2) {
+  int r;
+
+  StoBeginWrite(sto);
+  r = sto->tx ? journal_rename(sto->tx, path1, path2) : StoVfsRename(sto->session, path1, path2);
+  StoEndWrite(sto);
+
+  return r;
+}
+
+static void StoHex(char *dst, uint32_t value, int digits) {
+  static const char hex[] = "0123456789ABCDEF";
+
+  for (dst[digits] = 0; digits > 0; value >>= 4) {
+    dst[--digits] = hex[value & 0x0F];
+  }
+}
+
+// appends the name of a database file (or element) to the database directory in buf[0..n-1]
+static void storage_file(char *name, int file, int id, uint32_t type, uint8_t attr, uint32_t uniqueId, char *buf, int n) {
+  char st[8];
+  int i;
+
+  switch (file) {
+    case STO_FILE_HEADER:
+      sys_strncat(buf, "/header", VFS_PATH-n-1);
+      break;
+    case STO_FILE_INDEX:
+      sys_strncat(buf, "/index", VFS_PATH-n-1);
+      break;
+    case STO_FILE_DATA:
+      sys_strncat(buf, "/data", VFS_PATH-n-1);
+      break;
+    case STO_FILE_AINFO:
+      sys_strncat(buf, "/appInfo", VFS_PATH-n-1);
+      break;
+    case STO_FILE_SINFO:
+      sys_strncat(buf, "/sortInfo", VFS_PATH-n-1);
+      break;
+    case STO_FILE_LOCK:
+      sys_strncat(buf, "/lock", VFS_PATH-n-1);
+      break;
+    case STO_FILE_CONTAINER:
+      sys_strncat(buf, "/container", VFS_PATH-n-1);
+      break;
+    case STO_FILE_RINDEX:
+      sys_strncat(buf, "/rindex", VFS_PATH-n-1);
+      break;
+    case STO_FILE_IMAGE:
+      sys_strncat(buf, "/image", VFS_PATH-n-1);
+      break;
+    case STO_FILE_ELEMENT:
+      if (type) {
+        pumpkin_id2s(type, st);
+        for (i = 0; i < 4; i++) {
+          if (!((st[i] >= 'a' && st[i] <= 'z') || (st[i] >= 'A' && st[i] <= 'Z') || (st[i] >= '0' && st[i] <= '9'))) st[i] = '_';
+        }
+        sys_snprintf(&buf[n], VFS_PATH-n-1, "/%s.%08X.%d", st, type, id);
+      } else if (n + 13 < VFS_PATH) {
+        // records are named on every inflate and release, so "/%08X.%02X" is formatted by hand
+        buf[n] = '/';
+        StoHex(&buf[n+1], uniqueId, 8);
+        buf[n+9] = '.';
+        StoHex(&buf[n+10], attr, 2);
+      }
+      break;
+    case 0:
+      break;
+    default:
+      debug(DEBUG_ERROR, "STOR", "storage_name \"%s\" invalid file type %d", name, file);
+      ErrFatalDisplayEx("invalid file type", 1);
+      break;
+  }
+}
+
+static void storage_name(storage_t *sto, char *name, int file, int id, uint32_t type, uint8_t attr, uint32_t uniqueId, char *buf) {
+  char escaped[4*dmDBNameLength];
+
+  StoEscapeName((uint8_t *)name, escaped, sizeof(escaped)-1);
+  sys_snprintf(buf, VFS_PATH - 1, "%s%s", sto->path, escaped);
+  storage_file(name, file, id, type, attr, uniqueId, buf, sys_strlen(buf));
+}
+
+// Same as storage_name, but the escaped name of the database is computed
+// once and kept in the database until it is renamed or deleted.
+static void storage_db_name(storage_t *sto, storage_db_t *db, int file, int id, uint32_t type, uint8_t attr, uint32_t uniqueId, char *buf) {
+  int n;
+
+  if (db->escapedLen == 0) {
+    StoEscapeName((uint8_t *)db->name, db->escaped, sizeof(db->escaped)-1);
+    db->escapedLen = sys_strlen(db->escaped);
+  }
+
+  // sto->path (< MAX_STORAGE_PATH) plus the escaped name always fit in VFS_PATH
+  n = sys_strlen(sto->path);
+  xmemcpy(buf, sto->path, n);
+  xmemcpy(&buf[n], db->escaped, db->escapedLen + 1);
+  n += db->escapedLen;
+  storage_file(db->name, file, id, type, attr, uniqueId, buf, n);
+}
+
+static void StoElementKey(storage_db_t *db, storage_handle_t *h, uint32_t *key1, uint32_t *key2) {
+  if (db->ftype == STO_TYPE_RES) {
+    *key1 = h->d.res.type;
+    *key2 = h->d.res.id;
+  } else {
+    *key1 = h->d.rec.uniqueID;
+    *key2 = 0;
+  }
+}
+
+static void StoElementName(storage_t *sto, storage_db_t *db, storage_handle_t *h, char *buf) {
+  if (db->ftype == STO_TYPE_RES) {
+    storage_db_name(sto, db, STO_FILE_ELEMENT, h->d.res.id, h->d.res.type, 0, 0, buf);
+  } else {
+    storage_db_name(sto, db, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
+  }
+}
+
+static int StoOpenElements(storage_t *sto, storage_db_t *db) {
+  char buf[VFS_PATH];
+  int r = 0;
+
+  if (db->backend == STO_BACKEND_IMAGE && db->image == NULL) {
+    storage_db_name(sto, db, STO_FILE_IMAGE, 0, 0, 0, 0, buf);
+    if ((db->image = prcimage_open(sto->session, buf)) == NULL) {
+      // another task may have detached the image since the header was read
+      storage_db_name(sto, db, STO_FILE_CONTAINER, 0, 0, 0, 0, buf);
+      db->backend = StoVfsChecktype(sto->session, buf) == VFS_FILE ? STO_BACKEND_CONTAINER : STO_BACKEND_DIR;
+      debug(DEBUG_INFO, "STOR", "StoOpenElements database \"%s\" has no image, using backend %u", db->name, db->backend);
+    }
+  }
+
+  if (db->backend == STO_BACKEND_CONTAINER && db->container == NULL) {
+    storage_db_name(sto, db, STO_FILE_CONTAINER, 0, 0, 0, 0, buf);
+    if ((db->container = container_open(sto->session, buf, 1)) == NULL) {
+      debug(DEBUG_ERROR, "STOR", "StoOpenElements database \"%s\" container open failed", db->name);
+      r = -1;
+    } else {
+      container_compress(db->container, stoCompress);
+    }
+  }
+
+  return r;
+}
+
+static void StoCloseElements(storage_t *sto, storage_db_t *db) {
+  if (db->container) {
+    container_close(db->container);
+    db->container = NULL;
+  }
+  if (db->image) {
+    prcimage_close(db->image);
+    db->image = NULL;
+  }
+}
+
+// Element (record or resource) storage is delegated to the backend of the database.
+// These return the number of bytes transferred, like vfs_read and vfs_write.
+
+static int StoReadElement(storage_t *sto, storage_db_t *db, storage_handle_t *h, uint8_t *p, uint32_t size) {
+  char buf[VFS_PATH];
+  uint32_t key1, key2;
+  vfs_file_t *f;
+  int r = -1;
+
+  switch (db->backend) {
+    case STO_BACKEND_CONTAINER:
+      StoElementKey(db, h, &key1, &key2);
+      r = container_read(db->container, key1, key2, p, size);
+      break;
+    case STO_BACKEND_IMAGE:
+      r = prcimage_read(db->image, h->d.res.type, h->d.res.id, p, size);
+      break;
+    default:
+      StoElementName(sto, db, h, buf);
+      if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
+        r = vfs_read(f, p, size);
+        vfs_close(f);
+      }
+      break;
+  }
+
+  if (r >= 0) {
+    dbstats_count(stoStats, db->stats, DBSTATS_READ, r);
+  }
+
+  return r;
+}
+
+// A database may declare a sort key, the STO_SORT_KEY bytes of each record
+// found at keyOffset. It is kept in the index, so that sorting and searching
+// compare keys first and only look at the records themselves when two keys
+// are equal. The comparison function used on the database must then order
+// records by these bytes, as unsigned numbers, before anything else. Missing
+// bytes, and bytes after the terminating zero of a dmSortKeyString, count as
+// zero.
+static uint32_t StoSortKey(storage_db_t *db, uint8_t *p, uint32_t size) {
+  uint32_t i, key = 0;
+  int end = 0;
+
+  if (db->keyMode == dmSortKeyNone || p == NULL) return 0;
+
+  for (i = 0; i < STO_SORT_KEY; i++) {
+    key <<= 8;
+    if (!end && db->keyOffset + i < size) {
+      key |= p[db->keyOffset + i];
+      if (db->keyMode == dmSortKeyString && p[db->keyOffset + i] == 0) end = 1;
+    }
+  }
+
+  return key;
+}
+
+// Key of a record that is not in storage yet, like the one given to
+// DmFindSortPosition. Its size is the size of the chunk it was allocated in;
+// a pointer that is not the start of a chunk, or a chunk too short to hold the
+// key, has no key and the record is only compared with the comparison function.
+static int StoNewRecordKey(storage_t *sto, storage_db_t *db, uint8_t *p, uint32_t *key) {
+  storage_handle_t *h;
+  void **q;
+
+  if (db->keyMode == dmSortKeyNone || p < sto->base + sizeof(void *) || p >= sto->end) return -1;
+  q = (void **)p;
+  h = (storage_handle_t *)q[-1];
+  if ((uint8_t *)h < sto->base || (uint8_t *)h >= sto->end || h->magic != STO_MAGIC || h->buf != p) return -1;
+  if (h->size < db->keyOffset + STO_SORT_KEY) return -1;
+  *key = StoSortKey(db, p, h->size);
+
+  return 0;
+}
+
+// records in memory may have changed since they were written, so their key is taken from the contents
+static uint32_t StoRecordKey(storage_db_t *db, storage_handle_t *h) {
+  return h->buf ? StoSortKey(db, h->buf, h->size) : h->d.rec.key;
+}
+
+static int StoPutElement(storage_t *sto, storage_db_t *db, storage_handle_t *h, uint8_t *p, uint32_t size) {
+  char buf[VFS_PATH];
+  uint32_t key1, key2;
+  int r = -1;
+
+  if (db->backend == STO_BACKEND_IMAGE && StoDetachImage(sto, db) == -1) {
+    return -1;
+  }
+
+  if ((h->htype & ~STO_INFLATED) == STO_TYPE_REC) {
+    h->d.rec.key = StoSortKey(db, p, size);
+  }
+
+  switch (db->backend) {
+    case STO_BACKEND_CONTAINER:
+      StoElementKey(db, h, &key1, &key2);
+      r = container_write(db->container, key1, key2, p, size);
+      break;
+    default:
+      StoElementName(sto, db, h, buf);
+      r = StoPutFile(sto, buf, p, size);
+      break;
+  }
+
+  if (r >= 0) {
+    dbstats_count(stoStats, db->stats, DBSTATS_WRITE, r);
+  }
+
+  return r;
+}
+
+static int StoWriteElement(storage_t *sto, storage_db_t *db, storage_handle_t *h, uint8_t *p, uint32_t size) {
+  int r;
+
+  r = StoPutElement(sto, db, h, p, size);
+  if (db->ftype == STO_TYPE_RES) {
+    if (r >= 0) h->d.res.storedSize = size;
+    rescache_invalidate(stoCache, db->name);
+  }
+  db->modNum++;
+
+  return r;
+}
+
+static int StoRemoveElement(storage_t *sto, storage_db_t *db, storage_handle_t *h) {
+  char buf[VFS_PATH];
+  uint32_t key1, key2;
+  int r = -1;
+
+  if (db->ftype == STO_TYPE_RES) {
+    rescache_invalidate(stoCache, db->name);
+  }
+  db->modNum++;
+
+  if (db->backend == STO_BACKEND_IMAGE && StoDetachImage(sto, db) == -1) {
+    return -1;
+  }
+
+  switch (db->backend) {
+    case STO_BACKEND_CONTAINER:
+      StoElementKey(db, h, &key1, &key2);
+      r = container_remove(db->container, key1, key2);
+      break;
+    default:
+      StoElementName(sto, db, h, buf);
+      r = StoUnlinkFile(sto, buf);
+      break;
+  }
+
+  return r;
+}
+
+// Called after the uniqueID or the attributes of a record have changed.
+
+static int StoRenameElement(storage_t *sto, storage_db_t *db, storage_handle_t *h, uint32_t oldUniqueID, uint16_t oldAttr) {
+  char oldName[VFS_PATH], newName[VFS_PATH];
+  int r = 0;
+
+  switch (db->backend) {
+    case STO_BACKEND_CONTAINER:
+      r = container_rekey(db->container, oldUniqueID, 0, h->d.rec.uniqueID, 0);
+      break;
+    default:
+      storage_db_name(sto, db, STO_FILE_ELEMENT, 0, 0, oldAttr & ATTR_MASK, oldUniqueID, oldName);
+      StoElementName(sto, db, h, newName);
+      if (sys_strcmp(oldName, newName)) {
+        r = StoRenameFile(sto, oldName, newName);
+      }
+      break;
+  }
+
+  return r;
+}
+
+// Resource databases installed as images are read only. The first change copies
+// every resource out of the image into the default backend and removes the image,
+// so the change (and any later one) is applied to a private copy. The header is
+// rewritten when the database is closed, and StoOpenElements falls back to the
+// other backends if it still names an image that is gone.
+
+static int StoDetachImage(storage_t *sto, storage_db_t *db) {
+  storage_handle_t h;
+  prcimage_t *image;
+  char buf[VFS_PATH];
+  uint32_t type, id, size, i, n;
+  uint8_t *p;
+  int r = -1;
+
+  debug(DEBUG_INFO, "STOR", "StoDetachImage database \"%s\"", db->name);
+  image = db->image;
+  db->image = NULL;
+  db->backend = stoBackend;
+
+  if (StoOpenElements(sto, db) == 0) {
+    n = prcimage_num(image);
+    for (i = 0, r = 0; i < n && r == 0; i++) {
+      r = -1;
+      if (prcimage_get(image, i, &type, &id, &size) == 0 && (p = xcalloc(1, size ? size : 1)) != NULL) {
+        if (prcimage_read(image, type, id, p, size) == size) {
+          xmemset(&h, 0, sizeof(h));
+          h.d.res.type = type;
+          h.d.res.id = id;
+          if (StoPutElement(sto, db, &h, p, size) == size) {
+            r = 0;
+          }
+        }
+        xfree(p);
+      }
+    }
+  }
+
+  if (r == 0) {
+    prcimage_close(image);
+    storage_db_name(sto, db, STO_FILE_IMAGE, 0, 0, 0, 0, buf);
+    StoUnlinkFile(sto, buf);
+  } else {
+    debug(DEBUG_ERROR, "STOR", "StoDetachImage database \"%s\" failed", db->name);
+    if (db->container) {
+      container_close(db->container);
+      db->container = NULL;
+    }
+    db->backend = STO_BACKEND_IMAGE;
+    db->image = image;
+  }
+
+  return r;
+}
+
+// Resources are looked up in the shared cache before going to storage. What is
+// cached is the content left by StoDecodeResource, so cached bitmaps are
+// already decompressed and decoding them again is a no-op. Entries are keyed on
+// the creation date and the modification number, which every write bumps.
+
+static uint64_t StoResourceVersion(storage_db_t *db) {
+  return ((uint64_t)db->crDate << 32) | db->modNum;
+}
+
+// Called by rescache_get once the size of the entry is known, without the cache lock.
+// A resource already in memory is reloaded in place, and only from an entry of its size.
+static void *StoResourceAlloc(uint32_t size, void *data) {
+  storage_handle_t *h = (storage_handle_t *)data;
+
+  if (h->buf) {
+    return size == h->size ? h->buf : NULL;
+  }
+
+  return StoPtrNew(h, size, h->d.res.type, h->d.res.id);
+}
+
+// Fills h->buf, allocating it first when the resource is not in memory. The buffer
+// gets the size of the cache entry on a hit and the size in storage on a miss.
+static int StoReadResource(storage_t *sto, storage_db_t *db, storage_handle_t *h, Boolean *cached) {
+  uint8_t *buf;
+  uint32_t size;
+
+  buf = rescache_get(stoCache, db->name, StoResourceVersion(db), h->d.res.type, h->d.res.id, StoResourceAlloc, h, &size);
+  *cached = buf != NULL;
+
+  if (*cached) {
+    h->buf = buf;
+    h->size = size;
+    dbstats_count(stoStats, db->stats, DBSTATS_CACHED, size);
+    return size;
+  }
+
+  if (h->buf == NULL) {
+    if (h->d.res.storedSize) {
+      h->size = h->d.res.storedSize;
+    }
+    if ((h->buf = StoPtrNew(h, h->size, h->d.res.type, h->d.res.id)) == NULL) {
+      return -1;
+    }
+  }
+
+  return StoReadElement(sto, db, h, h->buf, h->size);
+}
+
+static void StoCacheResource(storage_db_t *db, storage_handle_t *h) {
+  if (h->buf) {
+    rescache_put(stoCache, db->name, StoResourceVersion(db), h->d.res.type, h->d.res.id, h->buf, h->size);
+  }
+}
+
+static int StoInflateRec(storage_t *sto, storage_db_t *db, storage_handle_t *h) {
+  int r = -1;
+
+  if ((h->buf = StoPtrNew(h, h->size, 0, 0)) != NULL) {
+    h->htype |= STO_INFLATED;
+    h->useCount = 1;
+    debug(DEBUG_TRACE, "STOR", "reading record at %p", h->buf);
+    if (StoReadElement(sto, db, h, h->buf, h->size) == h->size) {
+      dbstats_count(stoStats, db->stats, DBSTATS_INFLATE, h->size);
+      h->d.rec.attr &= ~dmRecAttrDirty;
+      h->d.rec.attr |= dmRecAttrBusy;
+      h->lockCount = 0;
+      r = 0;
+    }
+  }
+
+  return r;
+}
+
+// Returns the handle of the element at pos, or for a record that has no handle yet a
+// copy of it in tmp, built from its index entry. Only for reading what the index holds.
+static storage_handle_t *StoPeek(storage_db_t *db, uint32_t pos, storage_handle_t *tmp) {
+  storage_handle_t *h = db->elements[pos];
+  uint32_t uniqueID, attr, size, key, i;
+
+  if (!STO_LAZY(h)) return h;
+
+  i = STO_LAZY_ENTRY(h);
+  i += get4b(&uniqueID, db->lazy, i);
+  i += get4b(&attr, db->lazy, i);
+  i += get4b(&size, db->lazy, i);
+  i += get4b(&key, db->lazy, i);
+
+  xmemset(tmp, 0, sizeof(storage_handle_t));
+  tmp->magic = STO_MAGIC;
+  tmp->htype = STO_TYPE_REC;
+  tmp->size = size;
+  tmp->d.rec.uniqueID = uniqueID;
+  tmp->d.rec.attr = attr | dmRecAttached;
+  tmp->d.rec.key = db->keyMode ? key : 0;
+
+  return tmp;
+}
+
+// Returns the handle of the element at pos, creating it if the record has none yet.
+static storage_handle_t *StoElement(storage_db_t *db, uint32_t pos) {
+  storage_handle_t tmp, *h = db->elements[pos];
+
+  if (STO_LAZY(h)) {
+    if ((h = pumpkin_heap_alloc(sizeof(storage_handle_t), "Handle")) != NULL) {
+      *h = *StoPeek(db, pos, &tmp);
+      db->elements[pos] = h;
+    }
+  }
+
+  return h;
+}
+
+static int StoPutIndexEntry(storage_handle_t *h, uint8_t *buf, int i) {
+  i += put4b(h->d.rec.uniqueID, buf, i);
+  i += put4b(h->d.rec.attr & ATTR_MASK, buf, i);
+  i += put4b(h->size, buf, i);
+  i += put4b(h->d.rec.key, buf, i);
+
+  return STO_INDEX_ENTRY;
+}
+
+// the entry of a record without a handle is copied as it was read
+static int StoPutIndexPos(storage_db_t *db, uint32_t pos, uint8_t *buf, int i) {
+  storage_handle_t *h = db->elements[pos];
+
+  if (!STO_LAZY(h)) return StoPutIndexEntry(h, buf, i);
+
+  xmemcpy(&buf[i], &db->lazy[STO_LAZY_ENTRY(h)], STO_INDEX_ENTRY);
+  if (!db->keyMode) put4b(0, buf, i + 12);
+
+  return STO_INDEX_ENTRY;
+}
+
+// Writes a full snapshot of the record index, discarding the journal.
+static int StoWriteIndex(storage_t *sto, storage_db_t *db) {
+  char buf[VFS_PATH];
+  uint8_t *p;
+  uint32_t i, j, size;
+  int r = -1;
+
+  size = STO_INDEX_HEADER + db->numRecs * STO_INDEX_ENTRY;
+  if ((p = xcalloc(1, size)) == NULL) {
+    return -1;
+  }
+
+  i = 0;
+  i += put4b(STO_INDEX_MAGIC, p, i);
+  i += put4b(STO_INDEX_VERSION, p, i);
+  i += put4b(STO_INDEX_ENTRY, p, i);
+  i += put4b(db->numRecs, p, i);
+  i += put2b(db->keyOffset, p, i);
+  i += put2b(db->keyMode, p, i);
+  for (j = 0; j < db->numRecs; j++) {
+    i += StoPutIndexPos(db, j, p, i);
+  }
+
+  storage_db_name(sto, db, STO_FILE_RINDEX, 0, 0, 0, 0, buf);
+  if (StoPutFile(sto, buf, p, size) == size) {
+    r = 0;
+    db->indexJournal = 0;
+    db->indexEnd = size;
+    if (db->indexLegacy) {
+      // the text index has been converted, remove it
+      storage_db_name(sto, db, STO_FILE_INDEX, 0, 0, 0, 0, buf);
+      StoUnlinkFile(sto, buf);
+      db->indexLegacy = 0;
+    }
+    if (db->container) {
+      r = container_sync(db->container);
+    }
+  } else {
+    ErrFatalDisplayEx("create index failed", 1);
+  }
+  xfree(p);
+
+  return r;
+}
+
+// Appends an incremental update to the record index. Each change is a single
+// entry, so that a snapshot written when the journal grows larger than the
+// index itself never has a part of the same change logged after it.
+static int StoJournalEntry(storage_t *sto, storage_db_t *db, uint8_t *rec) {
+  char buf[VFS_PATH];
+  int r = -1;
+
+  if (db->indexLegacy || db->indexEnd == 0 || db->indexJournal >= db->numRecs + STO_INDEX_SLACK) {
+    return StoWriteIndex(sto, db);
+  }
+
+  // entries are written at a known offset rather than appended, so that writing one again is harmless
+  storage_db_name(sto, db, STO_FILE_RINDEX, 0, 0, 0, 0, buf);
+  if (StoWriteFileAt(sto, buf, db->indexEnd, rec, STO_INDEX_JOURNAL) == STO_INDEX_JOURNAL) {
+    db->indexJournal++;
+    db->indexEnd += STO_INDEX_JOURNAL;
+    r = 0;
+  }
+
+  if (r == -1) {
+    r = StoWriteIndex(sto, db);
+  } else if (db->container) {
+    r = container_sync(db->container);
+  }
+
+  return r;
+}
+
+// Insert and update take the entry from the current handle at position pos, remove only needs pos.
+static int StoJournalIndex(storage_t *sto, storage_db_t *db, uint32_t op, uint32_t pos) {
+  uint8_t rec[STO_INDEX_JOURNAL];
+
+  if (db->ftype != STO_TYPE_REC) {
+    return 0;
+  }
+
+  xmemset(rec, 0, sizeof(rec));
+  put4b((op << 24) | (pos & 0xFFFFFF), rec, 0);
+  if (op != STO_INDEX_REMOVE) {
+    StoPutIndexPos(db, pos, rec, 4);
+  }
 
-  debug(DEBUG_TRACE, "STOR", "StoEscapeName \"%s\" -> \"%s\"", src, dst);
+  return StoJournalEntry(sto, db, rec);
 }
 
-static void StoUnescapeName(char *src, char *dst, int n) {
-  char buf[4];
-  int i, j, c;
+// A move takes the entry at from out of the index and puts it back at to,
+// its position once the move is done.
+static int StoJournalMove(storage_t *sto, storage_db_t *db, uint32_t from, uint32_t to) {
+  uint8_t rec[STO_INDEX_JOURNAL];
 
-  for (j = 0, i = 0; src[j]; j++) {
-    if (src[j] == '_') i = j;
+  if (db->ftype != STO_TYPE_REC) {
+    return 0;
   }
 
-  for (j = 0, i++; src[i] && j < n-1; i += 2) {
-    buf[0] = src[i];
-    buf[1] = src[i+1];
-    buf[2] = 0;
-    sys_sscanf(buf, "%02X", &c);
-    dst[j++] = c;
-  }
-  dst[j] = 0;
+  xmemset(rec, 0, sizeof(rec));
+  put4b((STO_INDEX_MOVE << 24) | (from & 0xFFFFFF), rec, 0);
+  put4b(to, rec, 4);
 
-  debug(DEBUG_TRACE, "STOR", "StoUnescapeName \"%s\" -> \"%s\"", src, dst);
+  return StoJournalEntry(sto, db, rec);
 }
 
-static vfs_file_t *StoVfsOpen(vfs_session_t *session, char *path, int mode) {
-  return vfs_open(session, path, mode);
+// Time spent waiting for sto->mutex is counted for the process only.
+static int StoLockStorage(storage_t *sto) {
+  int64_t t;
+  int r;
+
+  t = sys_get_clock();
+  if ((r = mutex_lock(sto->mutex)) == 0) {
+    dbstats_count(stoStats, NULL, DBSTATS_LOCK, sys_get_clock() - t);
+  }
+
+  return r;
 }
 
-static int StoVfsMkdir(vfs_session_t *session, char *path) {
-  return vfs_mkdir(session, path);
+// Operations on an open database take its own lock, so that tasks working on
+// different databases do not wait for each other. sto->mutex only guards the
+// list of databases: creating, opening, closing, renaming and deleting them.
+static int StoLockDatabase(storage_t *sto, storage_db_t *db, Boolean write) {
+  int64_t t;
+  int r;
+
+  t = sys_get_clock();
+  if ((r = db->lock ? dblock_lock(db->lock, write, 1) : mutex_lock(sto->mutex)) == 0) {
+    dbstats_count(stoStats, db->stats, DBSTATS_LOCK, sys_get_clock() - t);
+  }
+
+  return r;
 }
 
-static int StoVfsRename(vfs_session_t *session, char *path1, char *path2) {
-  return vfs_rename(session, path1, path2);
+static int StoUnlockDatabase(storage_t *sto, storage_db_t *db) {
+  return db->lock ? dblock_unlock(db->lock) : mutex_unlock(sto->mutex);
 }
 
-static int StoVfsUnlink(vfs_session_t *session, char *path) {
-  return vfs_unlink(session, path);
+// Released records stay inflated while they fit in the database record cache,
+// so that the next DmQueryRecord/DmGetRecord finds them in memory. A dirty
+// record keeps dmRecAttrDirty until it is written, which happens when it is
+// evicted, when the database is synced or closed, when the heap runs out of
+// memory or when it has been waiting for STO_FLUSH_DELAY seconds.
+// Cached records are kept in release order on a list threaded through their
+// handles, so the least recently released one is always at the head.
+
+static int StoRecordCached(storage_handle_t *h) {
+  return h->htype == (STO_TYPE_REC | STO_INFLATED) && h->useCount == 0 && h->lockCount == 0;
 }
 
-static vfs_dir_t *StoVfsOpendir(vfs_session_t *session, char *path) {
-  return vfs_opendir(session, path);
+// Takes a record off the cache list, returns 1 if it was on it.
+static int StoCacheUnlink(storage_db_t *db, storage_handle_t *h) {
+  if (h->d.rec.cachePrev == NULL && db->cacheHead != h) return 0;
+
+  if (h->d.rec.cachePrev) h->d.rec.cachePrev->d.rec.cacheNext = h->d.rec.cacheNext;
+  else db->cacheHead = h->d.rec.cacheNext;
+  if (h->d.rec.cacheNext) h->d.rec.cacheNext->d.rec.cachePrev = h->d.rec.cachePrev;
+  else db->cacheTail = h->d.rec.cachePrev;
+  h->d.rec.cachePrev = h->d.rec.cacheNext = NULL;
+
+  db->cacheSize = db->cacheHead && db->cacheSize > h->size ? db->cacheSize - h->size : 0;
+  return 1;
 }
 
-static vfs_ent_t *StoVfsReaddir(vfs_dir_t *dir) {
-  return vfs_readdir(dir);
+static void StoCacheAppend(storage_db_t *db, storage_handle_t *h) {
+  StoCacheUnlink(db, h);
+  h->d.rec.cachePrev = db->cacheTail;
+  if (db->cacheTail) db->cacheTail->d.rec.cacheNext = h;
+  else db->cacheHead = h;
+  db->cacheTail = h;
+  db->cacheSize += h->size;
 }
 
-static int StoVfsChecktype(vfs_session_t *session, char *path) {
-  return vfs_checktype(session, path);
+static int StoFlushRecord(storage_t *sto, storage_db_t *db, storage_handle_t *h) {
+  int r = 0;
+
+  if ((h->htype & STO_INFLATED) && (h->d.rec.attr & dmRecAttrDirty)) {
+    debug(DEBUG_TRACE, "STOR", "writing record 0x%06X of \"%s\"", h->d.rec.uniqueID, db->name);
+    r = StoWriteElement(sto, db, h, h->buf, h->size) == -1 ? -1 : 1;
+    h->d.rec.attr &= ~dmRecAttrDirty;
+  }
+
+  return r;
 }
 
-static void *StoVfsLoadlib(vfs_session_t *session, char *path, int *first_load) {
-  return vfs_loadlib(session, path, first_load);
+static void StoDropRecord(storage_db_t *db, storage_handle_t *h) {
+  StoCacheUnlink(db, h);
+  StoPtrFree(h->buf);
+  h->buf = NULL;
+  h->htype &= ~STO_INFLATED;
+  h->d.rec.attr &= ~dmRecAttrBusy;
 }
 
-static void storage_name(storage_t *sto, char *name, int file, int id, uint32_t type, uint8_t attr, uint32_t uniqueId, char *buf) {
-  char escaped[4*dmDBNameLength], st[8];
-  int n, i;
+// Write dirty records. With idle set only records that are not in use are
+// written, and with drop set the records kept by the cache are also freed.
+static void StoFlushRecords(storage_t *sto, storage_db_t *db, Boolean idle, Boolean drop, storage_handle_t *except) {
+  storage_handle_t *h;
+  uint32_t i, n;
 
-  StoEscapeName((uint8_t *)name, escaped, sizeof(escaped)-1);
-  sys_snprintf(buf, VFS_PATH - 1, "%s%s", sto->path, escaped);
-  n = sys_strlen(buf);
+  if (db->ftype != STO_TYPE_REC || db->elements == NULL) return;
 
-  switch (file) {
-    case STO_FILE_HEADER:
-      sys_strncat(buf, "/header", VFS_PATH-n-1);
-      break;
-    case STO_FILE_INDEX:
-      sys_strncat(buf, "/index", VFS_PATH-n-1);
-      break;
-    case STO_FILE_DATA:
-      sys_strncat(buf, "/data", VFS_PATH-n-1);
-      break;
-    case STO_FILE_AINFO:
-      sys_strncat(buf, "/appInfo", VFS_PATH-n-1);
-      break;
-    case STO_FILE_SINFO:
-      sys_strncat(buf, "/sortInfo", VFS_PATH-n-1);
-      break;
-    case STO_FILE_LOCK:
-      sys_strncat(buf, "/lock", VFS_PATH-n-1);
-      break;
-    case STO_FILE_ELEMENT:
-      if (type) {
-        pumpkin_id2s(type, st);
-        for (i = 0; i < 4; i++) {
-          if (!((st[i] >= 'a' && st[i] <= 'z') || (st[i] >= 'A' && st[i] <= 'Z') || (st[i] >= '0' && st[i] <= '9'))) st[i] = '_';
-        }
-        sys_snprintf(&buf[n], VFS_PATH-n-1, "/%s.%08X.%d", st, type, id);
-      } else {
-        sys_snprintf(&buf[n], VFS_PATH-n-1, "/%08X.%02X", uniqueId, attr);
-      }
-      break;
-    case 0:
-      break;
-    default:
-      debug(DEBUG_ERROR, "STOR", "storage_name \"%s\" invalid file type %d", name, file);
-      ErrFatalDisplayEx("invalid file type", 1);
-      break;
+  StoBeginWrite(sto);
+  for (i = 0, n = 0; i < db->numRecs; i++) {
+    h = db->elements[i];
+    if (h == except || STO_LAZY(h)) continue;
+    if (idle && !StoRecordCached(h)) continue;
+    if (StoFlushRecord(sto, db, h) == 1) n++;
+    if (drop && StoRecordCached(h)) StoDropRecord(db, h);
   }
+
+  if (n > 0) {
+    StoWriteIndex(sto, db);
+  }
+  StoEndWrite(sto);
+  db->flushTime = 0;
 }
 
-static int StoInflateRec(storage_t *sto, storage_db_t *db, storage_handle_t *h) {
-  char buf[VFS_PATH];
-  vfs_file_t *f;
-  int r = -1;
+// Evict least recently released records until the cache fits in its budget.
+// Records that were locked again while on the list are only taken off it.
+static void StoTrimRecords(storage_t *sto, storage_db_t *db, uint32_t budget) {
+  storage_handle_t *h;
+  int index;
 
-  if ((h->buf = StoPtrNew(h, h->size, 0, 0)) != NULL) {
-    h->htype |= STO_INFLATED;
-    h->useCount = 1;
-    debug(DEBUG_TRACE, "STOR", "reading record at %p", h->buf);
-    storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
-    if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-      if (vfs_read(f, h->buf, h->size) == h->size) {
-        h->d.rec.attr &= ~dmRecAttrDirty;
-        h->d.rec.attr |= dmRecAttrBusy;
-        h->lockCount = 0;
-        r = 0;
+  while (db->cacheSize > budget && (h = db->cacheHead) != NULL) {
+    if (!StoRecordCached(h)) {
+      StoCacheUnlink(db, h);
+      continue;
+    }
+    if (StoFlushRecord(sto, db, h) == 1) {
+      if ((index = StoHandleFind(db, h)) != -1) {
+        StoJournalIndex(sto, db, STO_INDEX_UPDATE, index);
+      } else {
+        StoWriteIndex(sto, db);
       }
-      vfs_close(f);
     }
+    StoDropRecord(db, h);
   }
-
-  return r;
 }
 
-static int StoWriteIndex(storage_t *sto, storage_db_t *db) {
-  char buf[VFS_PATH];
-  vfs_file_t *f;
-  storage_handle_t *h;
-  uint32_t i;
-  int r = -1;
+static void StoReleaseCache(storage_t *sto, storage_handle_t *except) {
+  storage_db_t *db;
 
-  storage_name(sto, db->name, STO_FILE_INDEX, 0, 0, 0, 0, buf);
-  if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-    for (i = 0; i < db->numRecs; i++) {
-      h = db->elements[i];
-      sys_snprintf(buf, sizeof(buf)-1, "%08X.%02X\n", h->d.rec.uniqueID, h->d.rec.attr & ATTR_MASK);
-      if (vfs_write(f, (uint8_t *)buf, 12) != 12) break;
+  debug(DEBUG_INFO, "STOR", "heap is full, releasing cached records");
+  for (db = sto->list; db; db = db->next) {
+    // called with a database lock already held, so never wait for another one
+    if (db->cacheSize && db->lock && dblock_lock(db->lock, true, 0) == 0) {
+      StoFlushRecords(sto, db, true, true, except);
+      dblock_unlock(db->lock);
     }
-    r = 0;
-    vfs_close(f);
-  } else {
-    ErrFatalDisplayEx("create index failed", 1);
   }
-
-  return r;
 }
 
 static int StoWriteHeader(storage_t *sto, storage_db_t *db) {
-  char buf[VFS_PATH];
+  char buf[VFS_PATH], header[VFS_PATH];
   char stype[8], screator[8];
-  vfs_file_t *f;
   int n, r = -1;
 
-  storage_name(sto, db->name, STO_FILE_HEADER, 0, 0, 0, 0, buf);
-  if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-    pumpkin_id2s(db->type, stype);
-    pumpkin_id2s(db->creator, screator);
-    sys_snprintf(buf, sizeof(buf)-1, "ftype=%u\ntype='%4s'\ncreator='%4s'\nattributes=%u\nuniqueIDSeed=%u\nversion=%u\ncrDate=%u\nmodDate=%u\nbckDate=%u\nmodNum=%d\n",
-      db->ftype, stype, screator, db->attributes, db->uniqueIDSeed, db->version, db->crDate, db->modDate, db->bckDate, db->modNum);
-    n = sys_strlen(buf);
-    if (vfs_write(f, (uint8_t *)buf, n) == n) {
-      r = 0;
-    }
-    vfs_close(f);
+  storage_db_name(sto, db, STO_FILE_HEADER, 0, 0, 0, 0, buf);
+  pumpkin_id2s(db->type, stype);
+  pumpkin_id2s(db->creator, screator);
+  sys_snprintf(header, sizeof(header)-1, "ftype=%u\ntype='%4s'\ncreator='%4s'\nattributes=%u\nuniqueIDSeed=%u\nversion=%u\ncrDate=%u\nmodDate=%u\nbckDate=%u\nmodNum=%d\nbackend=%u\n",
+    db->ftype, stype, screator, db->attributes, db->uniqueIDSeed, db->version, db->crDate, db->modDate, db->bckDate, db->modNum, db->backend);
+  n = sys_strlen(header);
+  if (StoPutFile(sto, buf, (uint8_t *)header, n) == n) {
+    r = 0;
   } else {
     ErrFatalDisplayEx("create header failed", 1);
   }
@@ -374,12 +1304,14 @@ static int StoReadHeader(storage_t *sto, storage_db_t *db) {
   vfs_file_t *f;
   int r = -1;
 
-  storage_name(sto, db->name, STO_FILE_HEADER, 0, 0, 0, 0, buf);
+  storage_db_name(sto, db, STO_FILE_HEADER, 0, 0, 0, 0, buf);
   if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
     xmemset(buf, 0, sizeof(buf));
     if (vfs_read(f, (uint8_t *)buf, sizeof(buf)-1) > 0) {
-      if (sys_sscanf(buf, "ftype=%u\ntype='%4s'\ncreator='%4s'\nattributes=%u\nuniqueIDSeed=%u\nversion=%u\ncrDate=%u\nmodDate=%u\nbckDate=%u\nmodNum=%d\n",
-               &db->ftype, stype, screator, &db->attributes, &db->uniqueIDSeed, &db->version, &db->crDate, &db->modDate, &db->bckDate, &db->modNum) == 10) {
+      // the backend field is optional, headers written before it was added use the directory backend
+      db->backend = STO_BACKEND_DIR;
+      if (sys_sscanf(buf, "ftype=%u\ntype='%4s'\ncreator='%4s'\nattributes=%u\nuniqueIDSeed=%u\nversion=%u\ncrDate=%u\nmodDate=%u\nbckDate=%u\nmodNum=%d\nbackend=%u\n",
+               &db->ftype, stype, screator, &db->attributes, &db->uniqueIDSeed, &db->version, &db->crDate, &db->modDate, &db->bckDate, &db->modNum, &db->backend) >= 10) {
         pumpkin_s2id(&db->type, stype);
         pumpkin_s2id(&db->creator, screator);
         r = 0;
@@ -396,6 +1328,115 @@ static int StoReadHeader(storage_t *sto, storage_db_t *db) {
   return r;
 }
 
+// Databases are hashed by name and by (type, creator), so that lookups do
+// not walk the whole list. Deleted databases keep their place in the list
+// with an empty name, but are removed from both tables.
+
+static uint32_t StoNameHash(const char *name) {
+  uint32_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < dmDBNameLength && name[i]; i++) {
+    h = (h ^ (uint8_t)name[i]) * 16777619u;
+  }
+
+  return (h ^ (h >> 16)) & (STO_DB_BUCKETS - 1);
+}
+
+static uint32_t StoTypeCreatorHash(uint32_t type, uint32_t creator) {
+  uint32_t h = type * 2654435761u ^ creator * 40503u;
+
+  return (h ^ (h >> 16)) & (STO_DB_BUCKETS - 1);
+}
+
+static void StoIndexDatabase(storage_t *sto, storage_db_t *db) {
+  uint32_t i;
+
+  if (db->name[0]) {
+    i = StoNameHash(db->name);
+    db->nameNext = sto->nameHash[i];
+    sto->nameHash[i] = db;
+    i = StoTypeCreatorHash(db->type, db->creator);
+    db->tcNext = sto->tcHash[i];
+    sto->tcHash[i] = db;
+  }
+}
+
+static void StoUnindexDatabase(storage_t *sto, storage_db_t *db) {
+  storage_db_t **p;
+
+  if (db->name[0]) {
+    for (p = &sto->nameHash[StoNameHash(db->name)]; *p; p = &(*p)->nameNext) {
+      if (*p == db) {
+        *p = db->nameNext;
+        break;
+      }
+    }
+    for (p = &sto->tcHash[StoTypeCreatorHash(db->type, db->creator)]; *p; p = &(*p)->tcNext) {
+      if (*p == db) {
+        *p = db->tcNext;
+        break;
+      }
+    }
+    db->nameNext = db->tcNext = NULL;
+  }
+}
+
+// forgets a database deleted by this task or found deleted by StoRefresh
+static void StoClearDatabase(storage_t *sto, storage_db_t *db) {
+  StoUnindexDatabase(sto, db);
+  db->ftype = 0;
+  db->readCount = 0;
+  db->writeCount = 0;
+  db->mode = 0;
+  db->numRecs = 0;
+  db->protect = 0;
+  db->creator = 0;
+  db->type = 0;
+  db->crDate = 0;
+  db->modDate = 0;
+  db->bckDate = 0;
+  db->modNum = 0;
+  db->attributes = 0;
+  db->uniqueIDSeed = ((UInt32)SysRandom32(0)) & 0xFFFFFF;
+  db->version = 0;
+  db->appInfoID = 0;
+  db->sortInfoID = 0;
+  db->f = NULL;
+  db->backend = 0;
+  db->container = NULL;
+  db->indexJournal = 0;
+  db->indexLegacy = 0;
+  db->indexEnd = 0;
+  db->keyOffset = 0;
+  db->keyMode = 0;
+  db->stats = NULL;
+  xmemset(db->name, 0, dmDBNameLength);
+  db->escapedLen = 0;
+
+  sto->num_storage--;
+}
+
+static storage_db_t *StoFindDatabase(storage_t *sto, const char *name) {
+  storage_db_t *db;
+
+  for (db = sto->nameHash[StoNameHash(name)]; db; db = db->nameNext) {
+    if (sys_strcmp(db->name, name) == 0) break;
+  }
+
+  return db;
+}
+
+// When both type and creator are given only the matching hash chain is
+// enumerated, otherwise the whole list. Callers still check each entry.
+static storage_db_t *StoFirstByTypeCreator(storage_t *sto, uint32_t type, uint32_t creator) {
+  return (type && creator) ? sto->tcHash[StoTypeCreatorHash(type, creator)] : sto->list;
+}
+
+static storage_db_t *StoNextByTypeCreator(storage_db_t *db, uint32_t type, uint32_t creator) {
+  return (type && creator) ? db->tcNext : db->next;
+}
+
 static int StoGetFileLocks(storage_t *sto, storage_db_t *db, int *read_locks, int *write_locks) {
   char buf[VFS_PATH];
   vfs_file_t *f;
@@ -404,7 +1445,7 @@ static int StoGetFileLocks(storage_t *sto, storage_db_t *db, int *read_locks, in
   *read_locks = 0;
   *write_locks = 0;
 
-  storage_name(sto, db->name, STO_FILE_LOCK, 0, 0, 0, 0, buf);
+  storage_db_name(sto, db, STO_FILE_LOCK, 0, 0, 0, 0, buf);
   if (StoVfsChecktype(sto->session, buf) == VFS_FILE) {
     if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
       xmemset(buf, 0, sizeof(buf));
@@ -430,7 +1471,7 @@ static int StoPutFileLocks(storage_t *sto, storage_db_t *db, int read_locks, int
   vfs_file_t *f;
   int n, r = -1;
 
-  storage_name(sto, db->name, STO_FILE_LOCK, 0, 0, 0, 0, buf);
+  storage_db_name(sto, db, STO_FILE_LOCK, 0, 0, 0, 0, buf);
   if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
     sys_snprintf(buf, sizeof(buf)-1, "read=%u\nwrite=%u\n", read_locks, write_locks);
     n = sys_strlen(buf);
@@ -540,7 +1581,7 @@ static int StoReadAppInfo(storage_t *sto, storage_db_t *db) {
   void *p;
   int r = -1;
 
-  storage_name(sto, db->name, STO_FILE_AINFO, 0, 0, 0, 0, buf);
+  storage_db_name(sto, db, STO_FILE_AINFO, 0, 0, 0, 0, buf);
   if (StoVfsChecktype(sto->session, buf) != -1) {
     if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
       if ((ent = vfs_fstat(f)) != NULL) {
@@ -568,7 +1609,6 @@ static int StoReadAppInfo(storage_t *sto, storage_db_t *db) {
 static int StoWriteAppInfo(storage_t *sto, storage_db_t *db) {
   char buf[VFS_PATH];
   UInt32 size;
-  vfs_file_t *f;
   MemHandle h;
   void *p;
   int r = -1;
@@ -576,13 +1616,10 @@ static int StoWriteAppInfo(storage_t *sto, storage_db_t *db) {
   if (db->appInfoID) {
     if ((h = MemLocalIDToHandle(db->appInfoID)) != NULL) {
       if ((p = MemHandleLock(h)) != NULL) {
-        storage_name(sto, db->name, STO_FILE_AINFO, 0, 0, 0, 0, buf);
-        if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-          size = MemHandleSize(h);
-          if (vfs_write(f, p, size) == size) {
-            r = 0;
-          }
-          vfs_close(f);
+        storage_db_name(sto, db, STO_FILE_AINFO, 0, 0, 0, 0, buf);
+        size = MemHandleSize(h);
+        if (StoPutFile(sto, buf, p, size) == size) {
+          r = 0;
         } else {
           ErrFatalDisplayEx("create appInfo failed", 1);
         }
@@ -601,7 +1638,7 @@ static int StoReadSortInfo(storage_t *sto, storage_db_t *db) {
   void *p;
   int r = -1;
 
-  storage_name(sto, db->name, STO_FILE_SINFO, 0, 0, 0, 0, buf);
+  storage_db_name(sto, db, STO_FILE_SINFO, 0, 0, 0, 0, buf);
   if (StoVfsChecktype(sto->session, buf) != -1) {
     if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
       if ((ent = vfs_fstat(f)) != NULL) {
@@ -628,7 +1665,6 @@ static int StoReadSortInfo(storage_t *sto, storage_db_t *db) {
 static int StoWriteSortInfo(storage_t *sto, storage_db_t *db) {
   char buf[VFS_PATH];
   UInt32 size;
-  vfs_file_t *f;
   MemHandle h;
   void *p;
   int r = -1;
@@ -636,13 +1672,10 @@ static int StoWriteSortInfo(storage_t *sto, storage_db_t *db) {
   if (db->sortInfoID) {
     if ((h = MemLocalIDToHandle(db->sortInfoID)) != NULL) {
       if ((p = MemHandleLock(h)) != NULL) {
-        storage_name(sto, db->name, STO_FILE_SINFO, 0, 0, 0, 0, buf);
-        if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-          size = MemHandleSize(h);
-          if (vfs_write(f, p, size) == size) {
-            r = 0;
-          }
-          vfs_close(f);
+        storage_db_name(sto, db, STO_FILE_SINFO, 0, 0, 0, 0, buf);
+        size = MemHandleSize(h);
+        if (StoPutFile(sto, buf, p, size) == size) {
+          r = 0;
         } else {
           ErrFatalDisplayEx("create sortInfo failed", 1);
         }
@@ -690,12 +1723,110 @@ static vfs_ent_t *StoReadEnt(vfs_dir_t *dir) {
   return ent;
 }
 
+void StoInitCache(void) {
+  if (stoCache == NULL) {
+    stoCache = rescache_create(STO_CACHE_SIZE, STO_CACHE_ENTRY);
+  }
+  if (stoLocks == NULL) {
+    stoLocks = dblock_create();
+  }
+  if (stoStats == NULL) {
+    stoStats = dbstats_create();
+  }
+}
+
+void StoFinishCache(void) {
+  if (stoCache) {
+    rescache_destroy(stoCache);
+    stoCache = NULL;
+  }
+  if (stoLocks) {
+    dblock_destroy(stoLocks);
+    stoLocks = NULL;
+  }
+  if (stoJournal) {
+    journal_close(stoJournal);
+    stoJournal = NULL;
+  }
+  if (stoWatch) {
+    dbwatch_destroy(stoWatch);
+    stoWatch = NULL;
+  }
+  if (stoStats) {
+    dbstats_destroy(stoStats);
+    stoStats = NULL;
+  }
+}
+
+void StoSetContainer(int container) {
+  stoBackend = container ? STO_BACKEND_CONTAINER : STO_BACKEND_DIR;
+}
+
+void StoSetCompress(int compress) {
+  stoCompress = compress;
+}
+
+void StoSetImages(int images) {
+  stoImages = images;
+}
+
+void StoSetJournal(int journal) {
+  stoJournaling = journal;
+}
+
+void StoSetWatch(int watch) {
+  stoWatching = watch;
+}
+
+void StoSetRecordCache(uint32_t size) {
+  stoRecordCache = size;
+}
+
+// Counters of a database, or of the whole process when name is NULL. See dbstats.h for the events.
+int StoGetStats(char *name, int event, uint64_t *count, uint64_t *amount) {
+  return dbstats_read(stoStats, name, event, count, amount);
+}
+
+// all counters as a JSON object, the caller frees it with xfree
+char *StoGetStatsJson(void) {
+  return dbstats_json(stoStats);
+}
+
+void StoResetStats(void) {
+  dbstats_reset(stoStats);
+}
+
+// called periodically by each task to write records left dirty in the record cache
+void StoSync(void) {
+  storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
+  storage_db_t *db;
+  uint32_t now;
+
+  if (sto && sto->flushTime) {
+    now = TimGetSeconds();
+    if (now - sto->flushTime >= STO_FLUSH_DELAY) {
+      sto->flushTime = 0;
+      for (db = sto->list; db; db = db->next) {
+        if (db->flushTime) {
+          if (now - db->flushTime >= STO_FLUSH_DELAY && StoLockDatabase(sto, db, true) == 0) {
+            StoFlushRecords(sto, db, true, false, NULL);
+            StoUnlockDatabase(sto, db);
+          } else if (sto->flushTime == 0 || db->flushTime < sto->flushTime) {
+            sto->flushTime = db->flushTime;
+          }
+        }
+      }
+    }
+  }
+}
+
 int StoInit(char *path, mutex_t *mutex) {
   storage_t *sto;
   vfs_dir_t *dir;
   vfs_ent_t *ent;
   storage_db_t *db;
   LocalID dbID;
+  char buf[VFS_PATH];
   int r = -1;
 
   if ((sto = xcalloc(1, sizeof(storage_t))) != NULL) {
@@ -705,6 +1836,24 @@ int StoInit(char *path, mutex_t *mutex) {
     sto->end = sto->base + sto->size;
     sys_strncpy(sto->path, path, MAX_STORAGE_PATH - 1);
     if ((sto->session = vfs_open_session()) != NULL) {
+      // the first task replays what a crash left in the journal, before any header is read
+      if (stoJournaling && stoJournal == NULL && mutex_lock(mutex) == 0) {
+        if (stoJournal == NULL) {
+          sys_snprintf(buf, sizeof(buf)-1, "%s%s", sto->path, STO_JOURNAL_FILE);
+          stoJournal = journal_open(buf);
+        }
+        mutex_unlock(mutex);
+      }
+      if (stoWatching && stoWatch == NULL && mutex_lock(mutex) == 0) {
+        if (stoWatch == NULL && vfs_localpath(sto->session, sto->path, buf, sizeof(buf)) == 0) {
+          stoWatch = dbwatch_create(buf, STO_WATCH_FILE);
+        }
+        // without a watcher every refresh scans the root
+        if (stoWatch == NULL) stoWatching = 0;
+        mutex_unlock(mutex);
+      }
+      // changes made while the root is scanned are seen again by the first refresh
+      sto->watchPos = dbwatch_position(stoWatch);
       if ((dir = StoVfsOpendir(sto->session, sto->path)) != NULL) {
         for (;;) {
           ent = StoReadEnt(dir);
@@ -726,6 +1875,7 @@ int StoInit(char *path, mutex_t *mutex) {
           debug(DEBUG_TRACE, "STOR", "StoInit 0x%08X database \"%s\"", dbID, db->name);
           sto->list = db;
           sto->num_storage++;
+          StoIndexDatabase(sto, db);
         }
         vfs_closedir(dir);
         if (sto) {
@@ -744,44 +1894,105 @@ int StoInit(char *path, mutex_t *mutex) {
   return r;
 }
 
+static void StoRefreshDatabase(storage_t *sto, char *name) {
+  storage_db_t *db;
+  LocalID dbID;
+
+  if ((db = pumpkin_heap_alloc(sizeof(storage_db_t), "storage_db")) != NULL) {
+    sys_strncpy(db->name, name, dmDBNameLength-1);
+    if (StoReadHeader(sto, db) == 0) {
+      dbID = (uint8_t *)db - sto->base;
+      debug(DEBUG_INFO, "STOR", "StoRefresh 0x%08X database \"%s\"", dbID, db->name);
+      db->next = sto->list;
+      sto->list = db;
+      sto->num_storage++;
+      StoIndexDatabase(sto, db);
+    } else {
+      pumpkin_heap_free(db, "storage_db");
+    }
+  }
+}
+
+static void StoRefreshScan(storage_t *sto) {
+  vfs_dir_t *dir;
+  vfs_ent_t *ent;
+  char name[dmDBNameLength];
+
+  if ((dir = StoVfsOpendir(sto->session, sto->path)) != NULL) {
+    for (;;) {
+      ent = StoReadEnt(dir);
+      if (ent == NULL) break;
+      StoUnescapeName(ent->name, name, dmDBNameLength);
+      if (StoFindDatabase(sto, name) == NULL) {
+        StoRefreshDatabase(sto, name);
+      }
+    }
+    vfs_closedir(dir);
+  }
+}
+
+// Applies the changes seen by the watcher since the last refresh of this
+// task. Databases open in this task are left alone. Without a watcher, or
+// when changes were lost, the root is scanned for new databases instead.
+static void StoRefreshChanges(storage_t *sto) {
+  storage_db_t *db;
+  char escaped[4*dmDBNameLength], name[dmDBNameLength], buf[VFS_PATH];
+  int type;
+
+  for (;;) {
+    if ((type = dbwatch_next(stoWatch, &sto->watchPos, escaped, sizeof(escaped))) == 0) break;
+    if (type == DBWATCH_RESCAN) {
+      StoRefreshScan(sto);
+      continue;
+    }
+
+    StoUnescapeName(escaped, name, dmDBNameLength);
+    if (name[0] == 0) continue;
+    db = StoFindDatabase(sto, name);
+
+    switch (type) {
+      case DBWATCH_ADD:
+        if (db == NULL) StoRefreshDatabase(sto, name);
+        break;
+      case DBWATCH_MODIFY:
+        if (db == NULL) {
+          // the header is written after the directory is created
+          StoRefreshDatabase(sto, name);
+        } else if (db->readCount == 0 && db->writeCount == 0) {
+          debug(DEBUG_TRACE, "STOR", "StoRefresh header of database \"%s\" changed", name);
+          StoUnindexDatabase(sto, db);
+          StoReadHeader(sto, db);
+          StoIndexDatabase(sto, db);
+        }
+        break;
+      case DBWATCH_REMOVE:
+        if (db && db->readCount == 0 && db->writeCount == 0) {
+          // the database may have been created again since
+          storage_db_name(sto, db, 0, 0, 0, 0, 0, buf);
+          if (vfs_checktype(sto->session, buf) != VFS_DIR) {
+            debug(DEBUG_INFO, "STOR", "StoRefresh database \"%s\" removed", name);
+            rescache_invalidate(stoCache, db->name);
+            StoClearDatabase(sto, db);
+          }
+        }
+        break;
+    }
+  }
+}
+
 int StoRefresh(void) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
-  vfs_dir_t *dir;
-  vfs_ent_t *ent;
-  storage_db_t *db, *old, *oldList;
-  LocalID dbID;
-  char name[dmDBNameLength];
-  int found, r = -1;
+  int r = -1;
 
   if (sto) {
-    if (mutex_lock(sto->mutex) == 0) {
-      if ((dir = StoVfsOpendir(sto->session, sto->path)) != NULL) {
-        oldList = sto->list;
-        for (;;) {
-          ent = StoReadEnt(dir);
-          if (ent == NULL) break;
-          StoUnescapeName(ent->name, name, dmDBNameLength);
-          for (old = oldList, found = 0; old && !found; old = old->next) {
-            found = sys_strncmp(old->name, name, sys_strlen(name)) == 0;
-          }
-          if (!found) {
-            if ((db = pumpkin_heap_alloc(sizeof(storage_db_t), "storage_db")) != NULL) {
-              sys_strncpy(db->name, name, dmDBNameLength-1);
-              if (StoReadHeader(sto, db) == 0) {
-                dbID = (uint8_t *)db - sto->base;
-                debug(DEBUG_INFO, "STOR", "StoRefresh 0x%08X database \"%s\"", dbID, db->name);
-                db->next = sto->list;
-                sto->list = db;
-                sto->num_storage++;
-              } else {
-                pumpkin_heap_free(db, "storage_db");
-              }
-            }
-          }
-        }
-        vfs_closedir(dir);
+    if (StoLockStorage(sto) == 0) {
+      if (stoWatch) {
+        StoRefreshChanges(sto);
+      } else {
+        StoRefreshScan(sto);
       }
       mutex_unlock(sto->mutex);
+      r = 0;
     }
   }
 
@@ -950,9 +2161,10 @@ Err DmSetDatabaseInfo(UInt16 cardNo, LocalID  dbID, const Char *nameP,
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
   char buf1[VFS_PATH], buf2[VFS_PATH];
+  int header;
   Err err = dmErrInvalidParam;
 
-  if (mutex_lock(sto->mutex) == 0) {
+  if (StoLockStorage(sto) == 0) {
     if (dbID < (sto->size - sizeof(storage_db_t))) {
       db = (storage_db_t *) (sto->base + dbID);
       if (attributesP) db->attributes = *attributesP;
@@ -961,9 +2173,14 @@ Err DmSetDatabaseInfo(UInt16 cardNo, LocalID  dbID, const Char *nameP,
       if (modDateP) db->modDate = *modDateP;
       if (bckUpDateP) db->bckDate = *bckUpDateP;
       if (modNumP) db->modNum = *modNumP;
-      if (typeP) db->type = *typeP;
-      if (creatorP) db->creator = *creatorP;
+      if (typeP || creatorP) {
+        StoUnindexDatabase(sto, db);
+        if (typeP) db->type = *typeP;
+        if (creatorP) db->creator = *creatorP;
+        StoIndexDatabase(sto, db);
+      }
 
+      StoBeginWrite(sto);
       if (appInfoIDP) {
         db->appInfoID = *appInfoIDP;
         StoWriteAppInfo(sto, db);
@@ -973,12 +2190,32 @@ Err DmSetDatabaseInfo(UInt16 cardNo, LocalID  dbID, const Char *nameP,
         db->sortInfoID = *sortInfoIDP;
         StoWriteSortInfo(sto, db);
       }
-      if (StoWriteHeader(sto, db) == 0) {
+      header = StoWriteHeader(sto, db);
+      StoEndWrite(sto);
+
+      if (header == 0) {
         if (nameP && sys_strcmp(db->name, nameP)) {
-          storage_name(sto, db->name, 0, 0, 0, 0, 0, buf1);
+          storage_db_name(sto, db, 0, 0, 0, 0, 0, buf1);
           storage_name(sto, (char *)nameP, 0, 0, 0, 0, 0, buf2);
+          // the journal refers to files by path, so it is emptied before their directory moves
+          journal_checkpoint(stoJournal);
           if (StoVfsRename(sto->session, buf1, buf2) == 0) {
+            rescache_invalidate(stoCache, db->name);
+            StoUnindexDatabase(sto, db);
             sys_strncpy(db->name, nameP, dmDBNameLength - 1);
+            db->escapedLen = 0;
+            StoIndexDatabase(sto, db);
+            if (db->container) {
+              storage_db_name(sto, db, STO_FILE_CONTAINER, 0, 0, 0, 0, buf2);
+              container_rename(db->container, buf2);
+            }
+            if (db->lock) {
+              dblock_put(db->lock);
+              db->lock = dblock_get(stoLocks, db->name);
+            }
+            if (db->stats) {
+              db->stats = dbstats_get(stoStats, db->name);
+            }
             err = errNone;
           }
         } else {
@@ -1002,15 +2239,15 @@ Err DmGetNextDatabaseByTypeCreator(Boolean newSearch, DmSearchStatePtr stateInfo
 
   if (stateInfoP) {
     if (newSearch) {
-      stateInfoP->p = sto->list;
+      stateInfoP->p = StoFirstByTypeCreator(sto, type, creator);
     } else {
     }
-    for (db = (storage_db_t *)stateInfoP->p; db; db = db->next) {
+    for (db = (storage_db_t *)stateInfoP->p; db; db = StoNextByTypeCreator(db, type, creator)) {
       if ((type != 0 && type != db->type) || (creator != 0 && creator != db->creator) || db->name[0] == 0) {
-        stateInfoP->p = db->next;
+        stateInfoP->p = StoNextByTypeCreator(db, type, creator);
         continue;
       }
-      stateInfoP->p = db->next;
+      stateInfoP->p = StoNextByTypeCreator(db, type, creator);
       if (cardNoP) *cardNoP = 0;
       if (dbIDP) *dbIDP = (uint8_t *)db - sto->base;
       err = errNone;
@@ -1049,17 +2286,12 @@ LocalID DmFindDatabase(UInt16 cardNo, const Char *nameP) {
   LocalID dbID = 0;
   Err err = dmErrCantFind;
 
-  if (nameP) {
-    for (db = sto->list; db; db = db->next) {
-      if (sys_strcmp(db->name, nameP) == 0) {
-        dbID = (uint8_t *)db - sto->base;
-        if (dbID == sto->watchID) {
-          debug(DEBUG_INFO, "STOR", "WATCH DmFindDatabase(\"%s\"): 0x%08X", nameP, dbID);
-        }
-        err = errNone;
-        break;
-      }
+  if (nameP && nameP[0] && (db = StoFindDatabase(sto, nameP)) != NULL) {
+    dbID = (uint8_t *)db - sto->base;
+    if (dbID == sto->watchID) {
+      debug(DEBUG_INFO, "STOR", "WATCH DmFindDatabase(\"%s\"): 0x%08X", nameP, dbID);
     }
+    err = errNone;
   }
 
   StoCheckErr(err);
@@ -1069,35 +2301,26 @@ LocalID DmFindDatabase(UInt16 cardNo, const Char *nameP) {
 static MemHandle DmQueryRecordEx(DmOpenRef dbP, UInt16 index, Boolean setBusy) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  vfs_file_t *f;
   DmOpenType *dbRef;
-  char buf[VFS_PATH];
   storage_handle_t *h = NULL;
   Err err = dmErrIndexOutOfRange;
 
   if (dbP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
-        if (db->ftype == STO_TYPE_REC && index < db->numRecs && db->elements[index]) {
-          h = db->elements[index];
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, false) == 0) {
+        if (db->ftype == STO_TYPE_REC && index < db->numRecs && (h = StoElement(db, index)) != NULL) {
           if (!(h->htype & STO_INFLATED)) {
             if ((h->buf = StoPtrNew(h, h->size, 0, 0)) != NULL) {
               h->htype |= STO_INFLATED;
               h->useCount = 1;
-              storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
-              if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-                if (vfs_read(f, h->buf, h->size) == h->size) {
-                  h->d.rec.attr &= ~dmRecAttrDirty;
-                  h->d.rec.attr |= dmRecAttrBusy;
-                  h->lockCount = 0;
-                  err = errNone;
-                } else {
-                  err = dmErrMemError;
-                  h = NULL;
-                }
-                vfs_close(f);
+              if (StoReadElement(sto, db, h, h->buf, h->size) == h->size) {
+                dbstats_count(stoStats, db->stats, DBSTATS_INFLATE, h->size);
+                h->d.rec.attr &= ~dmRecAttrDirty;
+                h->d.rec.attr |= dmRecAttrBusy;
+                h->lockCount = 0;
+                err = errNone;
               } else {
                 err = dmErrMemError;
                 h = NULL;
@@ -1107,12 +2330,17 @@ static MemHandle DmQueryRecordEx(DmOpenRef dbP, UInt16 index, Boolean setBusy) {
               h = NULL;
             }
           } else {
+            if (StoRecordCached(h)) {
+              // found in the record cache
+              StoCacheUnlink(db, h);
+              h->d.rec.attr |= dmRecAttrBusy;
+            }
             h->useCount++;
             err = errNone;
           }
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -1132,42 +2360,55 @@ Err DmReleaseRecord(DmOpenRef dbP, UInt16 index, Boolean dirty) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
   storage_handle_t *h;
-  vfs_file_t *f;
   DmOpenType *dbRef;
-  char buf[VFS_PATH];
   Err err = dmErrIndexOutOfRange;
 
   if (dbP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
         if (db->ftype == STO_TYPE_REC && index < db->numRecs && db->elements[index]) {
+          // a record without a handle was never queried, so there is nothing to release
           h = db->elements[index];
-          if (h->htype == (STO_TYPE_REC | STO_INFLATED)) {
-            h->htype &= ~STO_INFLATED;
+          if (!STO_LAZY(h) && h->htype == (STO_TYPE_REC | STO_INFLATED)) {
             if (h->useCount) {
               h->useCount--;
             } else {
               debug(DEBUG_ERROR, "STOR", "DmReleaseRecord database \"%s\" index %d useCount < 0", db->name, index);
             }
-            if (dirty || (h->d.rec.attr & dmRecAttrDirty)) {
-              storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
-              if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-                if (vfs_write(f, h->buf, h->size) != h->size) {
-                }
-                vfs_close(f);
+            if (dirty) {
+              h->d.rec.attr |= dmRecAttrDirty;
+            }
+            if (h->buf && h->size <= stoRecordCache) {
+              // keep the record in the cache, a dirty record is written later
+              h->useCount = 0;
+              h->d.rec.attr &= ~dmRecAttrBusy;
+              StoCacheAppend(db, h);
+              if ((h->d.rec.attr & dmRecAttrDirty) && db->flushTime == 0) {
+                db->flushTime = TimGetSeconds();
+                if (sto->flushTime == 0) sto->flushTime = db->flushTime;
               }
-              h->d.rec.attr &= ~dmRecAttrDirty;
+              StoBeginWrite(sto);
+              StoTrimRecords(sto, db, stoRecordCache);
+              StoEndWrite(sto);
+            } else {
+              StoCacheUnlink(db, h);
+              StoBeginWrite(sto);
+              if (StoFlushRecord(sto, db, h) == 1) {
+                StoJournalIndex(sto, db, STO_INDEX_UPDATE, index);
+              }
+              StoEndWrite(sto);
+              if (h->buf) StoPtrFree(h->buf);
+              h->buf = NULL;
+              h->htype &= ~STO_INFLATED;
+              h->d.rec.attr &= ~dmRecAttrBusy;
             }
-            if (h->buf) StoPtrFree(h->buf);
-            h->buf = NULL;
-            h->d.rec.attr &= ~dmRecAttrBusy;
           }
           err = errNone;
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -1178,7 +2419,7 @@ Err DmReleaseRecord(DmOpenRef dbP, UInt16 index, Boolean dirty) {
 Err DmDatabaseSize(UInt16 cardNo, LocalID dbID, UInt32 *numRecordsP, UInt32 *totalBytesP, UInt32 *dataBytesP) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  storage_handle_t *h;
+  storage_handle_t *h, tmp;
   uint32_t i, n;
   Err err = dmErrInvalidParam;
 
@@ -1187,7 +2428,7 @@ Err DmDatabaseSize(UInt16 cardNo, LocalID dbID, UInt32 *numRecordsP, UInt32 *tot
     if (numRecordsP) *numRecordsP = db->numRecs;
     if (dataBytesP || totalBytesP) {
       for (i = 0, n = 0; i < db->numRecs; i++) {
-        h = db->elements[i];
+        h = StoPeek(db, i, &tmp);
         n += h->size;
       }
       if (dataBytesP) *dataBytesP = n;
@@ -1211,12 +2452,9 @@ Err DmCreateDatabaseEx(const Char *nameP, UInt32 creator, UInt32 type, UInt16 at
   Err err = dmErrInvalidParam;
 
   if (nameP && creator) {
-    if (mutex_lock(sto->mutex) == 0) {
-      for (db = sto->list; db; db = db->next) {
-        if (sys_strcmp(nameP, db->name) == 0) {
-          existing = db;
-          break;
-        }
+    if (StoLockStorage(sto) == 0) {
+      if (nameP[0] && (db = StoFindDatabase(sto, nameP)) != NULL) {
+        existing = db;
       }
       if (existing) {
         if (overwrite) {
@@ -1227,6 +2465,8 @@ Err DmCreateDatabaseEx(const Char *nameP, UInt32 creator, UInt32 type, UInt16 at
             return err;
           }
           storage_name(sto, (char *)nameP, 0, 0, 0, 0, 0, buf);
+          // the journal may still hold removals of the files of a deleted database with the same name
+          journal_checkpoint(stoJournal);
           if (StoVfsMkdir(sto->session, buf) == -1) {
             pumpkin_heap_free(db, "storage_db");
             mutex_unlock(sto->mutex);
@@ -1245,6 +2485,7 @@ Err DmCreateDatabaseEx(const Char *nameP, UInt32 creator, UInt32 type, UInt16 at
           return err;
         }
         storage_name(sto, (char *)nameP, 0, 0, 0, 0, 0, buf);
+        journal_checkpoint(stoJournal);
         if (StoVfsMkdir(sto->session, buf) == -1) {
           pumpkin_heap_free(db, "storage_db");
           mutex_unlock(sto->mutex);
@@ -1261,21 +2502,20 @@ Err DmCreateDatabaseEx(const Char *nameP, UInt32 creator, UInt32 type, UInt16 at
       }
 
       sys_strncpy(db->name, nameP, dmDBNameLength-1);
+      db->escapedLen = 0;
       if (attr & dmHdrAttrResDB) {
         db->ftype = STO_TYPE_RES;
       } else if (attr & dmHdrAttrStream) {
         db->ftype = STO_TYPE_FILE;
-        storage_name(sto, db->name, STO_FILE_DATA, 0, 0, 0, 0, buf);
+        storage_db_name(sto, db, STO_FILE_DATA, 0, 0, 0, 0, buf);
         if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
           vfs_close(f);
         }
       } else {
         db->ftype = STO_TYPE_REC;
-        storage_name(sto, db->name, STO_FILE_INDEX, 0, 0, 0, 0, buf);
-        if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-          vfs_close(f);
-        }
+        StoWriteIndex(sto, db);
       }
+      db->backend = db->ftype == STO_TYPE_FILE ? STO_BACKEND_DIR : stoBackend;
       db->creator = creator;
       db->type = type;
       db->attributes = attr;
@@ -1290,6 +2530,7 @@ Err DmCreateDatabaseEx(const Char *nameP, UInt32 creator, UInt32 type, UInt16 at
           sto->num_storage--;
         }
       } else {
+        StoIndexDatabase(sto, db);
         err = errNone;
       }
 
@@ -1320,6 +2561,364 @@ Err DmCreateDatabase(UInt16 cardNo, const Char *nameP, UInt32 creator, UInt32 ty
   return DmCreateDatabaseEx(nameP, creator, type, resDB ? dmHdrAttrResDB : 0, ((UInt32)SysRandom32(0)) & 0xFFFFFF, true);
 }
 
+// Open addressing table from uniqueID (records) or (type, id) (resources) to
+// element position. Slots hold position+1, keys are read back from the elements
+// themselves. Inserts, removals and moves update the table in place, only a
+// sort invalidates it, and it is then rebuilt on the next lookup.
+
+static void StoResChanged(void) {
+  __atomic_add_fetch(&stoResGen, 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t StoResGen(void) {
+  return __atomic_load_n(&stoResGen, __ATOMIC_ACQUIRE);
+}
+
+static uint32_t StoResKey(uint32_t type, uint16_t id) {
+  return type ^ ((uint32_t)id << 16) ^ id;
+}
+
+static uint32_t StoHashSlot(storage_db_t *db, uint32_t key) {
+  return (key * 0x9E3779B1) & (db->hashSize - 1);
+}
+
+static uint32_t StoHashKey(storage_db_t *db, storage_handle_t *h) {
+  return db->ftype == STO_TYPE_RES ? StoResKey(h->d.res.type, h->d.res.id) : h->d.rec.uniqueID;
+}
+
+static uint32_t StoHashPosKey(storage_db_t *db, uint32_t pos) {
+  storage_handle_t tmp;
+
+  return StoHashKey(db, StoPeek(db, pos, &tmp));
+}
+
+static void StoHashInsert(storage_db_t *db, uint32_t pos) {
+  uint32_t j;
+
+  for (j = StoHashSlot(db, StoHashPosKey(db, pos)); db->hash[j]; j = (j + 1) & (db->hashSize - 1));
+  db->hash[j] = pos + 1;
+}
+
+static void StoHashInvalidate(storage_db_t *db) {
+  db->hashValid = 0;
+  if (db->ftype == STO_TYPE_RES) {
+    StoResChanged();
+  }
+}
+
+static int StoHashRebuild(storage_db_t *db) {
+  uint32_t size, i;
+
+  for (size = 64; size < db->numRecs * 2; size <<= 1);
+  if (size > db->hashSize) {
+    if (db->hash) xfree(db->hash);
+    if ((db->hash = xcalloc(size, sizeof(uint32_t))) == NULL) {
+      db->hashSize = 0;
+      return -1;
+    }
+    db->hashSize = size;
+  } else {
+    xmemset(db->hash, 0, db->hashSize * sizeof(uint32_t));
+  }
+
+  for (i = 0; i < db->numRecs; i++) {
+    StoHashInsert(db, i);
+  }
+  db->hashValid = 1;
+
+  return 0;
+}
+
+static void StoHashAppend(storage_db_t *db) {
+  if (db->hashValid) {
+    if (db->numRecs * 2 > db->hashSize) {
+      db->hashValid = 0;
+    } else {
+      StoHashInsert(db, db->numRecs - 1);
+    }
+  }
+}
+
+// Removes the slot of the element at pos, whose key must not have changed yet.
+// Later slots of the same probe run are moved back, so no tombstones are left.
+static void StoHashDelete(storage_db_t *db, uint32_t pos) {
+  uint32_t i, j, k, mask;
+
+  if (!db->hashValid) return;
+  mask = db->hashSize - 1;
+
+  for (i = StoHashSlot(db, StoHashPosKey(db, pos)); db->hash[i] && db->hash[i] != pos + 1; i = (i + 1) & mask);
+  if (db->hash[i] == 0) {
+    db->hashValid = 0;
+    return;
+  }
+
+  for (j = (i + 1) & mask; db->hash[j]; j = (j + 1) & mask) {
+    k = StoHashSlot(db, StoHashPosKey(db, db->hash[j] - 1));
+    // the slot at j may fill the hole at i unless its home slot lies in (i, j]
+    if (i < j ? (k <= i || k > j) : (k <= i && k > j)) {
+      db->hash[i] = db->hash[j];
+      i = j;
+    }
+  }
+  db->hash[i] = 0;
+}
+
+// the element at pos is about to be removed, later elements move one position up
+static void StoHashRemove(storage_db_t *db, uint32_t pos) {
+  uint32_t j;
+
+  StoHashDelete(db, pos);
+  if (db->hashValid) {
+    for (j = 0; j < db->hashSize; j++) {
+      if (db->hash[j] > pos + 1) db->hash[j]--;
+    }
+  }
+}
+
+// the element at from has been moved to to, the elements in between shifted by one
+static void StoHashMove(storage_db_t *db, uint32_t from, uint32_t to) {
+  uint32_t j, pos;
+
+  if (db->hashValid && from != to) {
+    for (j = 0; j < db->hashSize; j++) {
+      if (db->hash[j] == 0) continue;
+      pos = db->hash[j] - 1;
+      if (pos == from) {
+        db->hash[j] = to + 1;
+      } else if (from < to && pos > from && pos <= to) {
+        db->hash[j]--;
+      } else if (from > to && pos >= to && pos < from) {
+        db->hash[j]++;
+      }
+    }
+  }
+}
+
+static int StoIdFind(storage_db_t *db, uint32_t uniqueID) {
+  uint32_t j, pos;
+
+  if (!db->hashValid && StoHashRebuild(db) == -1) {
+    for (pos = 0; pos < db->numRecs; pos++) {
+      if (StoHashPosKey(db, pos) == uniqueID) return pos;
+    }
+    return -1;
+  }
+
+  for (j = StoHashSlot(db, uniqueID); db->hash[j]; j = (j + 1) & (db->hashSize - 1)) {
+    pos = db->hash[j] - 1;
+    if (pos < db->numRecs && StoHashPosKey(db, pos) == uniqueID) return pos;
+  }
+
+  return -1;
+}
+
+// Position of a given handle, which unlike its uniqueID is never shared.
+static int StoHandleFind(storage_db_t *db, storage_handle_t *h) {
+  uint32_t j, pos;
+
+  if (!db->hashValid && StoHashRebuild(db) == -1) {
+    for (pos = 0; pos < db->numRecs; pos++) {
+      if (db->elements[pos] == h) return pos;
+    }
+    return -1;
+  }
+
+  for (j = StoHashSlot(db, StoHashKey(db, h)); db->hash[j]; j = (j + 1) & (db->hashSize - 1)) {
+    pos = db->hash[j] - 1;
+    if (pos < db->numRecs && db->elements[pos] == h) return pos;
+  }
+
+  return -1;
+}
+
+static int StoResFind(storage_db_t *db, uint32_t type, uint16_t id) {
+  storage_handle_t *h;
+  uint32_t j, pos;
+
+  if (!db->hashValid && StoHashRebuild(db) == -1) {
+    for (pos = 0; pos < db->numRecs; pos++) {
+      h = db->elements[pos];
+      if (h->d.res.type == type && h->d.res.id == id) return pos;
+    }
+    return -1;
+  }
+
+  for (j = StoHashSlot(db, StoResKey(type, id)); db->hash[j]; j = (j + 1) & (db->hashSize - 1)) {
+    pos = db->hash[j] - 1;
+    if (pos < db->numRecs) {
+      h = db->elements[pos];
+      if (h->d.res.type == type && h->d.res.id == id) return pos;
+    }
+  }
+
+  return -1;
+}
+
+// Finds a resource along the chain of open resource databases, most recently
+// opened first. Results, including misses, are remembered in a small direct
+// mapped cache that is discarded whenever stoResGen changes. The generation is
+// read before searching, so a change made meanwhile leaves the entry stale.
+static storage_handle_t *StoFindResource(storage_t *sto, DmResType type, DmResID resID, Boolean firstOnly, DmOpenType **dbRefP, UInt16 *indexP) {
+  storage_res_cache_t *c;
+  storage_handle_t *h;
+  storage_db_t *db;
+  DmOpenType *dbRef;
+  uint32_t gen;
+  int i = -1;
+
+  gen = StoResGen();
+  c = &sto->resCache[((type * 0x9E3779B1) ^ resID ^ (firstOnly ? 0x80 : 0)) & (STO_RES_CACHE - 1)];
+  if (c->gen == gen && c->type == type && c->id == resID && c->firstOnly == firstOnly) {
+    if (c->dbRef == NULL) return NULL;
+    db = (storage_db_t *)(sto->base + c->dbRef->dbID);
+    if (c->index < db->numRecs) {
+      h = db->elements[c->index];
+      if (h->d.res.type == type && h->d.res.id == resID) {
+        *dbRefP = c->dbRef;
+        *indexP = c->index;
+        return h;
+      }
+    }
+  }
+
+  for (dbRef = sto->dbRef; dbRef; dbRef = dbRef->next) {
+    if (dbRef->dbID >= (sto->size - sizeof(storage_db_t))) continue;
+    db = (storage_db_t *)(sto->base + dbRef->dbID);
+    if (db->ftype != STO_TYPE_RES) continue;
+    if ((i = StoResFind(db, type, resID)) != -1) break;
+    if (firstOnly) {
+      dbRef = NULL;
+      break;
+    }
+  }
+
+  c->gen = gen;
+  c->type = type;
+  c->id = resID;
+  c->firstOnly = firstOnly;
+  c->dbRef = dbRef;
+  c->index = i;
+
+  if (dbRef == NULL) return NULL;
+  *dbRefP = dbRef;
+  *indexP = i;
+
+  return db->elements[i];
+}
+
+static void StoHashFree(storage_db_t *db) {
+  if (db->hash) {
+    xfree(db->hash);
+    db->hash = NULL;
+  }
+  db->hashSize = 0;
+  db->hashValid = 0;
+}
+
+static void StoCategoryInvalidate(storage_db_t *db) {
+  if (db->categories) {
+    db->categories->view[0].valid = 0;
+    db->categories->view[1].valid = 0;
+  }
+}
+
+static void StoCategoryFree(storage_db_t *db) {
+  if (db->categories) {
+    if (db->categories->view[0].pos) xfree(db->categories->view[0].pos);
+    if (db->categories->view[1].pos) xfree(db->categories->view[1].pos);
+    xfree(db->categories);
+    db->categories = NULL;
+  }
+}
+
+static int StoCategoryRebuild(storage_db_t *db, storage_category_view_t *v, Boolean secret) {
+  uint32_t count[dmRecNumCategories], next[dmRecNumCategories];
+  storage_handle_t tmp;
+  uint16_t *pos, attr;
+  uint32_t i, c;
+
+  if (db->numRecs * 2 > v->capacity) {
+    if ((pos = xcalloc(db->numRecs * 2, sizeof(uint16_t))) == NULL) return -1;
+    if (v->pos) xfree(v->pos);
+    v->pos = pos;
+    v->capacity = db->numRecs * 2;
+  }
+
+  xmemset(count, 0, sizeof(count));
+  for (i = 0, v->numAll = 0; i < db->numRecs; i++) {
+    attr = StoPeek(db, i, &tmp)->d.rec.attr;
+    if ((attr & dmRecAttrDelete) || ((attr & dmRecAttrSecret) && !secret)) continue;
+    v->pos[v->numAll++] = i;
+    count[attr & dmRecAttrCategoryMask]++;
+  }
+
+  v->start[0] = v->numAll;
+  for (c = 0; c < dmRecNumCategories; c++) {
+    next[c] = v->start[c];
+    v->start[c + 1] = v->start[c] + count[c];
+  }
+  for (i = 0; i < v->numAll; i++) {
+    c = StoPeek(db, v->pos[i], &tmp)->d.rec.attr & dmRecAttrCategoryMask;
+    v->pos[next[c]++] = v->pos[i];
+  }
+  v->valid = 1;
+
+  return 0;
+}
+
+// Finds the ascending positions of the records a database reference can see in
+// a category (or in dmAllCategories), rebuilding the view if records changed.
+static int StoCategoryList(storage_db_t *db, DmOpenType *dbRef, UInt16 category, uint16_t **list, uint32_t *n) {
+  storage_category_view_t *v;
+  Boolean secret;
+
+  if (db->categories == NULL && (db->categories = xcalloc(1, sizeof(storage_category_t))) == NULL) {
+    return -1;
+  }
+
+  secret = (dbRef->mode & dmModeShowSecret) ? true : false;
+  v = &db->categories->view[secret ? 1 : 0];
+  if (!v->valid && StoCategoryRebuild(db, v, secret) == -1) {
+    return -1;
+  }
+
+  if (category == dmAllCategories) {
+    *list = v->pos;
+    *n = v->numAll;
+  } else if (category < dmRecNumCategories) {
+    *list = &v->pos[v->start[category]];
+    *n = v->start[category + 1] - v->start[category];
+  } else {
+    *list = NULL;
+    *n = 0;
+  }
+
+  return 0;
+}
+
+// number of positions in list[0..n-1] that are smaller than index
+static uint32_t StoCategoryRank(uint16_t *list, uint32_t n, uint32_t index) {
+  uint32_t lo = 0, hi = n, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (list[mid] < index) lo = mid + 1; else hi = mid;
+  }
+
+  return lo;
+}
+
+// sizes the handle array of a database being mapped, so it is not grown page by page
+static void StoReserveHandles(storage_db_t *db, uint32_t n) {
+  if (db->elements == NULL && n > 0) {
+    db->totalElements = (n + HANDLES_PER_PAGE - 1) & ~(HANDLES_PER_PAGE - 1);
+    if ((db->elements = xcalloc(db->totalElements, sizeof(storage_handle_t *))) == NULL) {
+      db->totalElements = 0;
+    }
+  }
+}
+
 static int StoAddDatabaseHandle(storage_t *sto, storage_db_t *db, storage_handle_t *h) {
   int r = -1;
 
@@ -1335,6 +2934,11 @@ static int StoAddDatabaseHandle(storage_t *sto, storage_db_t *db, storage_handle
 
   if (db->elements) {
     db->elements[db->numRecs++] = h;
+    StoHashAppend(db);
+    StoCategoryInvalidate(db);
+    if (db->ftype == STO_TYPE_RES) {
+      StoResChanged();
+    }
     r = 0;
   } else {
     db->totalElements = 0;
@@ -1371,6 +2975,7 @@ static storage_handle_t *StoAddRes(storage_t *sto, storage_db_t *db, uint32_t ty
     h->htype = STO_TYPE_RES;
     h->owner = 0;
     h->size = size;
+    h->d.res.storedSize = size;
     h->d.res.id = id;
     h->d.res.type = type;
     h->d.res.attr |= dmRecAttached;
@@ -1380,66 +2985,263 @@ static storage_handle_t *StoAddRes(storage_t *sto, storage_db_t *db, uint32_t ty
     }
   }
 
-  return h;
-}
+  return h;
+}
+
+static Int32 compare_handle(void *e1, void *e2, void *otherP) {
+  storage_db_t *db;
+  storage_handle_t *h1, *h2;
+  Int32 r = 0;
+
+  db = (storage_db_t *)otherP;
+  if (db->ftype == STO_TYPE_RES) {
+    h1 = *((storage_handle_t **)e1);
+    h2 = *((storage_handle_t **)e2);
+
+    if (h1->d.res.type < h2->d.res.type) {
+      r = -1;
+    } else if (h1->d.res.type > h2->d.res.type) {
+      r = 1;
+    } else {
+      r = (int32_t)h1->d.res.id - (int32_t)h2->d.res.id;
+    }
+  }
+
+  return r;
+}
+
+static void StoSortHandles(storage_db_t *db) {
+  if (db->elements && db->numRecs) {
+    SysQSortP(db->elements, db->numRecs, sizeof(storage_handle_t *), compare_handle, db);
+    StoHashInvalidate(db);
+  }
+}
+
+// Loads the binary record index with a single read and replays its journal.
+// Sizes come from the index, so element files are not touched. Records get no
+// handle here: the replayed entries are kept in db->lazy and each record gets
+// its handle from StoElement when it is first used. The uniqueID hash and the
+// category views are also built on first use, from the entries.
+static int StoReadIndex(storage_t *sto, storage_db_t *db) {
+  vfs_file_t *f;
+  vfs_ent_t *ent;
+  char buf[VFS_PATH];
+  uint8_t *p, *e;
+  uint32_t magic, version, esize, num, count, total, op, pos, to, i, j, k;
+  uint32_t uniqueID, size, max;
+  uint16_t keyOffset, keyMode;
+  int r = -1;
+
+  storage_db_name(sto, db, STO_FILE_RINDEX, 0, 0, 0, 0, buf);
+  if (StoVfsChecktype(sto->session, buf) != VFS_FILE) {
+    return -1;
+  }
+
+  if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) == NULL) {
+    return -1;
+  }
+
+  p = NULL;
+  e = NULL;
+  total = 0;
+  if ((ent = vfs_fstat(f)) != NULL) {
+    total = ent->size;
+  }
+
+  if (total >= STO_INDEX_HEADER1 && (p = xcalloc(1, total)) != NULL && vfs_read(f, p, total) == total) {
+    i = 0;
+    i += get4b(&magic, p, i);
+    i += get4b(&version, p, i);
+    i += get4b(&esize, p, i);
+    i += get4b(&num, p, i);
+
+    // version 1 has a shorter header and no sort key, its last column is unused
+    keyOffset = keyMode = 0;
+    if (version == STO_INDEX_VERSION && total >= STO_INDEX_HEADER) {
+      i += get2b(&keyOffset, p, i);
+      i += get2b(&keyMode, p, i);
+    }
 
-static Int32 compare_handle(void *e1, void *e2, void *otherP) {
-  storage_db_t *db;
-  storage_handle_t *h1, *h2;
-  Int32 r = 0;
+    if (magic == STO_INDEX_MAGIC && (version == 1 || version == STO_INDEX_VERSION) && esize == STO_INDEX_ENTRY && i + num * STO_INDEX_ENTRY <= total) {
+      db->keyOffset = keyOffset;
+      db->keyMode = keyMode;
+      // entries and journal are applied on a flat copy before the handles are created
+      db->indexJournal = (total - i - num * STO_INDEX_ENTRY) / STO_INDEX_JOURNAL;
+      db->indexEnd = i + num * STO_INDEX_ENTRY + db->indexJournal * STO_INDEX_JOURNAL;
+      if ((e = xcalloc(num + db->indexJournal + 1, STO_INDEX_ENTRY)) != NULL) {
+        xmemcpy(e, &p[i], num * STO_INDEX_ENTRY);
+        i += num * STO_INDEX_ENTRY;
+        count = num;
+
+        for (j = 0; j < db->indexJournal; j++, i += STO_INDEX_JOURNAL) {
+          get4b(&op, p, i);
+          pos = op & 0xFFFFFF;
+          op >>= 24;
+          // a move keeps its destination where the other entries have theirs
+          get4b(&to, p, i + 4);
+          if (op == STO_INDEX_INSERT && pos <= count) {
+            sys_memmove(&e[(pos + 1) * STO_INDEX_ENTRY], &e[pos * STO_INDEX_ENTRY], (count - pos) * STO_INDEX_ENTRY);
+            xmemcpy(&e[pos * STO_INDEX_ENTRY], &p[i + 4], STO_INDEX_ENTRY);
+            count++;
+          } else if (op == STO_INDEX_REMOVE && pos < count) {
+            sys_memmove(&e[pos * STO_INDEX_ENTRY], &e[(pos + 1) * STO_INDEX_ENTRY], (count - pos - 1) * STO_INDEX_ENTRY);
+            count--;
+          } else if (op == STO_INDEX_UPDATE && pos < count) {
+            xmemcpy(&e[pos * STO_INDEX_ENTRY], &p[i + 4], STO_INDEX_ENTRY);
+          } else if (op == STO_INDEX_MOVE && pos < count && to < count) {
+            xmemcpy(&e[count * STO_INDEX_ENTRY], &e[pos * STO_INDEX_ENTRY], STO_INDEX_ENTRY);
+            if (pos < to) {
+              sys_memmove(&e[pos * STO_INDEX_ENTRY], &e[(pos + 1) * STO_INDEX_ENTRY], (to - pos) * STO_INDEX_ENTRY);
+            } else {
+              sys_memmove(&e[(to + 1) * STO_INDEX_ENTRY], &e[to * STO_INDEX_ENTRY], (pos - to) * STO_INDEX_ENTRY);
+            }
+            xmemcpy(&e[to * STO_INDEX_ENTRY], &e[count * STO_INDEX_ENTRY], STO_INDEX_ENTRY);
+          } else {
+            debug(DEBUG_ERROR, "STOR", "StoReadIndex database \"%s\" invalid journal entry %u", db->name, j);
+            break;
+          }
+        }
 
-  db = (storage_db_t *)otherP;
-  if (db->ftype == STO_TYPE_RES) {
-    h1 = *((storage_handle_t **)e1);
-    h2 = *((storage_handle_t **)e2);
+        for (j = 0, k = 0, max = 0; j < count; j++) {
+          get4b(&uniqueID, e, j * STO_INDEX_ENTRY);
+          if (db->backend == STO_BACKEND_CONTAINER) {
+            if (container_size(db->container, uniqueID, 0, &size) != 0) {
+              debug(DEBUG_ERROR, "STOR", "StoReadIndex database \"%s\" record 0x%08X not found", db->name, uniqueID);
+              continue;
+            }
+            put4b(size, e, j * STO_INDEX_ENTRY + 8);
+          }
+          if (uniqueID > max) max = uniqueID;
+          if (k < j) xmemcpy(&e[k * STO_INDEX_ENTRY], &e[j * STO_INDEX_ENTRY], STO_INDEX_ENTRY);
+          k++;
+        }
 
-    if (h1->d.res.type < h2->d.res.type) {
-      r = -1;
-    } else if (h1->d.res.type > h2->d.res.type) {
-      r = 1;
+        StoReserveHandles(db, k);
+        if (db->elements || k == 0) {
+          for (j = 0; j < k; j++) {
+            db->elements[j] = STO_LAZY_SLOT(j * STO_INDEX_ENTRY);
+          }
+          db->numRecs = k;
+          db->lazy = e;
+          e = NULL;
+          if (db->uniqueIDSeed < max) {
+            db->uniqueIDSeed = max;
+          }
+          r = 0;
+        }
+      }
     } else {
-      r = (int32_t)h1->d.res.id - (int32_t)h2->d.res.id;
+      debug(DEBUG_ERROR, "STOR", "StoReadIndex database \"%s\" invalid index", db->name);
     }
   }
+  vfs_close(f);
+
+  if (e) xfree(e);
+  if (p) xfree(p);
 
   return r;
 }
 
-static void StoSortHandles(storage_db_t *db) {
-  if (db->elements && db->numRecs) {
-    SysQSortP(db->elements, db->numRecs, sizeof(storage_handle_t *), compare_handle, db);
+static int StoCompareRecordFile(const void *e1, const void *e2) {
+  const storage_record_file_t *f1 = (const storage_record_file_t *)e1;
+  const storage_record_file_t *f2 = (const storage_record_file_t *)e2;
+
+  if (f1->uniqueID != f2->uniqueID) return f1->uniqueID < f2->uniqueID ? -1 : 1;
+  if (f1->attr != f2->attr) return f1->attr < f2->attr ? -1 : 1;
+
+  return 0;
+}
+
+// Lists the record files of a database with a single directory scan, sorted by
+// (uniqueID, attr), so that sizes can be found without opening every file.
+static storage_record_file_t *StoScanRecordFiles(storage_t *sto, storage_db_t *db, uint32_t *n) {
+  storage_record_file_t *files = NULL, *aux;
+  vfs_dir_t *dir;
+  vfs_ent_t *ent;
+  char buf[VFS_PATH];
+  uint32_t uniqueID, attr, total = 0;
+
+  *n = 0;
+  storage_db_name(sto, db, 0, 0, 0, 0, 0, buf);
+  if ((dir = StoVfsOpendir(sto->session, buf)) != NULL) {
+    for (;;) {
+      ent = StoVfsReaddir(dir);
+      if (ent == NULL) break;
+      if (ent->type != VFS_FILE || sys_strlen(ent->name) != 11 || ent->name[8] != '.') continue;
+      if (sys_sscanf(ent->name, "%08X.%02X", &uniqueID, &attr) != 2) continue;
+      if (*n == total) {
+        if ((aux = xrealloc(files, (total + HANDLES_PER_PAGE) * sizeof(storage_record_file_t))) == NULL) break;
+        files = aux;
+        total += HANDLES_PER_PAGE;
+      }
+      files[*n].uniqueID = uniqueID;
+      files[*n].attr = attr;
+      files[*n].size = ent->size;
+      (*n)++;
+    }
+    vfs_closedir(dir);
+    if (files) {
+      sys_qsort(files, *n, sizeof(storage_record_file_t), StoCompareRecordFile);
+    }
   }
+
+  return files;
 }
 
 static int StoMapRecords(storage_t *sto, storage_db_t *db) {
-  vfs_file_t *f, *f2;
+  storage_record_file_t *files, *file, key;
+  vfs_file_t *f;
   vfs_ent_t *ent;
   char buf[VFS_PATH];
-  uint8_t rec[16];
-  uint32_t attr, uniqueID, max;
+  uint8_t *p;
+  uint32_t attr, uniqueID, size, max, total, nfiles, i;
   int r = -1;
 
-  if (db->elements == NULL) {
-    storage_name(sto, db->name, STO_FILE_INDEX, 0, 0, 0, 0, buf);
+  if (db->elements == NULL && StoReadIndex(sto, db) == 0) {
+    r = 0;
+  } else if (db->elements == NULL) {
+    // databases created before the binary index keep a text index until they are written;
+    // the index is read at once and record sizes come from one scan of the directory
+    storage_db_name(sto, db, STO_FILE_INDEX, 0, 0, 0, 0, buf);
     if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-      for (max = 0; !thread_must_end();) {
-        xmemset(rec, 0, sizeof(rec));
-        if (vfs_read(f, rec, 12) != 12) break;
-        if (sys_sscanf((char *)rec, "%08X.%02X\n", &uniqueID, &attr) == 2) {
-          if (uniqueID > max) max = uniqueID;
-          storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, attr & ATTR_MASK, uniqueID, buf);
-          if ((f2 = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-            if ((ent = vfs_fstat(f2)) != NULL) {
-              StoAddRec(sto, db, uniqueID, attr, ent->size);
+      total = (ent = vfs_fstat(f)) != NULL ? ent->size : 0;
+      files = NULL;
+      nfiles = 0;
+      if (db->backend != STO_BACKEND_CONTAINER) {
+        files = StoScanRecordFiles(sto, db, &nfiles);
+      }
+      if ((p = xcalloc(1, total + 1)) != NULL) {
+        if (vfs_read(f, p, total) == total) {
+          StoReserveHandles(db, total / 12);
+          for (i = 0, max = 0; i + 12 <= total && !thread_must_end(); i += 12) {
+            if (sys_sscanf((char *)&p[i], "%08X.%02X\n", &uniqueID, &attr) == 2) {
+              if (uniqueID > max) max = uniqueID;
+              if (db->backend == STO_BACKEND_CONTAINER) {
+                if (container_size(db->container, uniqueID, 0, &size) == 0) {
+                  StoAddRec(sto, db, uniqueID, attr, size);
+                }
+              } else if (files) {
+                key.uniqueID = uniqueID;
+                key.attr = attr & ATTR_MASK;
+                if ((file = sys_bsearch(&key, files, nfiles, sizeof(storage_record_file_t), StoCompareRecordFile)) != NULL) {
+                  StoAddRec(sto, db, uniqueID, attr, file->size);
+                }
+              }
             }
-            vfs_close(f2);
           }
+          if (db->uniqueIDSeed < max) {
+            db->uniqueIDSeed = max;
+          }
+          db->indexLegacy = 1;
+          if (db->mode & dmModeWrite) {
+            // convert now, so that later opens only read the binary index
+            StoWriteIndex(sto, db);
+          }
+          r = 0;
         }
+        xfree(p);
       }
-      if (db->uniqueIDSeed < max) {
-        db->uniqueIDSeed = max;
-      }
-      r = 0;
+      if (files) xfree(files);
       vfs_close(f);
     }
   } else {
@@ -1454,11 +3256,27 @@ static int StoMapResources(storage_t *sto, storage_db_t *db) {
   vfs_ent_t *ent;
   char buf[VFS_PATH];
   char st[8];
-  uint32_t type, id;
-  int n, r = -1;
+  uint32_t type, id, size, i, n;
+  int r = -1;
 
-  if (db->elements == NULL) {
-    storage_name(sto, db->name, 0, 0, 0, 0, 0, buf);
+  if (db->elements == NULL && db->backend == STO_BACKEND_IMAGE) {
+    n = prcimage_num(db->image);
+    for (i = 0; i < n; i++) {
+      if (prcimage_get(db->image, i, &type, &id, &size) == 0) {
+        StoAddRes(sto, db, type, id, size);
+      }
+    }
+    StoSortHandles(db);
+  } else if (db->elements == NULL && db->backend == STO_BACKEND_CONTAINER) {
+    n = container_num(db->container);
+    for (i = 0; i < n; i++) {
+      if (container_get(db->container, i, &type, &id, &size) == 0) {
+        StoAddRes(sto, db, type, id, size);
+      }
+    }
+    StoSortHandles(db);
+  } else if (db->elements == NULL) {
+    storage_db_name(sto, db, 0, 0, 0, 0, 0, buf);
     if ((dir = StoVfsOpendir(sto->session, buf)) != NULL) {
       for (;;) {
         ent = StoVfsReaddir(dir);
@@ -1466,7 +3284,7 @@ static int StoMapResources(storage_t *sto, storage_db_t *db) {
         if (ent->type != VFS_FILE) continue;
         if (!sys_strcmp(ent->name, ".") || !sys_strcmp(ent->name, "..")) continue;
         st[4] = 0;
-        if ((n = sys_sscanf(ent->name, "%c%c%c%c.%08X.%d", st, st+1, st+2, st+3, &type, &id)) == 6) {
+        if (sys_sscanf(ent->name, "%c%c%c%c.%08X.%d", st, st+1, st+2, st+3, &type, &id) == 6) {
           StoAddRes(sto, db, type, id, ent->size);
         }
       }
@@ -1488,7 +3306,7 @@ static int StoMapFile(storage_t *sto, storage_db_t *db) {
   if (db->mode & dmModeReadOnly) mode |= VFS_READ;
   if (db->mode & dmModeWrite)    mode |= VFS_WRITE;
 
-  storage_name(sto, db->name, STO_FILE_DATA, 0, 0, 0, 0, buf);
+  storage_db_name(sto, db, STO_FILE_DATA, 0, 0, 0, 0, buf);
   if ((db->f = StoVfsOpen(sto->session, buf, mode)) != NULL) {
     r = 0;
   }
@@ -1499,6 +3317,10 @@ static int StoMapFile(storage_t *sto, storage_db_t *db) {
 static int StoMapContents(storage_t *sto, storage_db_t *db) {
   int r = -1;
 
+  if (StoOpenElements(sto, db) == -1) {
+    return -1;
+  }
+
   switch (db->ftype) {
     case STO_TYPE_REC:
       r = StoMapRecords(sto, db);
@@ -1528,7 +3350,7 @@ DmOpenRef DmOpenDatabase(UInt16 cardNo, LocalID dbID, UInt16 mode) {
   DmOpenType *first, *dbRef = NULL;
   Err err = dmErrInvalidParam;
 
-  if (mutex_lock(sto->mutex) == 0) {
+  if (StoLockStorage(sto) == 0) {
     if (dbID < (sto->size - sizeof(storage_db_t))) {
       db = (storage_db_t *) (sto->base + dbID);
       if ((dbRef = pumpkin_heap_alloc(sizeof(DmOpenType), "dbRef")) != NULL) {
@@ -1544,6 +3366,13 @@ DmOpenRef DmOpenDatabase(UInt16 cardNo, LocalID dbID, UInt16 mode) {
           ok = false;
         }
         if (ok) {
+          if (db->lock == NULL) {
+            db->lock = dblock_get(stoLocks, db->name);
+          }
+          if (db->stats == NULL) {
+            db->stats = dbstats_get(stoStats, db->name);
+          }
+          dbstats_count(stoStats, db->stats, DBSTATS_OPEN, 0);
           db->mode = mode;
           dbRef->dbID = dbID;
           dbRef->mode = mode;
@@ -1567,6 +3396,7 @@ DmOpenRef DmOpenDatabase(UInt16 cardNo, LocalID dbID, UInt16 mode) {
       dbRef->next = first;
     }
     sto->dbRef = dbRef;
+    StoResChanged();
   }
 
   StoCheckErr(err);
@@ -1578,15 +3408,23 @@ Err DmCloseDatabase(DmOpenRef dbP) {
   storage_db_t *db;
   storage_handle_t *h;
   DmOpenType *dbRef;
-  vfs_file_t *f;
+  dblock_t *lock, *put;
   UInt32 i, size;
   void *encoded;
-  char st[8], buf[VFS_PATH];
+  char st[8];
   Err err = dmErrInvalidParam;
 
   if (dbP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
+    dbRef = (DmOpenType *)dbP;
+    lock = put = NULL;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      // the database lock is always taken before sto->mutex, so the last close
+      // waits for other threads using the database without blocking the storage
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if ((lock = db->lock) != NULL) dblock_lock(lock, true, 1);
+    }
+
+    if (StoLockStorage(sto) == 0) {
       if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
         if (dbRef->dbID == sto->watchID) {
           debug(DEBUG_INFO, "STOR", "WATCH DmCloseDatabase(%p)", dbRef);
@@ -1603,19 +3441,18 @@ Err DmCloseDatabase(DmOpenRef dbP) {
         }
 
         if (err == errNone && db->readCount == 0 && db->writeCount == 0) {
+          StoBeginWrite(sto);
           switch (db->ftype) {
             case STO_TYPE_REC:
               debug(DEBUG_TRACE, "STOR", "DmCloseDatabase \"%s\" flush %d records", db->name, db->numRecs);
+              StoFlushRecords(sto, db, true, true, NULL);
               if (dbRef->mode & dmModeWrite) {
                 for (i = 0; i < db->numRecs; i++) {
                   h = db->elements[i];
+                  if (STO_LAZY(h)) continue;
                   if ((h->htype & STO_INFLATED) && h->d.rec.attr & dmRecAttrDirty) {
                     debug(DEBUG_TRACE, "STOR", "DmCloseDatabase writing dirty record %d", i);
-                    storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
-                    if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-                      vfs_write(f, h->buf, h->size);
-                      vfs_close(f);
-                    }
+                    StoWriteElement(sto, db, h, h->buf, h->size);
                     h->d.rec.attr &= ~dmRecAttrDirty;
                   }
                 }
@@ -1636,15 +3473,11 @@ Err DmCloseDatabase(DmOpenRef dbP) {
                         encoded = h->d.res.encoder(h->d.res.decoded, &size);
                       }
                       debug(DEBUG_TRACE, "STOR", "DmCloseDatabase writing dirty resource %s %d", st, h->d.res.id);
-                      storage_name(sto, db->name, STO_FILE_ELEMENT, h->d.res.id, h->d.res.type, 0, 0, buf);
-                      if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-                        if (encoded) {
-                          vfs_write(f, encoded, size);
-                          xfree(encoded);
-                        } else {
-                          vfs_write(f, h->buf, h->size);
-                        }
-                        vfs_close(f);
+                      if (encoded) {
+                        StoWriteElement(sto, db, h, encoded, size);
+                        xfree(encoded);
+                      } else {
+                        StoWriteElement(sto, db, h, h->buf, h->size);
                       }
                       h->d.res.attr &= ~dmRecAttrDirty;
                     } else {
@@ -1679,8 +3512,10 @@ Err DmCloseDatabase(DmOpenRef dbP) {
             StoWriteAppInfo(sto, db);
             StoWriteSortInfo(sto, db);
           }
+          StoCloseElements(sto, db);
           db->mode = 0;
           StoWriteHeader(sto, db);
+          StoEndWrite(sto);
 
 
           if (db->elements) {
@@ -1689,6 +3524,16 @@ Err DmCloseDatabase(DmOpenRef dbP) {
             db->totalElements = 0;
             db->numRecs = 0;
           }
+          if (db->lazy) {
+            xfree(db->lazy);
+            db->lazy = NULL;
+          }
+          db->cacheHead = db->cacheTail = NULL;
+          db->cacheSize = 0;
+          StoHashFree(db);
+          StoCategoryFree(db);
+          put = db->lock;
+          db->lock = NULL;
         }
 
         if (dbRef->prev) {
@@ -1699,9 +3544,81 @@ Err DmCloseDatabase(DmOpenRef dbP) {
           sto->dbRef = dbRef->next;
         }
         pumpkin_heap_free(dbRef, "dbRef");
+        StoResChanged();
       }
       mutex_unlock(sto->mutex);
     }
+
+    if (lock) dblock_unlock(lock);
+    if (put) dblock_put(put);
+  }
+
+  StoCheckErr(err);
+  return err;
+}
+
+// Write all dirty records of an open database to storage.
+Err DmSyncDatabase(DmOpenRef dbP) {
+  storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
+  storage_db_t *db;
+  DmOpenType *dbRef;
+  Err err = dmErrInvalidParam;
+
+  if (dbP) {
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
+        StoFlushRecords(sto, db, false, false, NULL);
+        err = errNone;
+        StoUnlockDatabase(sto, db);
+      }
+    }
+  }
+
+  StoCheckErr(err);
+  return err;
+}
+
+// Declares the sort key of a record database (see StoSortKey). The key of
+// every record is read once and the index is written again with it.
+Err DmSetSortKey(DmOpenRef dbP, UInt16 offset, UInt16 mode) {
+  storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
+  storage_db_t *db;
+  storage_handle_t *h;
+  DmOpenType *dbRef;
+  uint8_t *p;
+  uint32_t i, n;
+  Err err = dmErrInvalidParam;
+
+  if (dbP && mode <= dmSortKeyString) {
+    dbRef = (DmOpenType *)dbP;
+    if ((dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (db->ftype == STO_TYPE_REC && StoLockDatabase(sto, db, true) == 0) {
+        if ((p = xcalloc(1, offset + STO_SORT_KEY)) != NULL) {
+          db->keyOffset = mode ? offset : 0;
+          db->keyMode = mode;
+          for (i = 0; i < db->numRecs; i++) {
+            if ((h = StoElement(db, i)) == NULL) continue;
+            if (h->buf) {
+              h->d.rec.key = StoSortKey(db, h->buf, h->size);
+            } else {
+              n = h->size < offset + STO_SORT_KEY ? h->size : offset + STO_SORT_KEY;
+              h->d.rec.key = (n > offset && StoReadElement(sto, db, h, p, n) == n) ? StoSortKey(db, p, n) : 0;
+            }
+          }
+          xfree(p);
+          StoBeginWrite(sto);
+          if (StoWriteIndex(sto, db) == 0) err = errNone;
+          StoEndWrite(sto);
+          debug(DEBUG_INFO, "STOR", "DmSetSortKey database \"%s\" offset %u mode %u", db->name, offset, mode);
+        } else {
+          err = dmErrMemError;
+        }
+        StoUnlockDatabase(sto, db);
+      }
+    }
   }
 
   StoCheckErr(err);
@@ -1718,7 +3635,7 @@ Err DmDeleteDatabase(UInt16 cardNo, LocalID dbID) {
   char buf[VFS_PATH], buf2[VFS_PATH];
   Err err = dmErrInvalidParam;
 
-  if (mutex_lock(sto->mutex) == 0) {
+  if (StoLockStorage(sto) == 0) {
     if (dbID < (sto->size - sizeof(storage_db_t))) {
       if (dbID == sto->watchID) {
         debug(DEBUG_INFO, "STOR", "WATCH DmDeleteDatabase(0x%08X)", dbID);
@@ -1733,7 +3650,8 @@ Err DmDeleteDatabase(UInt16 cardNo, LocalID dbID) {
         } else {
           debug(DEBUG_INFO, "STOR", "DmDeleteDatabase database \"%s\"", db->name);
 
-          storage_name(sto, db->name, 0, 0, 0, 0, 0, buf);
+          StoBeginWrite(sto);
+          storage_db_name(sto, db, 0, 0, 0, 0, 0, buf);
           if ((dir = StoVfsOpendir(sto->session, buf)) != NULL) {
             for (;;) {
               ent = StoVfsReaddir(dir);
@@ -1743,13 +3661,15 @@ Err DmDeleteDatabase(UInt16 cardNo, LocalID dbID) {
               sys_strncpy(buf2, buf, VFS_PATH-1);
               sys_strncat(buf2, "/", VFS_PATH-sys_strlen(buf2)-1);
               sys_strncat(buf2, ent->name, VFS_PATH-sys_strlen(buf2)-1);
-              StoVfsUnlink(sto->session, buf2);
+              StoUnlinkFile(sto, buf2);
             }
             vfs_closedir(dir);
           }
 
-          storage_name(sto, db->name, 0, 0, 0, 0, 0, buf);
-          StoVfsUnlink(sto->session, buf);
+          storage_db_name(sto, db, 0, 0, 0, 0, 0, buf);
+          StoUnlinkFile(sto, buf);
+          StoEndWrite(sto);
+          rescache_invalidate(stoCache, db->name);
 
           MemSet(&dbDeleted, sizeof(dbDeleted), 0);
           dbDeleted.oldDBID = dbID;
@@ -1758,27 +3678,7 @@ Err DmDeleteDatabase(UInt16 cardNo, LocalID dbID) {
           dbDeleted.attributes = db->attributes;
           StrNCopy(dbDeleted.dbName, db->name, dmDBNameLength-1);
 
-          db->ftype = 0;
-          db->readCount = 0;
-          db->writeCount = 0;
-          db->mode = 0;
-          db->numRecs = 0;
-          db->protect = 0;
-          db->creator = 0;
-          db->type = 0;
-          db->crDate = 0;
-          db->modDate = 0;
-          db->bckDate = 0;
-          db->modNum = 0;
-          db->attributes = 0;
-          db->uniqueIDSeed = ((UInt32)SysRandom32(0)) & 0xFFFFFF;
-          db->version = 0;
-          db->appInfoID = 0;
-          db->sortInfoID = 0;
-          db->f = NULL;
-          xmemset(db->name, 0, dmDBNameLength);
-
-          sto->num_storage--;
+          StoClearDatabase(sto, db);
           err = errNone;
         }
       }
@@ -1859,7 +3759,7 @@ UInt16 DmNumRecords(DmOpenRef dbP) {
 Err DmRecordInfo(DmOpenRef dbP, UInt16 index, UInt16 *attrP, UInt32 *uniqueIDP, LocalID *chunkIDP) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  storage_handle_t *h;
+  storage_handle_t *h, tmp;
   DmOpenType *dbRef;
   Err err = dmErrInvalidParam;
 
@@ -1871,7 +3771,7 @@ Err DmRecordInfo(DmOpenRef dbP, UInt16 index, UInt16 *attrP, UInt32 *uniqueIDP,
       if (uniqueIDP) *uniqueIDP = 0;
       if (chunkIDP) *chunkIDP = 0;
       if (db->ftype == STO_TYPE_REC && index < db->numRecs) {
-        h = db->elements[index];
+        h = StoPeek(db, index, &tmp);
         if (attrP) *attrP = h->d.rec.attr;
         if (uniqueIDP) *uniqueIDP = h->d.rec.uniqueID;
         if (chunkIDP) {
@@ -1896,31 +3796,35 @@ Err DmSetRecordInfo(DmOpenRef dbP, UInt16 index, UInt16 *attrP, UInt32 *uniqueID
   storage_db_t *db;
   storage_handle_t *h;
   DmOpenType *dbRef;
-  char oldName[VFS_PATH], newName[VFS_PATH];
+  UInt32 oldUniqueID;
+  UInt16 oldAttr;
   Err err = dmErrInvalidParam;
 
   if (dbP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
-        if (db->ftype == STO_TYPE_REC && index < db->numRecs) {
-          h = db->elements[index];
-          storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, oldName);
-          if (attrP) h->d.rec.attr = *attrP;
-          if (uniqueIDP) h->d.rec.uniqueID = *uniqueIDP;
-          storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, newName);
-          if (sys_strcmp(oldName, newName)) {
-            if (StoVfsRename(sto->session, oldName, newName) == 0) {
-              err = errNone;
-            }
-          } else {
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
+        if (db->ftype == STO_TYPE_REC && index < db->numRecs && (h = StoElement(db, index)) != NULL) {
+          oldUniqueID = h->d.rec.uniqueID;
+          oldAttr = h->d.rec.attr;
+          if (attrP) {
+            h->d.rec.attr = *attrP;
+            StoCategoryInvalidate(db);
+          }
+          if (uniqueIDP && h->d.rec.uniqueID != *uniqueIDP) {
+            StoHashDelete(db, index);
+            h->d.rec.uniqueID = *uniqueIDP;
+            if (db->hashValid) StoHashInsert(db, index);
+          }
+          if (StoRenameElement(sto, db, h, oldUniqueID, oldAttr) == 0) {
             err = errNone;
           }
+          StoJournalIndex(sto, db, STO_INDEX_UPDATE, index);
           db->modDate = TimGetSeconds();
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -1987,72 +3891,48 @@ static MemHandle DmGetResourceEx(DmResType type, DmResID resID, Boolean firstOnl
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
   DmOpenType *dbRef;
-  vfs_file_t *f;
-  char buf[VFS_PATH], st[8];
-  uint32_t i, found, load;
+  char st[8];
+  UInt16 index;
+  Boolean cached = false;
   storage_handle_t *h = NULL;
   Err err = dmErrResourceNotFound;
 
-  if (mutex_lock(sto->mutex) == 0) {
-    pumpkin_id2s(type, st);
-    debug(DEBUG_TRACE, "STOR", "DmGetResourceEx searching resource %s %d first %d", st, resID, firstOnly);
-    for (dbRef = sto->dbRef, found = 0; dbRef && !found; dbRef = dbRef->next) {
-      if (dbRef->dbID >= (sto->size - sizeof(storage_db_t))) continue;
-      db = (storage_db_t *)(sto->base + dbRef->dbID);
-      if (db->ftype != STO_TYPE_RES) continue;
-
-      debug(DEBUG_TRACE, "STOR", "DmGetResourceEx checking database \"%s\" (%d resources)", db->name, db->numRecs);
-      for (i = 0; i < db->numRecs; i++) {
-        h = db->elements[i];
-        pumpkin_id2s(h->d.res.type, st);
-        debug(DEBUG_TRACE, "STOR", "DmGetResourceEx resource %d: %s %d", i, st, h->d.res.id);
-        if (h->d.res.type == type && h->d.res.id == resID) {
-          debug(DEBUG_TRACE, "STOR", "DmGetResourceEx found resource %s %d inflated %d on \"%s\"", st, resID, (h->htype & STO_INFLATED) ? 1 : 0, db->name);
-          found = 1;
-          load = 0;
-
-          if (!(h->htype & STO_INFLATED)) {
-            if ((h->buf = StoPtrNew(h, h->size, h->d.res.type, resID)) != NULL) {
-              h->htype |= STO_INFLATED;
-              h->useCount = 1;
-              h->lockCount = 0;
-              load = 1;
-            }
-          } else {
-            load = 1;
-            h->useCount++;
-          }
-
-          if (h->buf) {
-            if (load) {
-              debug(DEBUG_TRACE, "STOR", "reading %5d bytes from resource %s %d at %p", h->size, st, h->d.res.id, h->buf);
-              storage_name(sto, db->name, STO_FILE_ELEMENT, resID, type, 0, 0, buf);
-              if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-                if (vfs_read(f, h->buf, h->size) > 0) {
-                  err = errNone;
-                }
-                vfs_close(f);
-              }
-            } else {
-              err = errNone;
-            }
-            if (err == errNone) {
-              StoDecodeResource(h);
-            }
-          }
-          break;
+  pumpkin_id2s(type, st);
+  debug(DEBUG_TRACE, "STOR", "DmGetResourceEx searching resource %s %d first %d", st, resID, firstOnly);
+  if ((h = StoFindResource(sto, type, resID, firstOnly, &dbRef, &index)) != NULL) {
+    db = (storage_db_t *)(sto->base + dbRef->dbID);
+    if (StoLockDatabase(sto, db, false) == 0) {
+      debug(DEBUG_TRACE, "STOR", "DmGetResourceEx found resource %s %d inflated %d on \"%s\"", st, resID, (h->htype & STO_INFLATED) ? 1 : 0, db->name);
+      if (!(h->htype & STO_INFLATED)) {
+        h->buf = NULL;
+        if (StoReadResource(sto, db, h, &cached) > 0) {
+          h->htype |= STO_INFLATED;
+          h->useCount = 1;
+          h->lockCount = 0;
+          err = errNone;
+        } else if (h->buf) {
+          StoPtrFree(h->buf);
+          h->buf = NULL;
+        }
+      } else {
+        h->useCount++;
+        if (StoReadResource(sto, db, h, &cached) > 0) {
+          err = errNone;
         }
       }
-      if (firstOnly) break;
-    }
 
-    if (!found) {
-      pumpkin_id2s(type, st);
-      debug(DEBUG_INFO, "STOR", "DmGetResourceEx resource %s %d not found", st, resID);
-      err = errNone;
-      h = NULL;
+      if (err == errNone) {
+        debug(DEBUG_TRACE, "STOR", "read %5d bytes from resource %s %d at %p", h->size, st, h->d.res.id, h->buf);
+        StoDecodeResource(db, h);
+        if (!cached) {
+          StoCacheResource(db, h);
+        }
+      }
+      StoUnlockDatabase(sto, db);
     }
-    mutex_unlock(sto->mutex);
+  } else {
+    debug(DEBUG_INFO, "STOR", "DmGetResourceEx resource %s %d not found", st, resID);
+    err = errNone;
   }
 
   StoCheckErr(err);
@@ -2073,15 +3953,14 @@ UInt16 DmSearchResource(DmResType resType, DmResID resID, MemHandle resH, DmOpen
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
   DmOpenType *dbRef;
-  vfs_file_t *f;
   UInt16 index = 0xffff;
-  Boolean found;
-  char buf[VFS_PATH], st[8];
+  Boolean found, cached = false;
+  char st[8];
   uint32_t i;
   storage_handle_t *h = NULL;
   Err err = dmErrResourceNotFound;
 
-  if (dbPP && mutex_lock(sto->mutex) == 0) {
+  if (dbPP && StoLockStorage(sto) == 0) {
     if (resH) {
       debug(DEBUG_TRACE, "STOR", "searching resource handle %p", resH);
     } else {
@@ -2089,49 +3968,58 @@ UInt16 DmSearchResource(DmResType resType, DmResID resID, MemHandle resH, DmOpen
       debug(DEBUG_TRACE, "STOR", "searching resource %s %d", st, resID);
     }
 
-    for (dbRef = sto->dbRef, found = false; dbRef && !found; dbRef = dbRef->next) {
-      if (dbRef->dbID >= (sto->size - sizeof(storage_db_t))) continue;
-      db = (storage_db_t *)(sto->base + dbRef->dbID);
-      if (db->ftype != STO_TYPE_RES) continue;
-
-      debug(DEBUG_TRACE, "STOR", "checking database \"%s\" (%d resources)", db->name, db->numRecs);
-      for (i = 0; i < db->numRecs; i++) {
-        h = db->elements[i];
-        found = resH ? (h == resH) : (h->d.res.type == resType && h->d.res.id == resID);
-        if (found) {
-          debug(DEBUG_TRACE, "STOR", "found resource at index %d", i);
-          index = i;
-          *dbPP = dbRef;
+    if (resH) {
+      for (dbRef = sto->dbRef, found = false; dbRef && !found; dbRef = dbRef->next) {
+        if (dbRef->dbID >= (sto->size - sizeof(storage_db_t))) continue;
+        db = (storage_db_t *)(sto->base + dbRef->dbID);
+        if (db->ftype != STO_TYPE_RES) continue;
 
-          if (!(h->htype & STO_INFLATED)) {
-            if ((h->buf = StoPtrNew(h, h->size, resType, resID)) != NULL) {
-              h->htype |= STO_INFLATED;
-              h->useCount = 1;
-              debug(DEBUG_TRACE, "STOR", "reading resource %s %d at %p", st, resID, h->buf);
-              storage_name(sto, db->name, STO_FILE_ELEMENT, h->d.res.id, h->d.res.type, 0, 0, buf);
-              if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-                if (vfs_read(f, h->buf, h->size) > 0) {
-                  h->lockCount = 0;
-                  err = errNone;
-                } else {
-                  h = NULL;
-                }
-                vfs_close(f);
-              } else {
-                h = NULL;
-              }
-            } else {
-              h = NULL;
-            }
-          } else {
-            h->useCount++;
-            err = errNone;
+        debug(DEBUG_TRACE, "STOR", "checking database \"%s\" (%d resources)", db->name, db->numRecs);
+        for (i = 0; i < db->numRecs; i++) {
+          if (db->elements[i] == resH) {
+            found = true;
+            break;
           }
+        }
+        if (found) break;
+      }
+    } else {
+      found = (StoFindResource(sto, resType, resID, false, &dbRef, &index) != NULL);
+      if (found) i = index;
+    }
 
-          if (err == errNone) {
-            StoDecodeResource(h);
+    if (found) {
+      debug(DEBUG_TRACE, "STOR", "found resource at index %d", i);
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      h = db->elements[i];
+      index = i;
+      *dbPP = dbRef;
+
+      if (!(h->htype & STO_INFLATED)) {
+        h->buf = NULL;
+        debug(DEBUG_TRACE, "STOR", "reading resource %s %d", st, resID);
+        if (StoReadResource(sto, db, h, &cached) > 0) {
+          h->htype |= STO_INFLATED;
+          h->useCount = 1;
+          h->lockCount = 0;
+          err = errNone;
+        } else {
+          if (h->buf) {
+            StoPtrFree(h->buf);
+            h->buf = NULL;
           }
-          break;
+          h = NULL;
+        }
+      } else {
+        h->useCount++;
+        cached = true;
+        err = errNone;
+      }
+
+      if (err == errNone) {
+        StoDecodeResource(db, h);
+        if (!cached) {
+          StoCacheResource(db, h);
         }
       }
     }
@@ -2156,15 +4044,13 @@ UInt16 DmSearchRecord(MemHandle recH, DmOpenRef *dbPP) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
   DmOpenType *dbRef;
-  vfs_file_t *f;
   UInt16 index = 0xffff;
   Boolean found;
-  char buf[VFS_PATH];
   uint32_t i;
   storage_handle_t *h = NULL;
   Err err = dmErrResourceNotFound;
 
-  if (recH && dbPP && mutex_lock(sto->mutex) == 0) {
+  if (recH && dbPP && StoLockStorage(sto) == 0) {
     debug(DEBUG_TRACE, "STOR", "searching record handle %p", recH);
 
     for (dbRef = sto->dbRef, found = false; dbRef && !found; dbRef = dbRef->next) {
@@ -2184,19 +4070,14 @@ UInt16 DmSearchRecord(MemHandle recH, DmOpenRef *dbPP) {
           if (!(h->htype & STO_INFLATED)) {
             if ((h->buf = StoPtrNew(h, h->size, 0, 0)) != NULL) {
               h->htype |= STO_INFLATED;
-              h->useCount = 1;
-              debug(DEBUG_TRACE, "STOR", "reading record %d at %p", i, h->buf);
-              storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
-              if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-                if (vfs_read(f, h->buf, h->size) == h->size) {
-                  h->d.rec.attr &= ~dmRecAttrDirty;
-                  h->d.rec.attr |= dmRecAttrBusy;
-                  h->lockCount = 0;
-                  err = errNone;
-                } else {
-                  h = NULL;
-                }
-                vfs_close(f);
+              h->useCount = 1;
+              debug(DEBUG_TRACE, "STOR", "reading record %d at %p", i, h->buf);
+              if (StoReadElement(sto, db, h, h->buf, h->size) == h->size) {
+                dbstats_count(stoStats, db->stats, DBSTATS_INFLATE, h->size);
+                h->d.rec.attr &= ~dmRecAttrDirty;
+                h->d.rec.attr |= dmRecAttrBusy;
+                h->lockCount = 0;
+                err = errNone;
               } else {
                 h = NULL;
               }
@@ -2224,15 +4105,14 @@ MemHandle DmGetResourceIndex(DmOpenRef dbP, UInt16 index) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
   DmOpenType *dbRef;
-  vfs_file_t *f;
   storage_handle_t *h = NULL;
-  char buf[VFS_PATH], st[8];
+  char st[8];
   Err err = dmErrResourceNotFound;
 
-  if (mutex_lock(sto->mutex) == 0) {
-    dbRef = (DmOpenType *)dbP;
-    if (dbRef) {
-      db = (storage_db_t *)(sto->base + dbRef->dbID);
+  dbRef = (DmOpenType *)dbP;
+  if (dbRef) {
+    db = (storage_db_t *)(sto->base + dbRef->dbID);
+    if (StoLockDatabase(sto, db, false) == 0) {
       if (db->ftype == STO_TYPE_RES && index < db->numRecs) {
         h = db->elements[index];
         if (!(h->htype & STO_INFLATED)) {
@@ -2241,15 +4121,9 @@ MemHandle DmGetResourceIndex(DmOpenRef dbP, UInt16 index) {
             h->useCount = 1;
             pumpkin_id2s(h->d.res.type, st);
             debug(DEBUG_TRACE, "STOR", "reading %5d bytes from resource %s %d at %p", h->size, st, h->d.res.id, h->buf);
-            storage_name(sto, db->name, STO_FILE_ELEMENT, h->d.res.id, h->d.res.type, 0, 0, buf);
-            if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-              if (vfs_read(f, h->buf, h->size) > 0) {
-                h->lockCount = 0;
-                err = errNone;
-              } else {
-                h = NULL;
-              }
-              vfs_close(f);
+            if (StoReadElement(sto, db, h, h->buf, h->size) > 0) {
+              h->lockCount = 0;
+              err = errNone;
             } else {
               h = NULL;
             }
@@ -2262,11 +4136,11 @@ MemHandle DmGetResourceIndex(DmOpenRef dbP, UInt16 index) {
         }
 
         if (err == errNone) {
-          StoDecodeResource(h);
+          StoDecodeResource(db, h);
         }
       }
+      StoUnlockDatabase(sto, db);
     }
-    mutex_unlock(sto->mutex);
   }
 
   StoCheckErr(err);
@@ -2361,13 +4235,11 @@ MemHandle DmResizeResource(MemHandle resourceH, UInt32 newSize) {
   storage_handle_t *h;
   storage_db_t *db;
   void *newBuf, *old;
-  char buf[VFS_PATH];
-  vfs_file_t *f;
   DmOpenType *dbRef;
   Err err = dmErrInvalidParam;
 
   if (resourceH) {
-    if (mutex_lock(sto->mutex) == 0) {
+    if (StoLockStorage(sto) == 0) {
       h = (storage_handle_t *)resourceH;
       if (h->htype & STO_INFLATED) {
         switch (h->htype & ~STO_INFLATED) {
@@ -2381,12 +4253,7 @@ MemHandle DmResizeResource(MemHandle resourceH, UInt32 newSize) {
                   StoPtrFree(old);
                   h->buf = newBuf;
                   h->size = newSize;
-
-                  storage_name(sto, db->name, STO_FILE_ELEMENT, h->d.res.id, h->d.res.type, 0x00, 0, buf);
-                  if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-                    vfs_write(f, (uint8_t *)h->buf, h->size);
-                    vfs_close(f);
-                  }
+                  StoWriteElement(sto, db, h, h->buf, h->size);
 
                   err = errNone;
                 }
@@ -2413,16 +4280,14 @@ MemHandle DmNewResourceEx(DmOpenRef dbP, DmResType resType, DmResID resID, UInt3
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
   DmOpenType *dbRef;
-  char buf[VFS_PATH];
-  vfs_file_t *f;
   storage_handle_t *h = NULL;
   Err err = dmErrResourceNotFound;
 
   if (dbP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
         if (db->ftype == STO_TYPE_RES) {
           if ((h = pumpkin_heap_alloc(sizeof(storage_handle_t), "Handle")) != NULL) {
             h->magic = STO_MAGIC;
@@ -2436,17 +4301,13 @@ MemHandle DmNewResourceEx(DmOpenRef dbP, DmResType resType, DmResID resID, UInt3
             StoAddDatabaseHandle(sto, db, h);
             db->modDate = TimGetSeconds();
 
-            storage_name(sto, db->name, STO_FILE_ELEMENT, resID, resType, 0x00, 0, buf);
-            if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-              if (p) xmemcpy(h->buf, p, h->size);
-              vfs_write(f, (uint8_t *)h->buf, h->size);
-              vfs_close(f);
-            }
+            if (p) xmemcpy(h->buf, p, h->size);
+            StoWriteElement(sto, db, h, h->buf, h->size);
             err = errNone;
           }
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -2464,14 +4325,12 @@ Err DmAttachResource(DmOpenRef dbP, MemHandle newH, DmResType resType, DmResID r
   storage_handle_t *h;
   DmOpenType *dbRef;
   uint8_t *p;
-  char buf[VFS_PATH];
-  vfs_file_t *f;
   Err err = dmErrResourceNotFound;
 
-  if (mutex_lock(sto->mutex) == 0) {
-    dbRef = (DmOpenType *)dbP;
-    if (dbRef) {
-      db = (storage_db_t *)(sto->base + dbRef->dbID);
+  dbRef = (DmOpenType *)dbP;
+  if (dbRef) {
+    db = (storage_db_t *)(sto->base + dbRef->dbID);
+    if (StoLockDatabase(sto, db, true) == 0) {
       if (db->ftype == STO_TYPE_RES) {
         h = (storage_handle_t *)newH;
         h->owner = 0;
@@ -2484,18 +4343,14 @@ Err DmAttachResource(DmOpenRef dbP, MemHandle newH, DmResType resType, DmResID r
         StoAddDatabaseHandle(sto, db, h);
 
         if (h->htype & STO_INFLATED) {
-          storage_name(sto, db->name, STO_FILE_ELEMENT, resID, resType, 0x00, 0, buf);
-          if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-            p = MemHandleLock(newH);
-            vfs_write(f, p, MemHandleSize(newH));
-            MemHandleUnlock(newH);
-            vfs_close(f);
-          }
+          p = MemHandleLock(newH);
+          StoWriteElement(sto, db, h, p, MemHandleSize(newH));
+          MemHandleUnlock(newH);
         }
         db->modDate = TimGetSeconds();
       }
+      StoUnlockDatabase(sto, db);
     }
-    mutex_unlock(sto->mutex);
   }
 
   return err;
@@ -2506,35 +4361,36 @@ Err DmRemoveResource(DmOpenRef dbP, UInt16 index) {
   storage_db_t *db;
   storage_handle_t *h;
   DmOpenType *dbRef;
-  char buf[VFS_PATH];
   uint32_t i;
   Err err = dmErrResourceNotFound;
 
   if (dbP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
         if (db->ftype == STO_TYPE_RES && db->numRecs > 0) {
           if (index >= db->numRecs) index = db->numRecs - 1;
           if (db->elements[index]->lockCount == 0) {
             h = db->elements[index];
-            storage_name(sto, db->name, STO_FILE_ELEMENT, h->d.res.id, h->d.res.type, 0, 0, buf);
-            StoVfsUnlink(sto->session, buf);
+            StoHashRemove(db, index);
+            StoRemoveElement(sto, db, h);
             if (h->buf) StoPtrFree(h->buf);
             pumpkin_heap_free(h, "Handle");
             db->numRecs--;
             for (i = index; i < db->numRecs; i++) {
               db->elements[i] = db->elements[i+1];
             }
+            StoResChanged();
+            StoCategoryInvalidate(db);
             db->modDate = TimGetSeconds();
             err = errNone;
           } else {
             debug(DEBUG_ERROR, "STOR", "DmRemoveResource %p %u attempt to remove locked handle", dbP, index);
           }
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -2565,9 +4421,10 @@ LocalID DmGetAppInfoID(DmOpenRef dbP) {
 UInt16 DmNumRecordsInCategory(DmOpenRef dbP, UInt16 category) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  storage_handle_t *h;
   DmOpenType *dbRef;
-  UInt16 i, numRecs = 0;
+  uint16_t *list;
+  uint32_t n;
+  UInt16 numRecs = 0;
   Err err = dmErrInvalidParam;
 
   if (dbP) {
@@ -2575,15 +4432,13 @@ UInt16 DmNumRecordsInCategory(DmOpenRef dbP, UInt16 category) {
     if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
       db = (storage_db_t *)(sto->base + dbRef->dbID);
       if (db->ftype == STO_TYPE_REC) {
-        for (i = 0; i < db->numRecs; i++) {
-          h = db->elements[i];
-          if (!(h->d.rec.attr & dmRecAttrDelete) && (category == dmAllCategories || (h->d.rec.attr & dmRecAttrCategoryMask) == (category &= dmRecAttrCategoryMask))) {
-            if (!(h->d.rec.attr & dmRecAttrSecret) || (dbRef->mode & dmModeShowSecret)) {
-              numRecs++;
-            }
-          }
+        if (category != dmAllCategories) category &= dmRecAttrCategoryMask;
+        if (StoCategoryList(db, dbRef, category, &list, &n) == 0) {
+          numRecs = n;
+          err = errNone;
+        } else {
+          err = dmErrMemError;
         }
-        err = errNone;
       }
     }
   }
@@ -2595,61 +4450,56 @@ UInt16 DmNumRecordsInCategory(DmOpenRef dbP, UInt16 category) {
 MemHandle DmQueryNextInCategory(DmOpenRef dbP, UInt16 *indexP, UInt16 category) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  storage_handle_t *ha, *h = NULL;
+  storage_handle_t *h = NULL;
   DmOpenType *dbRef;
-  vfs_file_t *f;
-  char buf[VFS_PATH];
+  uint16_t *list;
+  uint32_t n, k;
   Err err = dmErrInvalidParam;
 
   if (dbP && indexP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, false) == 0) {
         if (db->ftype == STO_TYPE_REC) {
-          for (; *indexP < db->numRecs; (*indexP)++) {
-            ha = db->elements[*indexP];
-            if (!(ha->d.rec.attr & dmRecAttrDelete) && (category == dmAllCategories || (ha->d.rec.attr & dmRecAttrCategoryMask) == (category &= dmRecAttrCategoryMask))) {
-              if (!(ha->d.rec.attr & dmRecAttrSecret) || (dbRef->mode & dmModeShowSecret)) {
-                h = ha;
-
-                if (!(h->htype & STO_INFLATED)) {
-                  if ((h->buf = StoPtrNew(h, h->size, 0, 0)) != NULL) {
-                    h->htype |= STO_INFLATED;
-                    h->useCount = 1;
-                    storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
-                    if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-                      if (vfs_read(f, h->buf, h->size) == h->size) {
-                        h->d.rec.attr &= ~dmRecAttrDirty;
-                        //h->d.rec.attr |= dmRecAttrBusy; // XXX is it necessary ?
-                        h->lockCount = 0;
-                        err = errNone;
-                      } else {
-                        err = dmErrMemError;
-                        h = NULL;
-                      }
-                      vfs_close(f);
-                    } else {
-                      err = dmErrMemError;
-                      h = NULL;
-                    }
-                  } else {
-                    err = dmErrMemError;
-                    h = NULL;
-                  }
-                } else {
-                  h->useCount++;
+          if (category != dmAllCategories) category &= dmRecAttrCategoryMask;
+          if (StoCategoryList(db, dbRef, category, &list, &n) == -1) {
+            n = 0;
+          }
+          if ((k = StoCategoryRank(list, n, *indexP)) < n) {
+            *indexP = list[k];
+
+            if ((h = StoElement(db, *indexP)) == NULL) {
+              err = dmErrMemError;
+            } else if (!(h->htype & STO_INFLATED)) {
+              if ((h->buf = StoPtrNew(h, h->size, 0, 0)) != NULL) {
+                h->htype |= STO_INFLATED;
+                h->useCount = 1;
+                if (StoReadElement(sto, db, h, h->buf, h->size) == h->size) {
+                  dbstats_count(stoStats, db->stats, DBSTATS_INFLATE, h->size);
+                  h->d.rec.attr &= ~dmRecAttrDirty;
+                  //h->d.rec.attr |= dmRecAttrBusy; // XXX is it necessary ?
+                  h->lockCount = 0;
                   err = errNone;
+                } else {
+                  err = dmErrMemError;
+                  h = NULL;
                 }
-
-                break;
+              } else {
+                err = dmErrMemError;
+                h = NULL;
               }
+            } else {
+              h->useCount++;
+              err = errNone;
             }
+          } else if (*indexP < db->numRecs) {
+            *indexP = db->numRecs;
           }
           err = errNone;
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -2657,20 +4507,19 @@ MemHandle DmQueryNextInCategory(DmOpenRef dbP, UInt16 *indexP, UInt16 category)
   return h;
 }
 
-static UInt16 DmFindSortPositionBinary(storage_db_t *db, MemHandle appInfoH, void *newRecord, SortRecordInfoPtr newRecordInfo, DmComparF *compar, Int16 other, UInt16 start, UInt16 end, UInt16 level) {
+static UInt16 DmFindSortPositionBinary(storage_db_t *db, MemHandle appInfoH, void *newRecord, SortRecordInfoPtr newRecordInfo, DmComparF *compar, Int16 other, UInt16 start, UInt16 end, UInt16 level, uint32_t *key) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
-  storage_handle_t *h;
+  storage_handle_t *h, tmp;
   SortRecordInfoType recInfo, *recInfoP;
-  vfs_file_t *f;
-  char buf[VFS_PATH];
   UInt16 pivot, pos;
+  uint32_t pivotKey;
   Int16 r;
 
 //debug(1, "XXX", "DmFindSortPosition level %d begin", level);
   pivot = start + (end - start + 1) / 2;
 //debug(1, "XXX", "DmFindSortPosition start=%d pivot=%d end=%d", start, pivot, end);
 //debug(1, "check", "find level %d start %d pivot %d end %d", level, start, pivot, end);
-  h = db->elements[pivot];
+  h = StoPeek(db, pivot, &tmp);
   if (newRecordInfo) {
     recInfo.attributes = h->d.rec.attr;
     recInfo.uniqueID[0] = (h->d.rec.uniqueID >> 16) & 0xFF;
@@ -2682,23 +4531,27 @@ static UInt16 DmFindSortPositionBinary(storage_db_t *db, MemHandle appInfoH, voi
   }
 //debug(1, "XXX", "DmFindSortPosition compare with rec %d (h=%p, buf=%p, len=%d, inflated=%d)", pivot, h, h->buf, h->size, h->htype & STO_INFLATED ? 1 : 0);
 
-  if (!(h->htype & STO_INFLATED)) {
+  if (key && (pivotKey = StoRecordKey(db, h)) != *key) {
+    // decided by the sort key, the record is not read
+    r = *key < pivotKey ? -1 : 1;
+  } else if ((h = StoElement(db, pivot)) == NULL) {
+    r = 0;
+  } else if (!(h->htype & STO_INFLATED)) {
     h->htype |= STO_INFLATED;
     h->useCount = 1;
 //debug(1, "XXX", "DmFindSortPosition inflate record");
     if ((h->buf = StoPtrNew(h, h->size, 0, 0)) != NULL) {
-      storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
-      if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-        vfs_read(f, h->buf, h->size);
-        vfs_close(f);
+      if (StoReadElement(sto, db, h, h->buf, h->size) == h->size) {
+        dbstats_count(stoStats, db->stats, DBSTATS_INFLATE, h->size);
       }
     }
+    r = compar(newRecord, h->buf, other, newRecordInfo, recInfoP, appInfoH);
   } else {
     h->useCount++;
+    r = compar(newRecord, h->buf, other, newRecordInfo, recInfoP, appInfoH);
   }
 
 //debug(1, "XXX", "DmFindSortPosition compare %p with %p at position %d ...", newRecord, h->buf, pivot);
-  r = compar(newRecord, h->buf, other, newRecordInfo, recInfoP, appInfoH);
 //debug(1, "XXX", "DmFindSortPosition compare r=%d", r);
 //debug(1, "check", "compare level %d pos %d: %d", level, pivot, r);
   if (r == 0) {
@@ -2707,7 +4560,7 @@ static UInt16 DmFindSortPositionBinary(storage_db_t *db, MemHandle appInfoH, voi
   } else if (r < 0) {
     if (pivot > start) {
 //debug(1, "XXX", "DmFindSortPosition less than, recursion");
-      pos = DmFindSortPositionBinary(db, appInfoH, newRecord, newRecordInfo, compar, other, start, pivot-1, level+1);
+      pos = DmFindSortPositionBinary(db, appInfoH, newRecord, newRecordInfo, compar, other, start, pivot-1, level+1, key);
     } else {
       pos = pivot;
 //debug(1, "XXX", "DmFindSortPosition less than, pos %d", pos);
@@ -2715,7 +4568,7 @@ static UInt16 DmFindSortPositionBinary(storage_db_t *db, MemHandle appInfoH, voi
   } else {
     if (pivot < end) {
 //debug(1, "XXX", "DmFindSortPosition greater than, recursion");
-      pos = DmFindSortPositionBinary(db, appInfoH, newRecord, newRecordInfo, compar, other, pivot+1, end, level+1);
+      pos = DmFindSortPositionBinary(db, appInfoH, newRecord, newRecordInfo, compar, other, pivot+1, end, level+1, key);
     } else {
       pos = end+1;
 //debug(1, "XXX", "DmFindSortPosition greater than, pos %d", pos);
@@ -2736,25 +4589,28 @@ UInt16 DmFindSortPosition(DmOpenRef dbP, void *newRecord, SortRecordInfoPtr newR
   DmOpenType *dbRef;
   MemHandle appInfoH;
   UInt16 start, end, pos = 0;
+  uint32_t key;
+  int keyed;
   Err err = dmErrInvalidParam;
 
   if (dbP && newRecord && compar) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, false) == 0) {
         if (db->ftype == STO_TYPE_REC) {
           if (db->numRecs > 0) {
             appInfoH = db->appInfoID ? MemLocalIDToHandle(db->appInfoID) : NULL;
             start = 0;
             end = db->numRecs - 1;
-            pos = DmFindSortPositionBinary(db, appInfoH, newRecord, newRecordInfo, compar, other, start, end, 0);
+            keyed = StoNewRecordKey(sto, db, newRecord, &key) == 0;
+            pos = DmFindSortPositionBinary(db, appInfoH, newRecord, newRecordInfo, compar, other, start, end, 0, keyed ? &key : NULL);
           } else {
             pos = 0;
           }
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -2769,12 +4625,14 @@ UInt16 DmFindSortPositionV10(DmOpenRef dbP, void *newRecord, DmComparF *compar,
 UInt16 DmFindSortPosition68K(DmOpenRef dbP, UInt32 newRecord, UInt32 newRecordInfo, UInt32 compar, Int16 other) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  storage_handle_t *h;
+  storage_handle_t *h, tmp;
   MemHandle appInfoH;
   UInt8 *recInfoP;
   UInt32 appInfo, recInfo;
   DmOpenType *dbRef;
   UInt16 i, pos = 0;
+  uint32_t key, recKey;
+  int keyed;
   Err err = dmErrInvalidParam;
 
   if (dbP && newRecord && compar) {
@@ -2787,9 +4645,18 @@ UInt16 DmFindSortPosition68K(DmOpenRef dbP, UInt32 newRecord, UInt32 newRecordIn
           appInfoH = db->appInfoID ? MemLocalIDToHandle(db->appInfoID) : NULL;
           appInfo = appInfoH ? (uint8_t *)appInfoH - sto->base : 0;
           recInfoP = pumpkin_heap_alloc(4, "recInfo");
+          keyed = StoNewRecordKey(sto, db, sto->base + newRecord, &key) == 0;
           for (i = 0; i < db->numRecs; i++) {
-            h = db->elements[i];
-            if (StoInflateRec(sto, db, h) == -1) break;
+            h = StoPeek(db, i, &tmp);
+            if (keyed && (recKey = StoRecordKey(db, h)) != key) {
+              if (key > recKey) {
+                pos = i;
+                err = errNone;
+                break;
+              }
+              continue;
+            }
+            if ((h = StoElement(db, i)) == NULL || StoInflateRec(sto, db, h) == -1) break;
             if (newRecordInfo) {
               recInfoP[0] = h->d.rec.attr;
               recInfoP[1] = (h->d.rec.uniqueID >> 16) & 0xFF;
@@ -2826,9 +4693,10 @@ UInt16 DmFindSortPosition68K(DmOpenRef dbP, UInt32 newRecord, UInt32 newRecordIn
 UInt16 DmPositionInCategory(DmOpenRef dbP, UInt16 index, UInt16 category) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  storage_handle_t *h;
   DmOpenType *dbRef;
-  UInt16 i, pos = 0;
+  uint16_t *list;
+  uint32_t n, k;
+  UInt16 pos = 0;
   Err err = dmErrInvalidParam;
 
   if (dbP) {
@@ -2836,16 +4704,15 @@ UInt16 DmPositionInCategory(DmOpenRef dbP, UInt16 index, UInt16 category) {
     if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
       db = (storage_db_t *)(sto->base + dbRef->dbID);
       if (db->ftype == STO_TYPE_REC && index < db->numRecs) {
-        for (i = 0; i < db->numRecs; i++) {
-          h = db->elements[i];
-          if (!(h->d.rec.attr & dmRecAttrDelete) && (category == dmAllCategories || (h->d.rec.attr & dmRecAttrCategoryMask) == (category &= dmRecAttrCategoryMask))) {
-            if (!(h->d.rec.attr & dmRecAttrSecret) || (dbRef->mode & dmModeShowSecret)) {
-              if (i == index) break;
-              pos++;
-            }
-          }
+        if (category != dmAllCategories) category &= dmRecAttrCategoryMask;
+        if (StoCategoryList(db, dbRef, category, &list, &n) == 0) {
+          // a record that is not in the category is placed after all the ones that are
+          k = StoCategoryRank(list, n, index);
+          pos = (k < n && list[k] == index) ? k : n;
+          err = errNone;
+        } else {
+          err = dmErrMemError;
         }
-        err = errNone;
       }
     }
   }
@@ -2859,8 +4726,7 @@ MemHandle DmResizeRecord(DmOpenRef dbP, UInt16 index, UInt32 newSize) {
   storage_db_t *db;
   DmOpenType *dbRef;
   void *p;
-  vfs_file_t *f;
-  char buf[VFS_PATH];
+  int cached;
   storage_handle_t *h = NULL;
   Err err = dmErrInvalidParam;
 
@@ -2868,29 +4734,29 @@ MemHandle DmResizeRecord(DmOpenRef dbP, UInt16 index, UInt32 newSize) {
     dbRef = (DmOpenType *)dbP;
     if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
       db = (storage_db_t *) (sto->base + dbRef->dbID);
-      if (db->ftype == STO_TYPE_REC && index < db->numRecs) {
-        h = db->elements[index];
-        if (h->htype & STO_INFLATED) {
-          p = StoPtrNew(h, newSize, 0, 0);
-          MemMove(p, h->buf, newSize < h->size ? newSize : h->size);
-          StoPtrFree(h->buf);
-          h->buf = p;
-        } else {
-          if ((h->buf = StoPtrNew(h, newSize, 0, 0)) != NULL) {
-            h->htype |= STO_INFLATED;
-            h->useCount = 1;
-            storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
-            if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-              vfs_read(f, h->buf, newSize < h->size ? newSize : h->size);
-              vfs_close(f);
+      if (StoLockDatabase(sto, db, true) == 0) {
+        if (db->ftype == STO_TYPE_REC && index < db->numRecs && (h = StoElement(db, index)) != NULL) {
+          cached = StoCacheUnlink(db, h);
+          if (h->htype & STO_INFLATED) {
+            p = StoPtrNew(h, newSize, 0, 0);
+            MemMove(p, h->buf, newSize < h->size ? newSize : h->size);
+            StoPtrFree(h->buf);
+            h->buf = p;
+          } else {
+            if ((h->buf = StoPtrNew(h, newSize, 0, 0)) != NULL) {
+              h->htype |= STO_INFLATED;
+              h->useCount = 1;
+              StoReadElement(sto, db, h, h->buf, newSize < h->size ? newSize : h->size);
+              h->lockCount = 0;
             }
-            h->lockCount = 0;
           }
+          h->size = newSize;
+          h->d.rec.attr |= dmRecAttrDirty;
+          if (cached) StoCacheAppend(db, h);
+          db->modDate = TimGetSeconds();
+          err = errNone;
         }
-        h->size = newSize;
-        h->d.rec.attr |= dmRecAttrDirty;
-        db->modDate = TimGetSeconds();
-        err = errNone;
+        StoUnlockDatabase(sto, db);
       }
     }
   }
@@ -2918,41 +4784,49 @@ Err DmMoveRecord(DmOpenRef dbP, UInt16 from, UInt16 to) {
     dbRef = (DmOpenType *)dbP;
     if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
       db = (storage_db_t *)(sto->base + dbRef->dbID);
-      if (db->ftype == STO_TYPE_REC) {
-        err = errNone;
-        if (db->numRecs > 1 && from < db->numRecs) {
-          if (to >= db->numRecs) {
+      if (StoLockDatabase(sto, db, true) == 0) {
+        if (db->ftype == STO_TYPE_REC) {
+          err = errNone;
+          if (db->numRecs > 1 && from < db->numRecs) {
+            if (to >= db->numRecs) {
 //debug(1, "XXX", "DmMoveRecord %d to end", from);
-            //     F           T
-            // 0 1 2 3 4 5 6 7 8
-            to = db->numRecs - 1;
-            h = db->elements[from];
-            for (i = from; i < to; i++) {
-              db->elements[i] = db->elements[i + 1];
-            }
-            db->elements[to] = h;
-          } else if (from > to) {
+              //     F           T
+              // 0 1 2 3 4 5 6 7 8
+              to = db->numRecs - 1;
+              h = db->elements[from];
+              for (i = from; i < to; i++) {
+                db->elements[i] = db->elements[i + 1];
+              }
+              db->elements[to] = h;
+            } else if (from > to) {
 //debug(1, "XXX", "DmMoveRecord %d down to %d", from, to);
-            //     T     F
-            // 0 1 2 3 4 5 6 7 8
-            h = db->elements[from];
-            for (i = from; i > to; i--) {
-              db->elements[i] = db->elements[i - 1];
-            }
-            db->elements[to] = h;
-          } else if (from < to) {
+              //     T     F
+              // 0 1 2 3 4 5 6 7 8
+              h = db->elements[from];
+              for (i = from; i > to; i--) {
+                db->elements[i] = db->elements[i - 1];
+              }
+              db->elements[to] = h;
+            } else if (from < to) {
 //debug(1, "XXX", "DmMoveRecord %d up to %d", from, to);
-            //     F     T
-            // 0 1 2 3 4 5 6 7 8
-            h = db->elements[from];
-            to--;
-            for (i = from; i < to; i++) {
-              db->elements[i] = db->elements[i + 1];
+              //     F     T
+              // 0 1 2 3 4 5 6 7 8
+              h = db->elements[from];
+              to--;
+              for (i = from; i < to; i++) {
+                db->elements[i] = db->elements[i + 1];
+              }
+              db->elements[to] = h;
             }
-            db->elements[to] = h;
+            if (from != to) {
+              StoHashMove(db, from, to);
+              StoCategoryInvalidate(db);
+              StoJournalMove(sto, db, from, to);
+            }
+            db->modDate = TimGetSeconds();
           }
-          db->modDate = TimGetSeconds();
         }
+        StoUnlockDatabase(sto, db);
       }
     }
   }
@@ -2970,45 +4844,39 @@ Err DmDeleteRecord(DmOpenRef dbP, UInt16 index) {
   storage_db_t *db;
   storage_handle_t *h;
   DmOpenType *dbRef;
-  char oldName[VFS_PATH];
-  char newName[VFS_PATH];
+  UInt16 oldAttr;
   Err err = dmErrInvalidParam;
 
   if (dbP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *) (sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
         if (db->ftype == STO_TYPE_REC && db->numRecs > 0 && index < db->numRecs) {
-          if (db->elements[index]->lockCount == 0) {
+          if ((h = StoElement(db, index)) != NULL && h->lockCount == 0) {
 //debug(1, "XXX", "DmDeleteRecord index %d", index);
-            h = db->elements[index];
             if (!(h->d.rec.attr & dmRecAttrDelete)) {
-              storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, oldName);
+              oldAttr = h->d.rec.attr;
               h->d.rec.attr |= dmRecAttrDelete;
-              storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, newName);
-//debug(1, "XXX", "DmDeleteRecord rename [%s] to [%s]", oldName, newName);
-              if (sys_strcmp(oldName, newName)) {
-//debug(1, "XXX", "DmDeleteRecord renaming");
-                if (StoVfsRename(sto->session, oldName, newName) == 0) {
+              StoCategoryInvalidate(db);
+              if (StoRenameElement(sto, db, h, h->d.rec.uniqueID, oldAttr) == 0) {
 //debug(1, "XXX", "DmDeleteRecord rename ok");
-                  if (h->buf) {
+                StoJournalIndex(sto, db, STO_INDEX_UPDATE, index);
+                StoCacheUnlink(db, h);
+                if (h->buf) {
 //debug(1, "XXX", "DmDeleteRecord free buf");
-                    StoPtrFree(h->buf);
-                    h->buf = NULL;
-                  }
+                  StoPtrFree(h->buf);
+                  h->buf = NULL;
+                }
 //debug(1, "XXX", "DmDeleteRecord deflate");
-                  h->htype &= ~STO_INFLATED;
-                  if (h->useCount) {
-                    h->useCount--;
-                  } else {
-                    debug(DEBUG_ERROR, "STOR", "DmDeleteRecord database \"%s\" index %d useCount < 0", db->name, index);
-                  }
-                  db->modDate = TimGetSeconds();
-                  err = errNone;
+                h->htype &= ~STO_INFLATED;
+                if (h->useCount) {
+                  h->useCount--;
+                } else {
+                  debug(DEBUG_ERROR, "STOR", "DmDeleteRecord database \"%s\" index %d useCount < 0", db->name, index);
                 }
-              } else {
-//debug(1, "XXX", "DmDeleteRecord same name");
+                db->modDate = TimGetSeconds();
+                err = errNone;
               }
             } else {
               debug(DEBUG_ERROR, "STOR", "DmDeleteRecord %p %u attempt to remove deleted record", dbP, index);
@@ -3018,8 +4886,8 @@ Err DmDeleteRecord(DmOpenRef dbP, UInt16 index) {
             err = memErrChunkLocked;
           }
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -3037,20 +4905,19 @@ Err DmRemoveRecord(DmOpenRef dbP, UInt16 index) {
   storage_handle_t *h;
   DmOpenType *dbRef;
   UInt16 i;
-  char buf[VFS_PATH];
   Err err = dmErrInvalidParam;
 
   if (dbP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *) (sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
         if (db->ftype == STO_TYPE_REC && db->numRecs > 0 && index < db->numRecs) {
-          if (db->elements[index]->lockCount == 0) {
-            h = db->elements[index];
-            storage_name(sto, db->name, STO_FILE_ELEMENT, index, 0, h->d.rec.attr & ATTR_MASK, h->d.rec.uniqueID, buf);
-//debug(1, "XXX", "DmRemoveRecord remove file [%s]", buf);
-            StoVfsUnlink(sto->session, buf);
+          if ((h = StoElement(db, index)) != NULL && h->lockCount == 0) {
+            StoHashRemove(db, index);
+            StoCacheUnlink(db, h);
+            StoBeginWrite(sto);
+            StoRemoveElement(sto, db, h);
             if (h->buf) StoPtrFree(h->buf);
             pumpkin_heap_free(h, "Handle");
             db->numRecs--;
@@ -3059,6 +4926,9 @@ Err DmRemoveRecord(DmOpenRef dbP, UInt16 index) {
                 db->elements[i] = db->elements[i + 1];
               }
             }
+            StoCategoryInvalidate(db);
+            StoJournalIndex(sto, db, STO_INDEX_REMOVE, index);
+            StoEndWrite(sto);
             db->modDate = TimGetSeconds();
             err = errNone;
           } else {
@@ -3066,8 +4936,8 @@ Err DmRemoveRecord(DmOpenRef dbP, UInt16 index) {
             err = memErrChunkLocked;
           }
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -3092,28 +4962,25 @@ MemHandle DmNewHandle(DmOpenRef dbP, UInt32 size) {
 Err DmFindRecordByID(DmOpenRef dbP, UInt32 uniqueID, UInt16 *indexP) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  storage_handle_t *h;
   DmOpenType *dbRef;
-  uint32_t i;
+  int i;
   Err err = dmErrInvalidParam;
 
   if (dbP && indexP) {
     dbRef = (DmOpenType *)dbP;
     if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
       db = (storage_db_t *)(sto->base + dbRef->dbID);
-      if (db->ftype == STO_TYPE_REC) {
-        err = dmErrUniqueIDNotFound;
-        for (i = 0; i < db->numRecs; i++) {
-          h = db->elements[i];
-          if (h->d.rec.uniqueID == uniqueID) {
+      if (StoLockDatabase(sto, db, false) == 0) {
+        if (db->ftype == STO_TYPE_REC) {
+          if ((i = StoIdFind(db, uniqueID)) != -1) {
             *indexP = i;
             err = errNone;
-            break;
+          } else {
+            debug(DEBUG_ERROR, "STOR", "DmFindRecordByID 0x%08X not found", uniqueID);
+            err = dmErrUniqueIDNotFound;
           }
         }
-        if (i == db->numRecs) {
-          debug(DEBUG_ERROR, "STOR", "DmFindRecordByID 0x%08X not found", uniqueID);
-        }
+        StoUnlockDatabase(sto, db);
       }
     }
   }
@@ -3127,20 +4994,17 @@ MemHandle DmNewRecordEx(DmOpenRef dbP, UInt16 *atP, UInt32 size, void *p) {
   storage_db_t *db;
   storage_handle_t *h = NULL;
   DmOpenType *dbRef;
-  vfs_file_t *f;
-  uint32_t n;
-  char buf[VFS_PATH];
   int j;
   Err err = dmErrInvalidParam;
 
   if (dbP && atP && size > 0) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        if (dbRef->dbID == sto->watchID) {
-          debug(DEBUG_INFO, "STOR", "WATCH DmNewRecord(%p, %p [%d], %u)", dbRef, atP, atP ? *atP : 0, size);
-        }
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      if (dbRef->dbID == sto->watchID) {
+        debug(DEBUG_INFO, "STOR", "WATCH DmNewRecord(%p, %p [%d], %u)", dbRef, atP, atP ? *atP : 0, size);
+      }
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
         debug(DEBUG_TRACE, "STOR", "DmNewRecordEx database \"%s\" at %d size %u", db->name, *atP, size);
         if (db->ftype == STO_TYPE_REC) {
           if (*atP >= db->numRecs) *atP = db->numRecs;
@@ -3162,30 +5026,22 @@ MemHandle DmNewRecordEx(DmOpenRef dbP, UInt16 *atP, UInt32 size, void *p) {
                 db->elements[j] = db->elements[j - 1];
               }
               db->elements[*atP] = h;
+              StoHashMove(db, db->numRecs - 1, *atP);
+              StoCategoryInvalidate(db);
             }
 
-            storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, 0x00, h->d.rec.uniqueID, buf);
-            if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
-              if (p) {
-                xmemcpy(&h->buf[0], p, size);
-                vfs_write(f, (uint8_t *)p, size);
-              } else {
-                xmemset(buf, 0, sizeof(buf));
-                for (n = 0; (n + sizeof(buf)) < size; n += sizeof(buf)) {
-                  vfs_write(f, (uint8_t *)buf, sizeof(buf));
-                }
-                if (size > n) {
-                  vfs_write(f, (uint8_t *)buf, size - n);
-                }
-              }
-              vfs_close(f);
+            if (p) {
+              xmemcpy(&h->buf[0], p, size);
             }
-            StoWriteIndex(sto, db);
+            StoBeginWrite(sto);
+            StoWriteElement(sto, db, h, p, size);
+            StoJournalIndex(sto, db, STO_INDEX_INSERT, *atP);
+            StoEndWrite(sto);
             err = errNone;
           }
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -3209,18 +5065,18 @@ Err DmAttachRecord(DmOpenRef dbP, UInt16 *atP, MemHandle newH, MemHandle *oldHP)
   storage_db_t *db;
   storage_handle_t *h, *old;
   DmOpenType *dbRef;
-  vfs_file_t *f;
-  char buf[VFS_PATH];
+  UInt32 op;
   UInt16 i;
   Err err = dmErrIndexOutOfRange;
 
 //debug(1, "XXX", "DmAttachRecord at %d", *atP);
   if (dbP && atP && newH) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
-        if (db->ftype == STO_TYPE_REC) {
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
+        // the record at *atP is replaced or shifted, so it needs its handle
+        if (db->ftype == STO_TYPE_REC && (*atP >= db->numRecs || StoElement(db, *atP) != NULL)) {
 //debug(1, "XXX", "DmAttachRecord numRecs %d", db->numRecs);
           if (*atP > db->numRecs) *atP = db->numRecs;
           h = (storage_handle_t *)newH;
@@ -3232,7 +5088,9 @@ Err DmAttachRecord(DmOpenRef dbP, UInt16 *atP, MemHandle newH, MemHandle *oldHP)
           h->d.rec.uniqueID = db->uniqueIDSeed++;
           h->d.rec.attr = dmRecAttrDirty;
           h->d.rec.attr |= dmRecAttached;
+          h->d.rec.cachePrev = h->d.rec.cacheNext = NULL;
 //debug(1, "XXX", "DmAttachRecord uniqueID %d", h->d.rec.uniqueID);
+          op = STO_INDEX_INSERT;
 
           if (*atP == db->numRecs) {
 //debug(1, "XXX", "DmAttachRecord add at end");
@@ -3241,17 +5099,14 @@ Err DmAttachRecord(DmOpenRef dbP, UInt16 *atP, MemHandle newH, MemHandle *oldHP)
           } else {
 //debug(1, "XXX", "DmAttachRecord add in the begining/middle");
             old = db->elements[*atP];
+            StoCacheUnlink(db, old);
             if (!(old->htype & STO_INFLATED)) {
 //debug(1, "XXX", "DmAttachRecord old not inflated");
               old->htype |= STO_INFLATED;
               old->useCount = 1;
               if ((old->buf = StoPtrNew(old, old->size, 0, 0)) != NULL) {
 //debug(1, "XXX", "DmAttachRecord old inflate old %d bytes", old->size);
-                storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, old->d.rec.attr & ATTR_MASK, old->d.rec.uniqueID, buf);
-                if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-                  vfs_read(f, old->buf, old->size);
-                  vfs_close(f);
-                }
+                StoReadElement(sto, db, old, old->buf, old->size);
               }
             } else {
               old->useCount++;
@@ -3260,12 +5115,14 @@ Err DmAttachRecord(DmOpenRef dbP, UInt16 *atP, MemHandle newH, MemHandle *oldHP)
             if (oldHP) {
               // new record replaces old
 //debug(1, "XXX", "DmAttachRecord replace element at %d", *atP);
+              StoHashDelete(db, *atP);
               db->elements[*atP] = h;
+              if (db->hashValid) StoHashInsert(db, *atP);
               old->htype = (old->htype & STO_INFLATED) | STO_TYPE_MEM;
               *oldHP = old;
-              storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, old->d.rec.attr & ATTR_MASK, old->d.rec.uniqueID, buf);
-//debug(1, "XXX", "DmAttachRecord remove old file [%s]", buf);
-              StoVfsUnlink(sto->session, buf);
+              op = STO_INDEX_UPDATE;
+//debug(1, "XXX", "DmAttachRecord remove old element");
+              StoRemoveElement(sto, db, old);
             } else {
               // new record is inserted at position, records are shifted down
               StoAddDatabaseHandle(sto, db, h); // just to add space, h at last position will be overwritten below
@@ -3275,24 +5132,23 @@ Err DmAttachRecord(DmOpenRef dbP, UInt16 *atP, MemHandle newH, MemHandle *oldHP)
               }
 //debug(1, "XXX", "DmAttachRecord set element at %d", *atP);
               db->elements[*atP] = h;
+              StoHashMove(db, db->numRecs - 1, *atP);
             }
           }
 
           if (h->htype & STO_INFLATED) {
-            storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, 0x00, h->d.rec.uniqueID, buf);
-//debug(1, "XXX", "DmAttachRecord write new file [%s]", buf);
-            if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
 //debug(1, "XXX", "DmAttachRecord write %d bytes", h->size);
-              vfs_write(f, h->buf, h->size);
-              vfs_close(f);
-            }
+            StoWriteElement(sto, db, h, h->buf, h->size);
+          }
+          if (op == STO_INDEX_UPDATE || *atP < db->numRecs - 1) {
+            StoCategoryInvalidate(db);
           }
           db->modDate = TimGetSeconds();
-          StoWriteIndex(sto, db);
+          StoJournalIndex(sto, db, op, *atP);
           err = errNone;
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -3308,23 +5164,20 @@ Err DmDetachRecord(DmOpenRef dbP, UInt16 index, MemHandle *oldHP) {
   storage_db_t *db;
   storage_handle_t *old;
   DmOpenType *dbRef;
-  vfs_file_t *f;
-  char buf[VFS_PATH];
   UInt16 i;
   Err err = dmErrIndexOutOfRange;
 
 //debug(1, "XXX", "DmDetachRecord at %d", *atP);
   if (dbP && oldHP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef && (dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
         if (db->ftype == STO_TYPE_REC && index < db->numRecs) {
 //debug(1, "XXX", "DmDetachRecord numRecs %d", db->numRecs);
-          if (db->elements[index]->lockCount == 0) {
-            old = db->elements[index];
+          if ((old = StoElement(db, index)) != NULL && old->lockCount == 0) {
+            StoCacheUnlink(db, old);
             old->owner = pumpkin_get_current();
-            storage_name(sto, db->name, STO_FILE_ELEMENT, 0, 0, old->d.rec.attr & ATTR_MASK, old->d.rec.uniqueID, buf);
             old->htype = (old->htype & STO_INFLATED) | STO_TYPE_MEM;
             old->d.rec.attr &= ~dmRecAttached;
             if (!(old->htype & STO_INFLATED)) {
@@ -3333,23 +5186,25 @@ Err DmDetachRecord(DmOpenRef dbP, UInt16 index, MemHandle *oldHP) {
 //debug(1, "XXX", "DmDetachRecord old not inflated");
               if ((old->buf = StoPtrNew(old, old->size, 0, 0)) != NULL) {
 //debug(1, "XXX", "DmDetachRecord old inflate old %d bytes", old->size);
-                if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-                  vfs_read(f, old->buf, old->size);
-                  vfs_close(f);
-                }
+                StoReadElement(sto, db, old, old->buf, old->size);
               }
             } else {
               old->useCount++;
             }
 
-//debug(1, "XXX", "DmDetachRecord remove old file [%s]", buf);
-            StoVfsUnlink(sto->session, buf);
+//debug(1, "XXX", "DmDetachRecord remove old element");
+            StoHashRemove(db, index);
+            StoBeginWrite(sto);
+            StoRemoveElement(sto, db, old);
             *oldHP = old;
             for (i = index; i < db->numRecs-1; i++) {
 //debug(1, "XXX", "DmDetachRecord shift element at %d to %d", i-1, i);
               db->elements[i] = db->elements[i + 1];
             }
             db->numRecs--;
+            StoCategoryInvalidate(db);
+            StoJournalIndex(sto, db, STO_INDEX_REMOVE, index);
+            StoEndWrite(sto);
             db->modDate = TimGetSeconds();
             err = errNone;
           } else {
@@ -3357,8 +5212,8 @@ Err DmDetachRecord(DmOpenRef dbP, UInt16 index, MemHandle *oldHP) {
             err = memErrChunkLocked;
           }
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -3567,11 +5422,13 @@ void *DmResourceLoadLib(DmOpenRef dbP, DmResType resType, Boolean *firstLoad) {
   UInt16 id;
   uint32_t i;
   char buf[VFS_PATH];
+  vfs_file_t *f;
+  uint8_t *p;
   int first_load;
   void *lib = NULL;
 
   if (dbP && firstLoad) {
-    if (mutex_lock(sto->mutex) == 0) {
+    if (StoLockStorage(sto) == 0) {
       dbRef = (DmOpenType *)dbP;
       if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
         db = (storage_db_t *)(sto->base + dbRef->dbID);
@@ -3581,7 +5438,19 @@ void *DmResourceLoadLib(DmOpenRef dbP, DmResType resType, Boolean *firstLoad) {
           for (i = 0; i < db->numRecs; i++) {
             h = db->elements[i];
             if (h->d.res.type == resType && h->d.res.id == id) {
-              storage_name(sto, db->name, STO_FILE_ELEMENT, id, resType, 0, 0, buf);
+              storage_db_name(sto, db, STO_FILE_ELEMENT, id, resType, 0, 0, buf);
+              if (db->backend != STO_BACKEND_DIR && StoVfsChecktype(sto->session, buf) != VFS_FILE) {
+                // the loader needs a real file, extract the library from the container or the image
+                if ((p = xcalloc(1, h->size ? h->size : 1)) != NULL) {
+                  if (StoReadElement(sto, db, h, p, h->size) == h->size) {
+                    if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
+                      vfs_write(f, p, h->size);
+                      vfs_close(f);
+                    }
+                  }
+                  xfree(p);
+                }
+              }
               lib = StoVfsLoadlib(sto->session, buf, &first_load);
               *firstLoad = lib != NULL && first_load == 1;
               break;
@@ -3599,9 +5468,8 @@ void *DmResourceLoadLib(DmOpenRef dbP, DmResType resType, Boolean *firstLoad) {
 UInt16 DmFindResource(DmOpenRef dbP, DmResType resType, DmResID resID, MemHandle resH) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  storage_handle_t *h;
   DmOpenType *dbRef;
-  uint32_t i;
+  int i;
   Err err = dmErrResourceNotFound;
   UInt16 index = 0xFFFF;
 
@@ -3609,27 +5477,26 @@ UInt16 DmFindResource(DmOpenRef dbP, DmResType resType, DmResID resID, MemHandle
     dbRef = (DmOpenType *)dbP;
     if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
       db = (storage_db_t *)(sto->base + dbRef->dbID);
-      if (db->ftype == STO_TYPE_RES) {
-        if (resH) {
-          // search by handle
-          for (i = 0; i < db->numRecs; i++) {
-            if (db->elements[i] == (storage_handle_t *)resH) {
-              index = i;
-              err = errNone;
-              break;
-            }
-          }
-        } else {
-          // search by type and id
-          for (i = 0; i < db->numRecs; i++) {
-            h = db->elements[i];
-            if (h->d.res.type == resType && h->d.res.id == resID) {
+      if (StoLockDatabase(sto, db, false) == 0) {
+        if (db->ftype == STO_TYPE_RES) {
+          if (resH) {
+            // search by handle
+            for (i = 0; i < db->numRecs; i++) {
+              if (db->elements[i] == (storage_handle_t *)resH) {
+                index = i;
+                err = errNone;
+                break;
+              }
+            }
+          } else {
+            // search by type and id
+            if ((i = StoResFind(db, resType, resID)) != -1) {
               index = i;
               err = errNone;
-              break;
             }
           }
         }
+        StoUnlockDatabase(sto, db);
       }
     }
   }
@@ -3716,65 +5583,51 @@ Err DmMoveCategory(DmOpenRef dbP, UInt16 toCategory, UInt16 fromCategory, Boolea
 Err DmSeekRecordInCategory(DmOpenRef dbP, UInt16 *indexP, UInt16 offset, Int16 direction, UInt16 category) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
-  storage_handle_t *h;
   DmOpenType *dbRef;
+  uint16_t *list;
+  uint32_t n, k;
   Err err = dmErrSeekFailed;
 
   if (dbP && indexP) {
-//debug(1, "XXX", "seek begin offset=%d", offset);
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
-         debug(DEBUG_TRACE, "STOR", "DmSeekRecordInCategory n=%d i=%u o=%d d=%d c=%u", DmNumRecords(dbRef), *indexP, offset, direction, category);
-//debug(1, "XXX", "seek numRecs=%d", db->numRecs);
-        if (db->numRecs > 0) {
-          if (*indexP == 0xFFFF) *indexP = db->numRecs-1;
-//debug(1, "XXX", "seek index=%d", *indexP);
-          if (*indexP < db->numRecs) {
-          for (;;) {
-            h = db->elements[*indexP];
-//debug(1, "XXX", "seek index=%d category rec=%d param=%d", *indexP, h->d.rec.attr & dmRecAttrCategoryMask, category);
-            if (!(h->d.rec.attr & dmRecAttrDelete) && (category == dmAllCategories || (h->d.rec.attr & dmRecAttrCategoryMask) == category)) {
-              if (!(h->d.rec.attr & dmRecAttrSecret) || (dbRef->mode & dmModeShowSecret)) {
-//debug(1, "XXX", "seek match offset=%d", offset);
-                if (offset == 0) {
-//debug(1, "XXX", "seek success");
-                  err = errNone;
-                  break;
-                }
-                offset--;
-//debug(1, "XXX", "seek decrement offset=%d", offset);
-              }
-            }
-            if (direction == dmSeekForward) {
-              // forward
-//debug(1, "XXX", "seek forward index=%d", *indexP);
-              if (*indexP == db->numRecs-1) {
-//debug(1, "XXX", "seek forward abort");
-                err = dmErrIndexOutOfRange;
-                break;
-               }
-              *indexP = *indexP + 1;
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      debug(DEBUG_TRACE, "STOR", "DmSeekRecordInCategory n=%d i=%u o=%d d=%d c=%u", DmNumRecords(dbRef), *indexP, offset, direction, category);
+      if (db->numRecs > 0) {
+        if (*indexP == 0xFFFF) *indexP = db->numRecs-1;
+        if (*indexP < db->numRecs) {
+          if (StoCategoryList(db, dbRef, category, &list, &n) == -1) {
+            n = 0;
+          }
+          if (direction == dmSeekForward) {
+            // the offset-th record of the category at or after *indexP
+            k = StoCategoryRank(list, n, *indexP) + offset;
+            if (k < n) {
+              *indexP = list[k];
+              err = errNone;
             } else {
-              // backward
-//debug(1, "XXX", "seek backward index=%d", *indexP);
-              if (*indexP == 0) {
-//debug(1, "XXX", "seek backward abort");
-                err = dmErrSeekFailed;
-                break;
-              }
-              *indexP = *indexP - 1;
+              *indexP = db->numRecs-1;
+              err = dmErrIndexOutOfRange;
             }
-          }
           } else {
-            err = dmErrIndexOutOfRange;
+            // the offset-th record of the category at or before *indexP
+            k = StoCategoryRank(list, n, *indexP + 1);
+            if (k > offset) {
+              *indexP = list[k - 1 - offset];
+              err = errNone;
+            } else {
+              *indexP = 0;
+              err = dmErrSeekFailed;
+            }
           }
         } else {
-//debug(1, "XXX", "seek empty");
-          err = (direction == dmSeekForward) ? dmErrIndexOutOfRange : dmErrSeekFailed;
+          err = dmErrIndexOutOfRange;
         }
-        debug(DEBUG_TRACE, "STOR", "DmSeekRecordInCategory i=%u err=%d", *indexP, err);
+      } else {
+        err = (direction == dmSeekForward) ? dmErrIndexOutOfRange : dmErrSeekFailed;
       }
+      debug(DEBUG_TRACE, "STOR", "DmSeekRecordInCategory i=%u err=%d", *indexP, err);
+    }
   }
 
   StoCheckErr(err);
@@ -3810,23 +5663,57 @@ static Boolean StoValidTypeCreator(UInt8 *buf) {
   return i > 0;
 }
 
-Err DmCreateDatabaseFromImage(MemPtr bufferP) {
+// Creates a database from a PRC/PDB image of total bytes. Elements are
+// written straight from the image, without inflating a copy of each one in
+// the heap, and the record index is written once at the end.
+// Keeps a resource database image as a single file in the database directory
+// and switches the database to the image backend.
+
+static int StoWriteImage(storage_t *sto, storage_db_t *db, UInt8 *database, UInt32 total) {
+  char buf[VFS_PATH];
+  vfs_file_t *f;
+  int r = -1;
+
+  storage_db_name(sto, db, STO_FILE_IMAGE, 0, 0, 0, 0, buf);
+  if ((f = StoVfsOpen(sto->session, buf, VFS_WRITE | VFS_TRUNC)) != NULL) {
+    r = (vfs_write(f, database, total) == total && vfs_sync(f) == 0) ? 0 : -1;
+    vfs_close(f);
+  }
+
+  if (r == 0) {
+    if (db->ftype == STO_TYPE_RES) {
+      rescache_invalidate(stoCache, db->name);
+    }
+    db->modNum++;
+    StoCloseElements(sto, db);
+    db->backend = STO_BACKEND_IMAGE;
+    if (StoOpenElements(sto, db) != 0 || db->image == NULL) {
+      debug(DEBUG_ERROR, "STOR", "DmCreateDatabaseFromImage \"%s\" image could not be opened", db->name);
+      r = -1;
+    }
+  }
+
+  return r;
+}
+
+static Err StoCreateDatabaseFromImage(UInt8 *database, UInt32 total) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
+  storage_handle_t *h;
   char name[dmDBNameLength], st[8];
-  UInt16 j, attr, version, numRecs, index, appInfoSize, sortInfoSize;
+  UInt16 j, attr, version, numRecs, appInfoSize, sortInfoSize;
   UInt32 i, creationDate, modificationDate, lastBackupDate, modificationNumber, appInfo, sortInfo, type, creator, uniqueIDSeed, size, dummy32;
   UInt32 *offsets, *resTypes, firstOffset;
   UInt16 *resIDs;
-  UInt8 *database, recAttr, dummy8;
+  UInt8 recAttr, dummy8;
   MemHandle appInfoH, sortInfoH;
   void *appInfoP, *sortInfoP;
   DmOpenType *dbRef;
   LocalID dbID;
+  Boolean image;
   Err err = dmErrInvalidParam;
 
-  if (bufferP) {
-    database = (UInt8 *)bufferP;
+  if (database && total >= STO_IMAGE_HEADER) {
     if (!StoValidName(database)) {
       debug(DEBUG_ERROR, "STOR", "DmCreateDatabaseFromImage invalid name \"%.*s\"", dmDBNameLength, database);
       return err;
@@ -3860,63 +5747,98 @@ Err DmCreateDatabaseFromImage(MemPtr bufferP) {
     i += get2b(&numRecs, database, i);  // numberOfRecords
     debug(DEBUG_INFO, "STOR", "DmCreateDatabaseFromImage \"%s\" with %d recs", name, numRecs);
 
+    if (i + numRecs * ((attr & dmHdrAttrResDB) ? 10 : 8) > total) {
+      debug(DEBUG_ERROR, "STOR", "DmCreateDatabaseFromImage \"%s\" truncated header", name);
+      return dmErrCorruptDatabase;
+    }
+
     if (DmCreateDatabaseEx(name, creator, type, attr, uniqueIDSeed, true) == errNone) {
       if ((dbID = DmFindDatabase(0, name)) != 0) {
-        DmSetDatabaseInfo(0, dbID, NULL, NULL, &version, &creationDate, &modificationDate, &lastBackupDate, NULL, NULL, NULL, NULL, NULL);
         if ((dbRef = DmOpenDatabase(0, dbID, dmModeWrite)) != NULL) {
           db = (storage_db_t *)(sto->base + dbID);
+          // the header is written once, when the database is closed
+          db->version = version;
+          db->crDate = creationDate;
+          db->modDate = modificationDate;
+          db->bckDate = lastBackupDate;
+          firstOffset = 0;
+
           if (numRecs > 0) {
-            resTypes = MemPtrNew(numRecs * sizeof(UInt32));
-            resIDs = MemPtrNew(numRecs * sizeof(UInt16));
-            offsets = MemPtrNew(numRecs * sizeof(UInt32));
-
-            if (attr & dmHdrAttrResDB) {
-              for (j = 0; j < numRecs; j++) {
-                i += get4b(&resTypes[j], database, i);
-                i += get2b(&resIDs[j], database, i);
-                i += get4b(&offsets[j], database, i);
-              }
-              i = firstOffset = offsets[0];
-              for (j = 0; j < numRecs; j++) {
-                size = (j < numRecs-1) ? offsets[j+1] - offsets[j] : MemPtrSize(bufferP) - offsets[j];
-                pumpkin_id2s(resTypes[j], st);
-                debug(DEBUG_INFO, "STOR", "DmCreateDatabaseFromImage res %d type '%s' id %d size %u", j, st, resIDs[j], size);
-                DmNewResourceEx(dbRef, resTypes[j], resIDs[j], size, &database[offsets[j]]);
-              }
-              err = errNone;
-            } else {
-              for (j = 0; j < numRecs; j++) {
-                i += get4b(&offsets[j], database, i);
-                i += get1(&recAttr, database, i);
-                i += get1(&dummy8, database, i);
-                //uniqueID = ((UInt32)dummy8) << 16;
-                i += get1(&dummy8, database, i);
-                //uniqueID |= ((UInt32)dummy8) << 8;
-                i += get1(&dummy8, database, i);
-                //uniqueID |= ((UInt32)dummy8);
-              }
-              i = firstOffset = offsets[0];
-              for (j = 0; j < numRecs; j++) {
-                size = (j < numRecs-1) ? offsets[j+1] - offsets[j] : MemPtrSize(bufferP) - offsets[j];
-                index = dmMaxRecordIndex;
-                DmNewRecordEx(dbRef, &index, size, &database[offsets[j]]);
+            resTypes = xcalloc(numRecs, sizeof(UInt32));
+            resIDs = xcalloc(numRecs, sizeof(UInt16));
+            offsets = xcalloc(numRecs + 1, sizeof(UInt32));
+
+            if (resTypes && resIDs && offsets) {
+              if (attr & dmHdrAttrResDB) {
+                for (j = 0; j < numRecs; j++) {
+                  i += get4b(&resTypes[j], database, i);
+                  i += get2b(&resIDs[j], database, i);
+                  i += get4b(&offsets[j], database, i);
+                }
+              } else {
+                for (j = 0; j < numRecs; j++) {
+                  i += get4b(&offsets[j], database, i);
+                  i += get1(&recAttr, database, i);
+                  i += get1(&dummy8, database, i);
+                  //uniqueID = ((UInt32)dummy8) << 16;
+                  i += get1(&dummy8, database, i);
+                  //uniqueID |= ((UInt32)dummy8) << 8;
+                  i += get1(&dummy8, database, i);
+                  //uniqueID |= ((UInt32)dummy8);
+                }
               }
-              if (StoWriteIndex(sto, db) == 0) {
+              offsets[numRecs] = total;
+              firstOffset = offsets[0];
+
+              if (StoLockDatabase(sto, db, true) == 0) {
+                StoBeginWrite(sto);
                 err = errNone;
+                // resources of an image kept as is are only indexed here, their contents stay in the image
+                image = stoImages && (attr & dmHdrAttrResDB);
+                for (j = 0; j < numRecs && err == errNone; j++) {
+                  if (offsets[j] > offsets[j+1] || offsets[j+1] > total) {
+                    debug(DEBUG_ERROR, "STOR", "DmCreateDatabaseFromImage \"%s\" element %d out of bounds", name, j);
+                    err = dmErrCorruptDatabase;
+                    break;
+                  }
+                  size = offsets[j+1] - offsets[j];
+                  if (attr & dmHdrAttrResDB) {
+                    pumpkin_id2s(resTypes[j], st);
+                    debug(DEBUG_INFO, "STOR", "DmCreateDatabaseFromImage res %d type '%s' id %d size %u", j, st, resIDs[j], size);
+                    h = StoAddRes(sto, db, resTypes[j], resIDs[j], size);
+                  } else if (size > 0) {
+                    h = StoAddRec(sto, db, db->uniqueIDSeed++, 0, size);
+                  } else {
+                    continue;
+                  }
+                  if (h == NULL || (!image && StoPutElement(sto, db, h, &database[offsets[j]], size) == -1)) {
+                    err = dmErrMemError;
+                  }
+                }
+                if (image && err == errNone && StoWriteImage(sto, db, database, total) != 0) {
+                  err = dmErrMemError;
+                }
+                db->modDate = TimGetSeconds();
+                if (!(attr & dmHdrAttrResDB)) {
+                  if (err == errNone && StoWriteIndex(sto, db) != 0) {
+                    err = dmErrMemError;
+                  }
+                }
+                StoEndWrite(sto);
+                StoUnlockDatabase(sto, db);
               }
             }
 
-            MemPtrFree(resTypes);
-            MemPtrFree(resIDs);
-            MemPtrFree(offsets);
+            if (resTypes) xfree(resTypes);
+            if (resIDs) xfree(resIDs);
+            if (offsets) xfree(offsets);
           } else {
-            firstOffset = 0;
             err = errNone;
           }
 
           appInfoSize = 0;
           sortInfoSize = 0;
-          if (firstOffset == 0) firstOffset = MemPtrSize(bufferP);
+          if (firstOffset == 0) firstOffset = total;
 
           if (appInfo) {
             if (sortInfo) {
@@ -3929,7 +5851,7 @@ Err DmCreateDatabaseFromImage(MemPtr bufferP) {
             sortInfoSize = firstOffset - sortInfo;
           }
 
-          if (appInfoSize) {
+          if (appInfoSize && appInfo + appInfoSize <= total) {
             debug(DEBUG_INFO, "STOR", "DmCreateDatabaseFromImage appInfo %d bytes", appInfoSize);
             if ((appInfoH = MemHandleNew(appInfoSize)) != NULL) {
               if ((appInfoP = MemHandleLock(appInfoH)) != NULL) {
@@ -3940,7 +5862,7 @@ Err DmCreateDatabaseFromImage(MemPtr bufferP) {
               }
             }
           }
-          if (sortInfoSize) {
+          if (sortInfoSize && sortInfo + sortInfoSize <= total) {
             debug(DEBUG_INFO, "STOR", "DmCreateDatabaseFromImage sortInfo %d bytes", sortInfoSize);
             if ((sortInfoH = MemHandleNew(sortInfoSize)) != NULL) {
               if ((sortInfoP = MemHandleLock(sortInfoH)) != NULL) {
@@ -3961,6 +5883,10 @@ Err DmCreateDatabaseFromImage(MemPtr bufferP) {
   return err;
 }
 
+Err DmCreateDatabaseFromImage(MemPtr bufferP) {
+  return bufferP ? StoCreateDatabaseFromImage((UInt8 *)bufferP, MemPtrSize(bufferP)) : dmErrInvalidParam;
+}
+
 int StoDeleteFile(char *name) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   return StoVfsUnlink(sto->session, name);
@@ -4010,53 +5936,73 @@ static void StoRegistryCreate(AppRegistryType *ar, UInt32 creator) {
   AppRegistrySet(ar, creator, appRegistryPosition, 0, &p);
 }
 
-int StoDeployFile(char *path, AppRegistryType *ar) {
-  storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
+// Loads a whole PRC/PDB file in host memory. Called from the deploy workers too,
+// so it only uses the vfs layer.
+static uint8_t *StoLoadImage(vfs_session_t *session, char *path, uint32_t *size) {
   vfs_file_t *f;
+  uint8_t *p = NULL;
+
+  if ((f = StoVfsOpen(session, path, VFS_READ)) != NULL) {
+    *size = vfs_seek(f, 0, 1);
+    if (*size > STO_IMAGE_HEADER && *size != 0xfffffffful) {
+      vfs_seek(f, 0, 0);
+      if ((p = xcalloc(1, *size)) != NULL && vfs_read(f, p, *size) != *size) {
+        xfree(p);
+        p = NULL;
+      }
+    }
+    vfs_close(f);
+  }
+
+  return p;
+}
+
+static int StoDeployImage(uint8_t *p, uint32_t size, char *source, AppRegistryType *ar) {
   LocalID dbID;
   UInt32 type, creator;
-  char name[dmDBNameLength], stype[8], screator[8], *ext;
-  uint32_t size, hsize;
-  uint8_t *p;
+  char name[dmDBNameLength], stype[8], screator[8];
   int r = -1;
 
-  if (path && (ext = getext(path)) != NULL && (!sys_strcasecmp(ext, "prc") || !sys_strcasecmp(ext, "pdb"))) {
-    if ((f = StoVfsOpen(sto->session, path, VFS_READ)) != NULL) {
-      size = vfs_seek(f, 0, 1);
-      hsize = 78;
-      if (size > hsize && size != 0xfffffffful) {
-        vfs_seek(f, 0, 0);
-        if ((p = MemPtrNew(size)) != NULL) {
-          if (vfs_read(f, p, hsize) == hsize) {
-            xmemset(name, 0, dmDBNameLength);
-            xmemcpy(name, p, dmDBNameLength - 1);
-            if (name[0]) {
-              if ((dbID = DmFindDatabase(0, name)) != 0) {
-                debug(DEBUG_INFO, "STOR", "deleting old version of \"%s\"", name);
-                DmDeleteDatabase(0, dbID);
-              }
-              if (vfs_read(f, p + hsize, size - hsize) == size - hsize) {
-                get4b(&type, p, dmDBNameLength + 28);
-                get4b(&creator, p, dmDBNameLength + 32);
-                pumpkin_id2s(type, stype);
-                pumpkin_id2s(creator, screator);
-                debug(DEBUG_INFO, "STOR", "installing new version of \"%s\" type '%s' creator '%s' from \"%s\"", name, stype, screator, path);
-                if (DmCreateDatabaseFromImage(p) == errNone) {
-                  debug(DEBUG_INFO, "STOR", "installed \"%s\"", name);
-                  if (type == sysFileTApplication) {
-                    StoRegistryCreate(ar, creator);
-                  }
-                  r = 0;
-                } else {
-                    debug(DEBUG_ERROR, "STOR", "error installing \"%s\"", name);
-                }
-              }
-            }
-          }
-          MemPtrFree(p);
+  if (p && size > STO_IMAGE_HEADER) {
+    xmemset(name, 0, dmDBNameLength);
+    xmemcpy(name, p, dmDBNameLength - 1);
+    if (name[0]) {
+      if ((dbID = DmFindDatabase(0, name)) != 0) {
+        debug(DEBUG_INFO, "STOR", "deleting old version of \"%s\"", name);
+        DmDeleteDatabase(0, dbID);
+      }
+      get4b(&type, p, dmDBNameLength + 28);
+      get4b(&creator, p, dmDBNameLength + 32);
+      pumpkin_id2s(type, stype);
+      pumpkin_id2s(creator, screator);
+      debug(DEBUG_INFO, "STOR", "installing new version of \"%s\" type '%s' creator '%s' from %s", name, stype, screator, source);
+
+      if (StoCreateDatabaseFromImage(p, size) == errNone) {
+        debug(DEBUG_INFO, "STOR", "installed \"%s\"", name);
+        if (type == sysFileTApplication) {
+          StoRegistryCreate(ar, creator);
         }
+        r = 0;
+      } else {
+        debug(DEBUG_ERROR, "STOR", "error installing \"%s\"", name);
       }
-      vfs_close(f);
+    }
+  }
+
+  return r;
+}
+
+int StoDeployFile(char *path, AppRegistryType *ar) {
+  storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
+  uint32_t size;
+  uint8_t *p;
+  char *ext;
+  int r = -1;
+
+  if (path && (ext = getext(path)) != NULL && (!sys_strcasecmp(ext, "prc") || !sys_strcasecmp(ext, "pdb"))) {
+    if ((p = StoLoadImage(sto->session, path, &size)) != NULL) {
+      r = StoDeployImage(p, size, path, ar);
+      xfree(p);
     }
   }
 
@@ -4065,40 +6011,11 @@ int StoDeployFile(char *path, AppRegistryType *ar) {
 
 int StoDeployFileFromImage(uint8_t *p, uint32_t size, AppRegistryType *ar) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
-  LocalID dbID;
-  UInt32 type, creator;
-  char name[dmDBNameLength], stype[8], screator[8];
-  uint32_t hsize;
   int r = -1;
 
   if (sto) {
-    if (mutex_lock(sto->mutex) == 0) {
-      hsize = 78;
-      if (size > hsize) {
-        xmemset(name, 0, dmDBNameLength);
-        xmemcpy(name, p, dmDBNameLength - 1);
-        if (name[0]) {
-          if ((dbID = DmFindDatabase(0, name)) != 0) {
-            debug(DEBUG_INFO, "STOR", "deleting old version of \"%s\"", name);
-            DmDeleteDatabase(0, dbID);
-          }
-          get4b(&type, p, dmDBNameLength + 28);
-          get4b(&creator, p, dmDBNameLength + 32);
-          pumpkin_id2s(type, stype);
-          pumpkin_id2s(creator, screator);
-          debug(DEBUG_INFO, "STOR", "installing new version of \"%s\" type '%s' creator '%s' from memory", name, stype, screator);
-
-          if (DmCreateDatabaseFromImage(p) == errNone) {
-            debug(DEBUG_INFO, "STOR", "installed \"%s\"", name);
-            if (type == sysFileTApplication) {
-              StoRegistryCreate(ar, creator);
-            }
-            r = 0;
-          } else {
-            debug(DEBUG_ERROR, "STOR", "error installing \"%s\"", name);
-          }
-        }
-      }
+    if (StoLockStorage(sto) == 0) {
+      r = StoDeployImage(p, size, "memory", ar);
       mutex_unlock(sto->mutex);
     }
   }
@@ -4106,35 +6023,151 @@ int StoDeployFileFromImage(uint8_t *p, uint32_t size, AppRegistryType *ar) {
   return r;
 }
 
+// StoDeployFiles installs the images one at a time, because databases are
+// created in the storage of the calling task, but the files are read ahead
+// by a few worker threads, up to STO_DEPLOY_AHEAD images past the current one.
+
+typedef struct {
+  char path[VFS_PATH];
+  uint32_t base;
+  uint8_t *buf;
+  uint32_t size;
+  int ready;
+} storage_deploy_file_t;
+
+typedef struct {
+  vfs_session_t *session;
+  mutex_t *mutex;
+  cond_t *cond;
+  storage_deploy_file_t *files;
+  uint32_t num, next, consumed, running;
+} storage_deploy_t;
+
+static int StoDeployAction(void *arg) {
+  storage_deploy_t *d = (storage_deploy_t *)arg;
+  storage_deploy_file_t *file;
+  uint32_t size = 0;
+  uint8_t *buf;
+
+  if (mutex_lock(d->mutex) == 0) {
+    for (;;) {
+      while (d->next < d->num && d->next >= d->consumed + STO_DEPLOY_AHEAD) {
+        cond_wait(d->cond, d->mutex);
+      }
+      if (d->next >= d->num) break;
+      file = &d->files[d->next++];
+      mutex_unlock(d->mutex);
+      buf = StoLoadImage(d->session, file->path, &size);
+      mutex_lock(d->mutex);
+      file->buf = buf;
+      file->size = size;
+      file->ready = 1;
+      cond_broadcast(d->cond);
+    }
+    d->running--;
+    cond_broadcast(d->cond);
+    mutex_unlock(d->mutex);
+  }
+
+  return 0;
+}
+
+// waits for image i, loading it here if no worker is left to do it
+static storage_deploy_file_t *StoDeployNext(storage_deploy_t *d, uint32_t i) {
+  storage_deploy_file_t *file = &d->files[i];
+
+  if (d->mutex && mutex_lock(d->mutex) == 0) {
+    while (!file->ready && d->running > 0) {
+      cond_wait(d->cond, d->mutex);
+    }
+    if (!file->ready && d->next <= i) {
+      d->next = i + 1;
+    }
+    d->consumed = i + 1;
+    cond_broadcast(d->cond);
+    mutex_unlock(d->mutex);
+  }
+
+  if (!file->ready) {
+    file->buf = StoLoadImage(d->session, file->path, &file->size);
+    file->ready = 1;
+  }
+
+  return file;
+}
+
+static void StoDeployStart(storage_deploy_t *d) {
+  uint32_t i;
+
+  d->mutex = mutex_create("deploy");
+  d->cond = cond_create("deploy");
+  if (d->mutex == NULL || d->cond == NULL) {
+    if (d->mutex) mutex_destroy(d->mutex);
+    if (d->cond) cond_destroy(d->cond);
+    d->mutex = NULL;
+    d->cond = NULL;
+    return;
+  }
+
+  for (i = 0; i < STO_DEPLOY_WORKERS && i < d->num; i++) {
+    mutex_lock(d->mutex);
+    d->running++;
+    mutex_unlock(d->mutex);
+    if (thread_begin("DEPLOY", StoDeployAction, d) == -1) {
+      mutex_lock(d->mutex);
+      d->running--;
+      mutex_unlock(d->mutex);
+      break;
+    }
+  }
+}
+
+static void StoDeployFinish(storage_deploy_t *d) {
+  if (d->mutex) {
+    mutex_lock(d->mutex);
+    d->next = d->num;
+    cond_broadcast(d->cond);
+    while (d->running > 0) {
+      cond_wait(d->cond, d->mutex);
+    }
+    mutex_unlock(d->mutex);
+    mutex_destroy(d->mutex);
+    cond_destroy(d->cond);
+  }
+}
+
 int StoDeployFiles(char *path, AppRegistryType *ar) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
+  storage_deploy_t d;
+  storage_deploy_file_t *file, *files;
   vfs_dir_t *dir;
   vfs_ent_t *ent;
   char *ext, buf[VFS_PATH];
-  int spawner, rr, r = -1;
+  uint32_t i, total;
+  int spawner, r = -1;
 
   if (path) {
     if ((dir = StoVfsOpendir(sto->session, path)) != NULL) {
       spawner = pumpkin_get_spawner() == thread_get_handle();
+      xmemset(&d, 0, sizeof(storage_deploy_t));
+      d.session = sto->session;
+      total = 0;
 
-      for (r = 0; r == 0;) {
+      for (;;) {
         if ((ent = StoVfsReaddir(dir)) == NULL) break;
         if (ent->type != VFS_FILE) continue;
         ext = getext(ent->name);
         if (!sys_strcasecmp(ext, "prc") || !sys_strcasecmp(ext, "pdb")) {
-          xmemset(buf, 0, sizeof(buf));
-          sys_snprintf(buf, sizeof(buf)-1, "%s/%s", path, ent->name);
-          rr = StoDeployFile(buf, ar);
-          StoVfsUnlink(sto->session, buf);
-          if (rr == 0) {
-            r = 0;
-          } else {
-            sys_snprintf(buf, sizeof(buf)-1, "Error deploying \"%s\"", ent->name);
-            debug(DEBUG_ERROR, "STOR", "StoDeployFiles: %s", buf);
-            if (!spawner) {
-              pumpkin_error_dialog(buf);
-            }
+          if (d.num == total) {
+            if ((files = xrealloc(d.files, (total + 64) * sizeof(storage_deploy_file_t))) == NULL) break;
+            d.files = files;
+            total += 64;
           }
+          file = &d.files[d.num++];
+          xmemset(file, 0, sizeof(storage_deploy_file_t));
+          sys_snprintf(file->path, sizeof(file->path)-1, "%s/", path);
+          file->base = sys_strlen(file->path);
+          sys_strncat(file->path, ent->name, sizeof(file->path) - file->base - 1);
         } else {
           sys_snprintf(buf, sizeof(buf)-1, "%s/%s", path, ent->name);
           StoVfsUnlink(sto->session, buf);
@@ -4146,6 +6179,27 @@ int StoDeployFiles(char *path, AppRegistryType *ar) {
         }
       }
       vfs_closedir(dir);
+
+      StoDeployStart(&d);
+      for (i = 0; i < d.num; i++) {
+        file = StoDeployNext(&d, i);
+        if (StoDeployImage(file->buf, file->size, file->path, ar) != 0) {
+          sys_snprintf(buf, sizeof(buf)-1, "Error deploying \"%s\"", &file->path[file->base]);
+          debug(DEBUG_ERROR, "STOR", "StoDeployFiles: %s", buf);
+          if (!spawner) {
+            pumpkin_error_dialog(buf);
+          }
+        }
+        if (file->buf) {
+          xfree(file->buf);
+          file->buf = NULL;
+        }
+        StoVfsUnlink(sto->session, file->path);
+      }
+      StoDeployFinish(&d);
+
+      if (d.files) xfree(d.files);
+      r = 0;
     }
   }
 
@@ -4229,14 +6283,16 @@ Boolean StoPtrDecoded(void *p) {
   return r;
 }
 
-static void StoDecodeResource(storage_handle_t *res) {
+static void StoDecodeResource(storage_db_t *db, storage_handle_t *res) {
   UInt8 *aux;
   uint32_t dsize;
+  int64_t t;
   char st[8];
   void *p;
   int i;
 
   if (res && !res->d.res.decoded) {
+    t = sys_get_clock();
     pumpkin_id2s(res->d.res.type, st);
     res->d.res.destructor = NULL;
 
@@ -4306,6 +6362,11 @@ static void StoDecodeResource(storage_handle_t *res) {
         }
         break;
     }
+
+    // only resources that have a decoded form are counted
+    if (res->d.res.decoded) {
+      dbstats_count(stoStats, db->stats, DBSTATS_DECODE, sys_get_clock() - t);
+    }
   }
 }
 
@@ -5043,16 +7104,16 @@ Int32 StoFileSeek(DmOpenRef dbP, UInt32 offset, Int32 whence) {
   Int32 r = -1;
 
   if (dbP) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, false) == 0) {
         if (db->ftype == STO_TYPE_FILE && db->f) {
           r = vfs_seek(db->f, offset, whence);
           if (r != -1) err = errNone;
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -5068,16 +7129,16 @@ Int32 StoFileRead(DmOpenRef dbP, void *p, Int32 size) {
   Int32 r = -1;
 
   if (dbP && p && size) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if (dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, false) == 0) {
         if (db->ftype == STO_TYPE_FILE && db->f) {
           r = vfs_read(db->f, (uint8_t *)p, size);
           if (r != -1) err = errNone;
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -5093,16 +7154,16 @@ Int32 StoFileWrite(DmOpenRef dbP, void *p, Int32 size) {
   Int32 r = -1;
 
   if (dbP && p && size) {
-    if (mutex_lock(sto->mutex) == 0) {
-      dbRef = (DmOpenType *)dbP;
-      if ((dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
-        db = (storage_db_t *)(sto->base + dbRef->dbID);
+    dbRef = (DmOpenType *)dbP;
+    if ((dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
+      db = (storage_db_t *)(sto->base + dbRef->dbID);
+      if (StoLockDatabase(sto, db, true) == 0) {
         if (db->ftype == STO_TYPE_FILE && db->f) {
           r = vfs_write(db->f, (uint8_t *)p, size);
           if (r != -1) err = errNone;
         }
+        StoUnlockDatabase(sto, db);
       }
-      mutex_unlock(sto->mutex);
     }
   }
 
@@ -5110,71 +7171,66 @@ Int32 StoFileWrite(DmOpenRef dbP, void *p, Int32 size) {
   return r;
 }
 
-static int StoCompareHandle(const void *e1, const void *e2) {
+static int StoCompareKey(const void *e1, const void *e2) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
+  storage_sort_key_t *k1, *k2;
   storage_handle_t *h1, *h2;
   SortRecordInfoType r1, r2;
   UInt8 *b1, *b2;
   Boolean free1, free2;
-  vfs_file_t *f;
-  char buf[VFS_PATH];
   UInt8 *b;
   UInt32 a;
   int r = 0;
 
   if (e1 && e2 && (sto->comparF || sto->comparF68K)) {
-    h1 = *(storage_handle_t **)e1;
-    h2 = *(storage_handle_t **)e2;
-
-    b1 = h1->buf;
+    k1 = (storage_sort_key_t *)e1;
+    k2 = (storage_sort_key_t *)e2;
+    if (k1->key != k2->key) return k1->key < k2->key ? -1 : 1;
+    h1 = k1->h;
+    h2 = k2->h;
+
+    // the handles are only used when the snapshot in the arena is incomplete
+    b1 = k1->buf ? k1->buf : k1->size ? h1->buf : NULL;
     free1 = false;
-    if (b1 == NULL) {
-      if ((b1 = pumpkin_heap_alloc(h1->size, "TmpHandleBuf")) != NULL) {
-        storage_name(sto, sto->tmpDb->name, STO_FILE_ELEMENT, 0, 0, h1->d.rec.attr & ATTR_MASK, h1->d.rec.uniqueID, buf);
-        if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-          vfs_read(f, b1, h1->size);
-          vfs_close(f);
-        }
+    if (b1 == NULL && k1->size) {
+      if ((b1 = pumpkin_heap_alloc(k1->size, "TmpHandleBuf")) != NULL) {
+        StoReadElement(sto, sto->tmpDb, h1, b1, k1->size);
         free1 = true;
       }
     }
 
-    b2 = h2->buf;
+    b2 = k2->buf ? k2->buf : k2->size ? h2->buf : NULL;
     free2 = false;
-    if (b2 == NULL) {
-      if ((b2 = pumpkin_heap_alloc(h2->size, "TmpHandleBuf")) != NULL) {
-        storage_name(sto, sto->tmpDb->name, STO_FILE_ELEMENT, 0, 0, h2->d.rec.attr & ATTR_MASK, h2->d.rec.uniqueID, buf);
-        if ((f = StoVfsOpen(sto->session, buf, VFS_READ)) != NULL) {
-          vfs_read(f, b2, h2->size);
-          vfs_close(f);
-        }
+    if (b2 == NULL && k2->size) {
+      if ((b2 = pumpkin_heap_alloc(k2->size, "TmpHandleBuf")) != NULL) {
+        StoReadElement(sto, sto->tmpDb, h2, b2, k2->size);
         free2 = true;
       }
     }
 
     if (sto->comparF) {
-      r1.attributes = h1->d.rec.attr;
-      r1.uniqueID[0] = (h1->d.rec.uniqueID >> 16) & 0xFF;
-      r1.uniqueID[1] = (h1->d.rec.uniqueID >>  8) & 0xFF;
-      r1.uniqueID[2] = (h1->d.rec.uniqueID >>  0) & 0xFF;
+      r1.attributes = k1->attr;
+      r1.uniqueID[0] = (k1->uniqueID >> 16) & 0xFF;
+      r1.uniqueID[1] = (k1->uniqueID >>  8) & 0xFF;
+      r1.uniqueID[2] = (k1->uniqueID >>  0) & 0xFF;
 
-      r2.attributes = h2->d.rec.attr;
-      r2.uniqueID[0] = (h2->d.rec.uniqueID >> 16) & 0xFF;
-      r2.uniqueID[1] = (h2->d.rec.uniqueID >>  8) & 0xFF;
-      r2.uniqueID[2] = (h2->d.rec.uniqueID >>  0) & 0xFF;
+      r2.attributes = k2->attr;
+      r2.uniqueID[0] = (k2->uniqueID >> 16) & 0xFF;
+      r2.uniqueID[1] = (k2->uniqueID >>  8) & 0xFF;
+      r2.uniqueID[2] = (k2->uniqueID >>  0) & 0xFF;
 
       r = sto->comparF(b1, b2, sto->other, &r1, &r2, sto->appInfoH);
 
     } else if (sto->comparF68K) {
-      sto->recInfo[0] = h1->d.rec.attr;
-      sto->recInfo[1] = (h1->d.rec.uniqueID >> 16) & 0xFF;
-      sto->recInfo[2] = (h1->d.rec.uniqueID >>  8) & 0xFF;
-      sto->recInfo[3] = (h1->d.rec.uniqueID >>  0) & 0xFF;
+      sto->recInfo[0] = k1->attr;
+      sto->recInfo[1] = (k1->uniqueID >> 16) & 0xFF;
+      sto->recInfo[2] = (k1->uniqueID >>  8) & 0xFF;
+      sto->recInfo[3] = (k1->uniqueID >>  0) & 0xFF;
 
-      sto->recInfo[4] = h2->d.rec.attr;
-      sto->recInfo[5] = (h2->d.rec.uniqueID >> 16) & 0xFF;
-      sto->recInfo[6] = (h2->d.rec.uniqueID >>  8) & 0xFF;
-      sto->recInfo[7] = (h2->d.rec.uniqueID >>  0) & 0xFF;
+      sto->recInfo[4] = k2->attr;
+      sto->recInfo[5] = (k2->uniqueID >> 16) & 0xFF;
+      sto->recInfo[6] = (k2->uniqueID >>  8) & 0xFF;
+      sto->recInfo[7] = (k2->uniqueID >>  0) & 0xFF;
 
       b = sto->base;
       a = sto->appInfoH ? (UInt8 *)sto->appInfoH - b : 0;
@@ -5188,22 +7244,152 @@ static int StoCompareHandle(const void *e1, const void *e2) {
   return r;
 }
 
+// Copy the contents of the records into a single arena, so that comparing two
+// records neither reads them from storage again nor looks at their handles.
+// Records whose sort key is not shared with another one are not needed.
+// *complete is cleared when some records did not fit in STO_SORT_ARENA,
+// those are then read or taken from their handle on each comparison.
+static uint8_t *StoSortArena(storage_t *sto, storage_db_t *db, storage_sort_key_t *keys, Boolean *complete) {
+  storage_handle_t *h;
+  uint32_t i, size;
+  uint8_t *arena;
+
+  *complete = true;
+  for (i = 0, size = 0; i < db->numRecs; i++) {
+    if (keys[i].size && keys[i].tie) {
+      if (size + keys[i].size <= STO_SORT_ARENA) {
+        size += keys[i].size;
+      } else {
+        *complete = false;
+      }
+    }
+  }
+  if (size == 0) return NULL;
+
+  if ((arena = pumpkin_heap_alloc(size, "SortArena")) != NULL) {
+    for (i = 0, size = 0; i < db->numRecs; i++) {
+      h = keys[i].h;
+      if (keys[i].size && keys[i].tie && size + keys[i].size <= STO_SORT_ARENA) {
+        if (h->buf) {
+          xmemcpy(arena + size, h->buf, keys[i].size);
+          keys[i].buf = arena + size;
+        } else if (StoReadElement(sto, db, h, arena + size, keys[i].size) == keys[i].size) {
+          keys[i].buf = arena + size;
+        } else {
+          *complete = false;
+        }
+        size += keys[i].size;
+      }
+    }
+    debug(DEBUG_TRACE, "STOR", "StoSort loaded %u bytes of \"%s\" records", size, db->name);
+  } else {
+    *complete = false;
+  }
+
+  return arena;
+}
+
+static int StoCompareSortKey(const void *e1, const void *e2) {
+  const storage_sort_key_t *k1 = (const storage_sort_key_t *)e1;
+  const storage_sort_key_t *k2 = (const storage_sort_key_t *)e2;
+
+  if (k1->key != k2->key) return k1->key < k2->key ? -1 : 1;
+
+  return 0;
+}
+
+// Orders the keys by sort key alone and flags the ones equal to a neighbour,
+// only those have to be compared by their contents.
+static void StoSortTies(storage_sort_key_t *keys, uint32_t n) {
+  uint32_t i;
+
+  sys_qsort(keys, n, sizeof(storage_sort_key_t), StoCompareSortKey);
+  for (i = 0; i < n; i++) {
+    keys[i].tie = (i > 0 && keys[i-1].key == keys[i].key) || (i < n-1 && keys[i+1].key == keys[i].key);
+  }
+}
+
+// Sorts the records of db, which must be locked for writing. When every record
+// that is compared fits in the arena the lock is released while the comparison
+// callbacks run, so they may use other databases freely. Returns 1, leaving the
+// records as they were, if a record was added, removed or moved meanwhile.
+static int StoSortRecords(storage_t *sto, storage_db_t *db, Boolean unlock) {
+  storage_sort_key_t *keys;
+  storage_handle_t **orig;
+  uint8_t *arena;
+  Boolean complete;
+  UInt32 i, n;
+  int r = -1;
+
+  n = db->numRecs;
+  keys = xcalloc(n, sizeof(storage_sort_key_t));
+  orig = xcalloc(n, sizeof(storage_handle_t *));
+
+  // every record takes part, so all of them get their handle before the snapshot
+  for (i = 0; i < n && keys && orig; i++) {
+    if (StoElement(db, i) == NULL) break;
+  }
+
+  if (keys && orig && i == n) {
+    xmemcpy(orig, db->elements, n * sizeof(storage_handle_t *));
+    for (i = 0; i < n; i++) {
+      keys[i].h = db->elements[i];
+      keys[i].key = StoRecordKey(db, keys[i].h);
+      keys[i].tie = 1;
+      keys[i].size = keys[i].h->size;
+      keys[i].uniqueID = keys[i].h->d.rec.uniqueID;
+      keys[i].attr = keys[i].h->d.rec.attr;
+    }
+    if (db->keyMode) {
+      StoSortTies(keys, n);
+    }
+    arena = StoSortArena(sto, db, keys, &complete);
+
+    if (unlock && complete) {
+      StoUnlockDatabase(sto, db);
+      sys_qsort(keys, n, sizeof(storage_sort_key_t), StoCompareKey);
+      StoLockDatabase(sto, db, true);
+      r = (db->numRecs != n || sys_memcmp(db->elements, orig, n * sizeof(storage_handle_t *))) ? 1 : 0;
+    } else {
+      // records are read from storage during the comparisons, which needs the lock
+      sys_qsort(keys, n, sizeof(storage_sort_key_t), StoCompareKey);
+      r = 0;
+    }
+
+    if (r == 0) {
+      for (i = 0; i < n; i++) {
+        db->elements[i] = keys[i].h;
+      }
+      StoHashInvalidate(db);
+      StoCategoryInvalidate(db);
+      StoWriteIndex(sto, db);
+    }
+    if (arena) pumpkin_heap_free(arena, "SortArena");
+  }
+
+  if (orig) xfree(orig);
+  if (keys) xfree(keys);
+
+  return r;
+}
+
 static Err StoSort(DmOpenRef dbP, DmComparF *comparF, UInt32 comparF68K, Int16 other) {
   storage_t *sto = (storage_t *)pumpkin_get_local_storage(sto_key);
   storage_db_t *db;
   DmOpenType *dbRef;
   UInt32 i;
   Boolean locked;
+  int r;
   Err err = dmErrInvalidParam;
 
   if (dbP && (comparF || comparF68K)) {
     dbRef = (DmOpenType *)dbP;
     if ((dbRef->mode & dmModeWrite) && dbRef->dbID < (sto->size - sizeof(storage_db_t))) {
       db = (storage_db_t *)(sto->base + dbRef->dbID);
-      if (db->ftype == STO_TYPE_REC) {
+      if (db->ftype == STO_TYPE_REC && StoLockDatabase(sto, db, true) == 0) {
         if (db->numRecs > 1) {
           for (i = 0, locked = false; i < db->numRecs && !locked; i++) {
-            if (db->elements[i]->lockCount > 0) locked = true;
+            if (!STO_LAZY(db->elements[i]) && db->elements[i]->lockCount > 0) locked = true;
           }
           if (!locked) {
             sto->comparF = comparF;
@@ -5212,14 +7398,16 @@ static Err StoSort(DmOpenRef dbP, DmComparF *comparF, UInt32 comparF68K, Int16 o
             sto->appInfoH = db->appInfoID ? MemLocalIDToHandle(db->appInfoID) : NULL;
             sto->tmpDb = db;
             debug(DEBUG_INFO, "STOR", "StoSort sorting database \"%s\" with %d records (%s)", db->name, db->numRecs, comparF ? "native" : "68K");
-            sys_qsort(db->elements, db->numRecs, sizeof(storage_handle_t *), StoCompareHandle);
+            if ((r = StoSortRecords(sto, db, true)) == 1) {
+              debug(DEBUG_INFO, "STOR", "StoSort database \"%s\" changed while sorting, sorting again", db->name);
+              r = StoSortRecords(sto, db, false);
+            }
+            err = r == 0 ? errNone : dmErrMemError;
             sto->tmpDb = NULL;
             sto->comparF = NULL;
             sto->comparF68K = 0;
             sto->other = 0;
             sto->appInfoH = NULL;
-            StoWriteIndex(sto, db);
-            err = errNone;
           } else {
             debug(DEBUG_ERROR, "STOR", "StoSort database \"%s\" at least one record locked", db->name);
           }
@@ -5227,6 +7415,7 @@ static Err StoSort(DmOpenRef dbP, DmComparF *comparF, UInt32 comparF68K, Int16 o
           debug(DEBUG_INFO, "STOR", "StoSort database \"%s\" has %d record", db->name, db->numRecs);
           err = errNone;
         }
+        StoUnlockDatabase(sto, db);
       }
     }
   }
@@ -5294,7 +7483,7 @@ static Boolean StoCreateDataBaseList(UInt32 type, UInt32 creator, UInt16 *dbCoun
   buf = (UInt8 *)list;
   offset = 0;
 
-  for (db = sto->list; db; db = db->next) {
+  for (db = StoFirstByTypeCreator(sto, type, creator); db; db = StoNextByTypeCreator(db, type, creator)) {
     if ((type != 0 && type != db->type) || (creator != 0 && creator != db->creator) || db->name[0] == 0) {
       continue;
     }
@@ -1,9 +1,26 @@
 #ifndef PIT_STORAGE_H
 #define PIT_STORAGE_H
 
+// sort key modes of DmSetSortKey
+#define dmSortKeyNone   0
+#define dmSortKeyBytes  1
+#define dmSortKeyString 2
+
 void StoRemoveLocks(char *path);
 int StoInit(char *path, mutex_t *mutex);
+void StoSetContainer(int container);
+void StoSetCompress(int compress);
+void StoSetImages(int images);
+void StoSetJournal(int journal);
+void StoSetWatch(int watch);
+void StoSetRecordCache(uint32_t size);
+int StoGetStats(char *name, int event, uint64_t *count, uint64_t *amount);
+char *StoGetStatsJson(void);
+void StoResetStats(void);
+void StoInitCache(void);
+void StoFinishCache(void);
 int StoRefresh(void);
+void StoSync(void);
 int StoFinish(void);
 int StoDeleteFile(char *path);
 int StoDeployFile(char *path, AppRegistryType *ar);
@@ -23,6 +40,8 @@ MemPtr MemHandleLockEx(MemHandle h, Boolean decoded);
 void *DmResourceLoadLib(DmOpenRef dbP, DmResType resType, Boolean *firstLoad);
 MemHandle DmNewResourceEx(DmOpenRef dbP, DmResType resType, DmResID resID, UInt32 size, void *p);
 Err DmSetDirty(MemHandle handle);
+Err DmSyncDatabase(DmOpenRef dbP);
+Err DmSetSortKey(DmOpenRef dbP, UInt16 offset, UInt16 mode);
 Err DmCreateDatabaseEx(const Char *nameP, UInt32 creator, UInt32 type, UInt16 attr, UInt32 uniqueIDSeed, Boolean overwrite);
 UInt16 DmFindSortPosition68K(DmOpenRef dbP, UInt32 newRecord, UInt32 newRecordInfo, UInt32 compar, Int16 other);
 Err DmInsertionSort68K(DmOpenRef dbP, UInt32 comparF, Int16 other);
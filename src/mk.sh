@@ -52,7 +52,7 @@ do
   fi
 done
 
-for dir in libpit lua $SDL2 libpumpkin libos libshell $GUI BOOT Launcher Preferences Command Edit LuaSyntax MemoPad AddressBook ToDoList DateBook
+for dir in libpit lua $SDL2 libpumpkin libos stobench libshell $GUI BOOT Launcher Preferences Command Edit LuaSyntax MemoPad AddressBook ToDoList DateBook
 do
   if [ -d $dir ]; then
     cd $dir
@@ -0,0 +1,355 @@
+#include <PalmOS.h>
+
+#include "sys.h"
+#include "thread.h"
+#include "mutex.h"
+#include "ptr.h"
+#include "vfs.h"
+#include "vfslocal.h"
+#include "pwindow.h"
+#include "pumpkin.h"
+#include "AppRegistry.h"
+#include "storage.h"
+#include "xalloc.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Headless benchmark of the Data Manager. For each database size it creates a
+// record database, fills it, reopens it, then queries, sorts, searches, seeks
+// by category and deletes records, timing every operation. It needs no window
+// provider, so it runs from a terminal:
+//
+//   LD_LIBRARY_PATH=bin tools/stobench -n 1000,10000,60000
+//
+// All files, including the debug log, are created under a work directory,
+// stobench by default.
+
+#define BENCH_NAME     "StoBench"
+#define BENCH_KEY      16
+#define BENCH_MAX_RECS 65535
+#define BENCH_SIZES    8
+
+typedef struct {
+  char *name;
+  uint32_t *lat;
+  uint32_t num, max;
+  int64_t total;
+} bench_phase_t;
+
+static uint32_t bench_seed = 1;
+
+static uint32_t bench_rand(void) {
+  bench_seed ^= bench_seed << 13;
+  bench_seed ^= bench_seed >> 17;
+  bench_seed ^= bench_seed << 5;
+  return bench_seed;
+}
+
+static void bench_key(char *key) {
+  int i;
+
+  for (i = 0; i < BENCH_KEY - 1; i++) {
+    key[i] = 'a' + bench_rand() % 26;
+  }
+  key[i] = 0;
+}
+
+static Int16 bench_compare(void *rec1, void *rec2, Int16 other, SortRecordInfoPtr info1, SortRecordInfoPtr info2, MemHandle appInfoH) {
+  return sys_strcmp((char *)rec1, (char *)rec2);
+}
+
+static int bench_compare_lat(const void *e1, const void *e2) {
+  uint32_t a = *(uint32_t *)e1, b = *(uint32_t *)e2;
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static void bench_begin(bench_phase_t *ph, char *name, uint32_t max) {
+  ph->name = name;
+  ph->num = 0;
+  ph->max = max;
+  ph->total = 0;
+}
+
+static void bench_sample(bench_phase_t *ph, int64_t t0) {
+  int64_t dt = sys_get_clock() - t0;
+
+  if (ph->num < ph->max) {
+    ph->lat[ph->num++] = dt;
+  }
+  ph->total += dt;
+}
+
+static uint32_t bench_percentile(bench_phase_t *ph, uint32_t p) {
+  uint32_t i;
+
+  if (ph->num == 0) return 0;
+  i = (ph->num * p) / 100;
+  if (i >= ph->num) i = ph->num - 1;
+
+  return ph->lat[i];
+}
+
+static void bench_report(bench_phase_t *ph, uint32_t numRecs) {
+  double ops;
+
+  sys_qsort(ph->lat, ph->num, sizeof(uint32_t), bench_compare_lat);
+  ops = ph->total > 0 ? (double)ph->num * 1000000.0 / (double)ph->total : 0;
+
+  printf("%7u  %-8s %7u %11.1f %8u %8u %8u %8u\n", numRecs, ph->name, ph->num, ops,
+    bench_percentile(ph, 50), bench_percentile(ph, 90), bench_percentile(ph, 99), ph->num ? ph->lat[ph->num - 1] : 0);
+}
+
+static DmOpenRef bench_open(void) {
+  LocalID dbID;
+
+  if ((dbID = DmFindDatabase(0, BENCH_NAME)) == 0) return NULL;
+
+  return DmOpenDatabase(0, dbID, dmModeReadWrite);
+}
+
+static int bench_run(uint32_t numRecs, uint32_t recSize, uint32_t numQueries, uint16_t sortKey, int stats) {
+  bench_phase_t ph;
+  DmOpenRef dbRef;
+  LocalID dbID;
+  MemHandle h;
+  UInt16 index, attr, category;
+  char key[BENCH_KEY];
+  uint8_t *rec;
+  uint32_t i, n;
+  int64_t t0;
+  char *json;
+  int r = -1;
+
+  if ((dbID = DmFindDatabase(0, BENCH_NAME)) != 0) {
+    DmDeleteDatabase(0, dbID);
+  }
+
+  n = numRecs > numQueries ? numRecs : numQueries;
+  ph.lat = xcalloc(n ? n : 1, sizeof(uint32_t));
+  rec = xcalloc(1, recSize);
+  if (ph.lat == NULL || rec == NULL) goto out;
+
+  if (DmCreateDatabase(0, BENCH_NAME, 'Bnch', 'DATA', false) != errNone || (dbRef = bench_open()) == NULL) {
+    fprintf(stderr, "could not create database \"%s\"\n", BENCH_NAME);
+    goto out;
+  }
+
+  // every record starts with a random key, the rest is filler
+  bench_begin(&ph, "populate", numRecs);
+  for (i = 0; i < numRecs; i++) {
+    bench_key((char *)rec);
+    xmemset(rec + BENCH_KEY, 'a' + i % 26, recSize - BENCH_KEY);
+    t0 = sys_get_clock();
+    index = dmMaxRecordIndex;
+    if ((h = DmNewRecord(dbRef, &index, recSize)) == NULL) break;
+    DmWrite(MemHandleLock(h), 0, rec, recSize);
+    MemHandleUnlock(h);
+    attr = i % dmRecNumCategories;
+    DmSetRecordInfo(dbRef, index, &attr, NULL);
+    DmReleaseRecord(dbRef, index, true);
+    bench_sample(&ph, t0);
+  }
+  bench_report(&ph, numRecs);
+  if (sortKey) DmSetSortKey(dbRef, 0, sortKey);
+
+  bench_begin(&ph, "reopen", 1);
+  t0 = sys_get_clock();
+  DmCloseDatabase(dbRef);
+  dbRef = bench_open();
+  bench_sample(&ph, t0);
+  bench_report(&ph, numRecs);
+  if (dbRef == NULL) goto out;
+
+  bench_begin(&ph, "query", numQueries);
+  for (i = 0; i < numQueries; i++) {
+    t0 = sys_get_clock();
+    if ((h = DmQueryRecord(dbRef, bench_rand() % numRecs)) != NULL) {
+      MemHandleLock(h);
+      MemHandleUnlock(h);
+    }
+    bench_sample(&ph, t0);
+  }
+  bench_report(&ph, numRecs);
+
+  bench_begin(&ph, "sort", 1);
+  t0 = sys_get_clock();
+  DmQuickSort(dbRef, bench_compare, 0);
+  bench_sample(&ph, t0);
+  bench_report(&ph, numRecs);
+
+  bench_begin(&ph, "find", numQueries);
+  for (i = 0; i < numQueries; i++) {
+    bench_key(key);
+    t0 = sys_get_clock();
+    DmFindSortPosition(dbRef, key, NULL, bench_compare, 0);
+    bench_sample(&ph, t0);
+  }
+  bench_report(&ph, numRecs);
+
+  bench_begin(&ph, "seek", numQueries);
+  for (i = 0; i < numQueries; i++) {
+    category = bench_rand() % dmRecNumCategories;
+    index = bench_rand() % numRecs;
+    t0 = sys_get_clock();
+    DmSeekRecordInCategory(dbRef, &index, bench_rand() % 16, dmSeekForward, category);
+    bench_sample(&ph, t0);
+  }
+  bench_report(&ph, numRecs);
+
+  bench_begin(&ph, "delete", numRecs);
+  for (n = DmNumRecords(dbRef); n > 0; n--) {
+    index = bench_rand() % n;
+    t0 = sys_get_clock();
+    DmRemoveRecord(dbRef, index);
+    bench_sample(&ph, t0);
+  }
+  bench_report(&ph, numRecs);
+
+  bench_begin(&ph, "drop", 1);
+  t0 = sys_get_clock();
+  DmCloseDatabase(dbRef);
+  if ((dbID = DmFindDatabase(0, BENCH_NAME)) != 0) {
+    DmDeleteDatabase(0, dbID);
+  }
+  bench_sample(&ph, t0);
+  bench_report(&ph, numRecs);
+
+  if (stats && (json = StoGetStatsJson()) != NULL) {
+    printf("%s\n", json);
+    xfree(json);
+  }
+  StoResetStats();
+  r = 0;
+
+out:
+  if (ph.lat) xfree(ph.lat);
+  if (rec) xfree(rec);
+
+  return r;
+}
+
+static void usage(char *name) {
+  fprintf(stderr, "usage: %s [-n <records>[,<records>...]] [-s <record size>] [-q <queries>] [-k bytes|string] [-c] [-z] [-j] [-d <dir>] [-r <seed>]\n", name);
+  fprintf(stderr, "  -n  database sizes, default 1000,10000,60000 (at most %u, the number of records\n", BENCH_MAX_RECS);
+  fprintf(stderr, "      a Palm OS database can hold, so sizes such as 100000 are not possible)\n");
+  fprintf(stderr, "  -s  record size in bytes, default 64 (at least %u)\n", BENCH_KEY);
+  fprintf(stderr, "  -q  operations of the query, find and seek phases, default 10000\n");
+  fprintf(stderr, "  -k  keep a sort key of the records in the index\n");
+  fprintf(stderr, "  -c  use the container backend\n");
+  fprintf(stderr, "  -z  compress container blobs\n");
+  fprintf(stderr, "  -j  print the storage counters after each size\n");
+  fprintf(stderr, "  -d  work directory, default stobench\n");
+  fprintf(stderr, "  -r  random seed\n");
+}
+
+int main(int argc, char *argv[]) {
+  window_provider_t wp;
+  uint32_t sizes[BENCH_SIZES], numSizes, recSize, numQueries, i;
+  uint16_t sortKey;
+  int container, compress, stats, r;
+  char *dir, *s, path[VFS_PATH];
+
+  numSizes = 3;
+  sizes[0] = 1000;
+  sizes[1] = 10000;
+  sizes[2] = 60000;
+  recSize = 64;
+  numQueries = 10000;
+  sortKey = dmSortKeyNone;
+  container = 0;
+  compress = 0;
+  stats = 0;
+  dir = "stobench";
+
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0) {
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]) {
+      case 'c': container = 1; continue;
+      case 'z': compress = 1; continue;
+      case 'j': stats = 1; continue;
+      default: break;
+    }
+    if (i == argc - 1) {
+      usage(argv[0]);
+      return 1;
+    }
+    s = argv[++i];
+    switch (argv[i-1][1]) {
+      case 'n':
+        for (numSizes = 0; numSizes < BENCH_SIZES && *s; numSizes++) {
+          sizes[numSizes] = sys_strtol(s, &s, 10);
+          if (sizes[numSizes] == 0 || sizes[numSizes] > BENCH_MAX_RECS) {
+            fprintf(stderr, "invalid number of records, Palm OS databases hold at most %u records\n", BENCH_MAX_RECS);
+            return 1;
+          }
+          if (*s == ',') s++;
+        }
+        break;
+      case 's': recSize = sys_atoi(s); break;
+      case 'q': numQueries = sys_atoi(s); break;
+      case 'k':
+        if (!sys_strcmp(s, "bytes")) sortKey = dmSortKeyBytes;
+        else if (!sys_strcmp(s, "string")) sortKey = dmSortKeyString;
+        else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'd': dir = s; break;
+      case 'r': bench_seed = sys_atoi(s) ? sys_atoi(s) : 1; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (recSize < BENCH_KEY || numSizes == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  sys_init();
+
+  // the registry, the crash log and the debug log are kept in the current directory
+  sys_mkdir(dir);
+  if (sys_chdir(dir) != 0) {
+    fprintf(stderr, "could not use work directory \"%s\"\n", dir);
+    return 1;
+  }
+  debug_init("stobench.log");
+  sys_mkdir("app_storage");
+  sys_mkdir("registry");
+  sys_getcwd(path, sizeof(path) - 2);
+  sys_strcat(path, "/");
+
+  ptr_init();
+  thread_init();
+  thread_setmain();
+  vfs_init();
+  vfs_local_mount(path, "/");
+
+  StoSetContainer(container);
+  StoSetCompress(compress);
+  xmemset(&wp, 0, sizeof(wp));
+
+  if (pumpkin_global_init(NULL, &wp, NULL, NULL, NULL) != 0) {
+    fprintf(stderr, "could not initialize storage\n");
+    return 1;
+  }
+
+  printf("records  phase        ops       ops/s  p50(us)  p90(us)  p99(us)  max(us)\n");
+  for (i = 0, r = 0; i < numSizes && r == 0; i++) {
+    r = bench_run(sizes[i], recSize, numQueries, sortKey, stats);
+  }
+
+  pumpkin_global_finish();
+  vfs_finish();
+  thread_close();
+  debug_close();
+
+  return r == 0 ? 0 : 1;
+}